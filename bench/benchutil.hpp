@@ -0,0 +1,103 @@
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+
+
+// Shared helpers of the benchmark programs: timers, percentiles, process
+// counters and a minimal JSON writer for machine readable results.
+
+
+// Returns the monotonic time in nanoseconds
+inline uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// Returns the user + system CPU time of the calling process or thread in nanoseconds
+// Parameters: who - RUSAGE_SELF or RUSAGE_THREAD
+inline uint64_t bench_cpu_ns(int who = RUSAGE_SELF) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return (uint64_t(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000000ull
+           + (uint64_t(usage.ru_utime.tv_usec) + usage.ru_stime.tv_usec) * 1000ull;
+}
+
+// Returns the number of read + write syscalls done by the process so far
+// (from /proc/self/io, 0 when unavailable)
+inline uint64_t bench_syscalls() {
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t value, total = 0;
+    while (io >> key >> value) {
+        if (key == "syscr:" || key == "syscw:")
+            total += value;
+    }
+    return total;
+}
+
+// Returns the given percentile of a sample set (sorts the samples)
+// Parameters: samples - measured values
+//             percentile - between 0 and 100
+inline double bench_percentile(std::vector<double>& samples, double percentile) {
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t index = size_t(percentile / 100.0 * (samples.size() - 1) + 0.5);
+    return samples[std::min(index, samples.size() - 1)];
+}
+
+
+
+// Collects one JSON object per measurement and writes them as an array
+class BenchReport
+{
+
+public:
+
+    BenchReport(const std::string& benchmark) : benchmark(benchmark) {}
+
+    void begin() {
+        current.str("");
+        current << "{\"benchmark\":\"" << benchmark << "\"";
+    }
+    void field(const std::string& key, const std::string& value) {
+        current << ",\"" << key << "\":\"" << value << "\"";
+    }
+    void field(const std::string& key, double value) {
+        char text[64];
+        std::snprintf(text, sizeof(text), "%.6g", value);
+        current << ",\"" << key << "\":" << text;
+    }
+    void end() {
+        current << "}";
+        rows.push_back(current.str());
+    }
+    int write(const std::string& path) {
+        std::ofstream out(path);
+        if (!out)
+            return -1;
+        out << "[\n";
+        for (size_t k = 0; k < rows.size(); k++)
+            out << "  " << rows[k] << (k + 1 < rows.size() ? ",\n" : "\n");
+        out << "]\n";
+        return out.good() ? 1 : -1;
+    }
+
+private:
+
+    std::string benchmark;
+    std::ostringstream current;
+    std::vector<std::string> rows;
+
+};
@@ -0,0 +1,154 @@
+#include "benchutil.hpp"
+#include <serialbridge.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <pty.h>
+#include <unistd.h>
+
+
+// Serial bridge benchmark over two pseudo-terminal pairs: the benchmark plays
+// the controller on the master of pair A and the device on the master of
+// pair B, the bridge connects the two slaves. The direct hop (master A to
+// slave A, no bridge) is measured as the baseline.
+
+
+// Reads exactly size bytes from a descriptor
+// Returns: true if everything arrived within a second
+static bool receive(int fd, uint8_t* buffer, size_t size){
+    struct pollfd pfd = {fd, POLLIN, 0};
+    for(size_t done = 0; done < size;){
+        if(poll(&pfd, 1, 1000) <= 0)
+            return false;
+        ssize_t nbyte = read(fd, buffer + done, size - done);
+        if(nbyte <= 0)
+            return false;
+        done += nbyte;
+    }
+    return true;
+}
+
+// Writes exactly size bytes to a descriptor
+static bool send(int fd, const uint8_t* buffer, size_t size){
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    for(size_t done = 0; done < size;){
+        ssize_t nbyte = write(fd, buffer + done, size - done);
+        if(nbyte < 0 && errno == EAGAIN){
+            poll(&pfd, 1, 1000);
+            continue;
+        }
+        if(nbyte <= 0)
+            return false;
+        done += nbyte;
+    }
+    return true;
+}
+
+
+int main(int argc, char** argv){
+    std::string json = "bridgebench.json";
+    int messages = 5000;
+    size_t streamsize = 8 << 20;
+    for(int i=1;i+1<argc;i+=2){
+        std::string arg = argv[i];
+        if(arg == "--json") json = argv[i+1];
+        else if(arg == "--messages") messages = std::atoi(argv[i+1]);
+        else if(arg == "--bytes") streamsize = std::strtoul(argv[i+1], nullptr, 10);
+    }
+
+    int masters[2], slaves[2];
+    char names[2][128];
+    serialib ports[2];
+    for(int k = 0; k < 2; k++){
+        if(openpty(&masters[k], &slaves[k], names[k], nullptr, nullptr) != 0 || ports[k].openDevice(names[k], 921600) != 1){
+            std::cerr << "Cannot create pseudo-terminal" << std::endl;
+            return -1;
+        }
+    }
+    SerialBridge bridge(&ports[0], &ports[1]);
+    uint64_t tapped = 0;
+    bridge.setTap([&](SerialBridgeDirection, const uint8_t*, size_t size){ tapped += size; });
+
+    BenchReport report("bridgebench");
+    printf("%-8s %6s %9s %9s %9s %10s\n", "path", "size", "MB/s", "p50_us", "p99_us", "p999_us");
+    for(const char* path : {"direct", "bridge"}){
+        bool bridged = strcmp(path, "bridge") == 0;
+        if(bridged && bridge.start() != 1){
+            std::cerr << "Cannot start the bridge" << std::endl;
+            return -1;
+        }
+        //Direct hop: master A -> slave A read with the serialib descriptor
+        int destination = bridged ? masters[1] : ports[0].getFd();
+        for(size_t size : {1, 64, 1024}){
+            std::vector<uint8_t> payload(size, 'x'), buffer(size);
+            std::vector<double> latency;
+            latency.reserve(messages);
+            for(int k = 0; k < messages; k++){
+                uint64_t sent = bench_now_ns();
+                if(!send(masters[0], payload.data(), size) || !receive(destination, buffer.data(), size))
+                    break;
+                latency.push_back((bench_now_ns() - sent) / 1000.0);
+            }
+            double p50 = bench_percentile(latency, 50);
+            double p99 = bench_percentile(latency, 99);
+            double p999 = bench_percentile(latency, 99.9);
+            printf("%-8s %6zu %9s %9.1f %9.1f %10.1f\n", path, size, "-", p50, p99, p999);
+            report.begin();
+            report.field("path", path);
+            report.field("stage", "latency");
+            report.field("payload_bytes", size);
+            report.field("messages", latency.size());
+            report.field("p50_us", p50);
+            report.field("p99_us", p99);
+            report.field("p999_us", p999);
+            report.end();
+        }
+
+        //Throughput: one direction, the receiver drains as fast as it can
+        std::vector<uint8_t> stream(streamsize);
+        for(size_t k = 0; k < stream.size(); k++)
+            stream[k] = k & 0xff;
+        std::vector<uint8_t> received(streamsize);
+        uint64_t cpu = bench_cpu_ns();
+        uint64_t start = bench_now_ns();
+        std::thread writer([&]{ send(masters[0], stream.data(), stream.size()); });
+        bool complete = receive(destination, received.data(), received.size());
+        writer.join();
+        double elapsed = (bench_now_ns() - start) / 1e9;
+        double throughput = streamsize / elapsed / 1e6;
+        double cpu_ns = double(bench_cpu_ns() - cpu) / streamsize;
+        bool intact = complete && received == stream;
+        printf("%-8s %6s %9.1f %9s %9s %10s %s (%.1f cpu ns/B)\n", path, "stream", throughput, "-", "-", "-",
+               intact ? "intact" : "CORRUPTED", cpu_ns);
+        report.begin();
+        report.field("path", path);
+        report.field("stage", "throughput");
+        report.field("bytes", streamsize);
+        report.field("mb_per_s", throughput);
+        report.field("cpu_ns_per_byte", cpu_ns);
+        report.field("intact", intact ? 1 : 0);
+        report.end();
+    }
+    bridge.stop();
+    SerialBridgeStats stats = bridge.getStats();
+    printf("bridge: %llu bytes in %llu chunks, %llu stalls, %llu bytes tapped\n",
+           (unsigned long long)stats.bytes[BRIDGE_A_TO_B], (unsigned long long)stats.chunks[BRIDGE_A_TO_B],
+           (unsigned long long)stats.stalls[BRIDGE_A_TO_B], (unsigned long long)tapped);
+
+    for(int k = 0; k < 2; k++){
+        ports[k].closeDevice();
+        close(masters[k]);
+        close(slaves[k]);
+    }
+    if(report.write(json) != 1){
+        std::cerr << "Cannot write " << json << std::endl;
+        return -1;
+    }
+    std::cout << "Results written to " << json << std::endl;
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <usbrelay.hpp>
+#include <cstdio>
+
+#include <pty.h>
+#include <unistd.h>
+
+
+// Check that a long schedule runs in real milliseconds on a VirtualClock:
+// a day of relay commands (50 ms pacing each) and hourly power cycles with
+// their init handshake on a loopback board, then hour-long serialib
+// timeouts on a silent port. The virtual timeline must match the schedule
+// exactly and the real time stay under a second. The program exits with 1 when a check fails, it is
+// registered with ctest.
+
+
+static int failures = 0;
+
+static void check(const char* name, bool pass){
+    failures += !pass;
+    printf("%-44s %s\n", name, pass ? "ok" : "FAIL");
+}
+
+
+int main(){
+    const uint64_t hour_us = 3600ull * 1000000;
+    VirtualClock clock(0, 1); // Silent reads wait 1 real ms before jumping to their deadline
+    uint64_t realstart = systemClock().now_us();
+
+    //A day of commands, one every 10 s, and a power cycle with its handshake every hour
+    Usbrelay board(std::make_unique<LoopbackTransport>(8), 8);
+    board.setClock(&clock);
+    if(board.openCom() != 1 || board.initBoard() != 1){
+        printf("Cannot initialize loopback board\n");
+        return -1;
+    }
+    uint64_t start = clock.now_us();
+    int commands = 0, errors = 0;
+    for(uint64_t tick = start; tick < start + 24 * hour_us; tick += 10000000){
+        clock.sleepUntil_us(tick);
+        if(tick % hour_us == start % hour_us){
+            static_cast<LoopbackTransport*>(board.getTransport())->getBoard().reset();
+            errors += board.initBoard() != 1;
+        }
+        errors += board.setState(commands++ & 0xff) != 1;
+    }
+    uint64_t last = start + 24 * hour_us - 10000000;
+    check("8640 paced commands without error", commands == 8640 && errors == 0);
+    check("day ends after the last pacing delay", clock.now_us() == last + 50000);
+    check("board holds the last state", static_cast<LoopbackTransport*>(board.getTransport())->getBoard().getState()
+                                        == RelayMask((commands - 1) & 0xff));
+
+    //Hour-long timeouts on a port nobody writes to
+    int master, slave;
+    char name[128];
+    if(openpty(&master, &slave, name, nullptr, nullptr) != 0){
+        printf("Cannot create pseudo-terminal\n");
+        return -1;
+    }
+    serialib port;
+    if(port.openDevice(name, 9600) != 1){
+        printf("Cannot open %s\n", name);
+        return -1;
+    }
+    port.setClock(&clock);
+    char buffer[16];
+    uint64_t before = clock.now_us();
+    check("readChar times out after an hour", port.readChar(buffer, 3600000) == 0 && clock.now_us() == before + hour_us);
+    before = clock.now_us();
+    check("readString times out after an hour", port.readString(buffer, '\n', sizeof(buffer), 3600000) == 0
+                                                && clock.now_us() == before + hour_us);
+    before = clock.now_us();
+    check("readBytes times out after an hour", port.readBytes(buffer, sizeof(buffer), 3600000) == 0
+                                               && clock.now_us() - before >= hour_us);
+    port.closeDevice();
+    close(master);
+    close(slave);
+
+    double real = (systemClock().now_us() - realstart) / 1e6;
+    printf("simulated %.1f h in %.3f s\n", clock.now_us() / 3.6e9, real);
+    check("schedule runs in under a second", real < 1.0);
+    if(failures){
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "benchutil.hpp"
+#include <relayfleet.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+
+// Fleet benchmark: a controller recomputes the desired state of every board
+// each tick and a few boards actually change. Compares setMask on every
+// board (the current practice) with RelayFleet::commit, which writes only the
+// boards found by the packed XOR diff, on in-memory boards (loopback
+// transport) under a VirtualClock, so the 50 ms pacing of each write is
+// counted in virtual time. The diff alone is timed against a per-board
+// compare of two mask arrays.
+
+
+int main(int argc, char** argv){
+    std::string json = "fleetbench.json";
+    int boardcount = 4096;
+    int ticks = 50;
+    for(int i=1;i+1<argc;i+=2){
+        std::string arg = argv[i];
+        if(arg == "--json") json = argv[i+1];
+        else if(arg == "--boards") boardcount = std::atoi(argv[i+1]);
+        else if(arg == "--ticks") ticks = std::atoi(argv[i+1]);
+    }
+    BenchReport report("fleetbench");
+
+    VirtualClock virtualclock;
+    std::vector<std::unique_ptr<Usbrelay>> boards;
+    for(int k = 0; k < boardcount; k++){
+        boards.push_back(std::make_unique<Usbrelay>(std::make_unique<LoopbackTransport>(8), 8));
+        boards.back()->setClock(&virtualclock);
+        if(boards.back()->openCom() != 1 || boards.back()->initBoard() != 1){
+            std::cerr << "Cannot initialize loopback board " << k << std::endl;
+            return -1;
+        }
+    }
+
+    printf("%-8s %7s %10s %10s %12s %10s %10s\n", "mode", "changed", "writes/t", "avoided/t", "virtual_s/t", "diff_us", "naive_us");
+    for(double rate : {0.0, 0.001, 0.01, 0.1}){
+        std::vector<RelayMask> desired(boardcount, 0), committed(boardcount, 0);
+        for(int k = 0; k < boardcount; k++)
+            desired[k] = committed[k] = boards[k]->getMask();
+        for(const char* mode : {"all", "fleet"}){
+            RelayFleet fleet(8);
+            for(auto& board : boards)
+                fleet.addBoard(board.get());
+            fleet.commit(); //First commit writes every board
+            committed = desired;
+            std::mt19937 changes(2);
+            uint64_t writes = 0, avoided = 0;
+            uint64_t virtualstart = virtualclock.now_us();
+            double diffns = 0, naivens = 0;
+            std::vector<int> list;
+            for(int tick = 0; tick < ticks; tick++){
+                for(int k = 0; k < int(rate * boardcount + 0.5); k++) //The boards whose inputs moved
+                    desired[changes() % boardcount] ^= 1u << (changes() % 8);
+                if(mode[0] == 'a'){
+                    for(int k = 0; k < boardcount; k++)
+                        boards[k]->setMask(desired[k]);
+                    writes += boardcount;
+                    continue;
+                }
+                fleet.setDesired(desired);
+                uint64_t start = bench_now_ns();
+                fleet.diff(list);
+                diffns += bench_now_ns() - start;
+                start = bench_now_ns();
+                list.clear();
+                for(int k = 0; k < boardcount; k++) //Per board compare of two arrays
+                    if(desired[k] != committed[k])
+                        list.push_back(k);
+                naivens += bench_now_ns() - start;
+                committed = desired;
+                fleet.commit();
+                writes += fleet.getStats().lastwrites;
+                avoided += fleet.getStats().lastavoided;
+            }
+            double virtualseconds = (virtualclock.now_us() - virtualstart) / 1e6 / ticks;
+            printf("%-8s %6.1f%% %10.1f %10.1f %12.2f %10.2f %10.2f\n", mode, rate * 100, double(writes) / ticks,
+                   double(avoided) / ticks, virtualseconds, diffns / 1e3 / ticks, naivens / 1e3 / ticks);
+            report.begin();
+            report.field("mode", mode);
+            report.field("boards", boardcount);
+            report.field("change_rate", rate);
+            report.field("writes_per_tick", double(writes) / ticks);
+            report.field("avoided_per_tick", double(avoided) / ticks);
+            report.field("virtual_s_per_tick", virtualseconds);
+            report.field("diff_us", diffns / 1e3 / ticks);
+            report.field("naive_diff_us", naivens / 1e3 / ticks);
+            report.end();
+        }
+    }
+
+    if(report.write(json) != 1){
+        std::cerr << "Cannot write " << json << std::endl;
+        return -1;
+    }
+    std::cout << "Results written to " << json << std::endl;
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include <relayfleet.hpp>
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+
+// Check of RelayFleet::diff and commit on fleets of more than 128 loopback
+// boards under a VirtualClock, for slots of 2 to 32 relays (32 down to 2
+// boards per packed word; 8 relay boards in the 16 and 32 relay slots, the
+// bigger boards being hypothetical models): random changes, always including the boards at
+// the edges of the 64 bit words, of the 128 bit compares and of the per-board
+// bit vectors, must be listed exactly as a per-board compare lists them, in
+// increasing order, with the same number of relays switched. Held boards stay
+// out of the list and of the counters until released, invalidated boards are
+// listed unchanged. The program exits with 1 when a check fails, it is
+// registered with ctest.
+
+
+static int failures = 0;
+
+static void check(const char* name, bool pass){
+    failures += !pass;
+    printf("%-48s %s\n", name, pass ? "ok" : "FAIL");
+}
+
+
+int main(){
+    VirtualClock clock;
+    std::mt19937 random(49);
+    bool listed = true, counted = true, written = true, spans = true;
+    bool heldout = true, released = true, invalidated = true;
+    for(int slot : {2, 4, 8, 16, 32}){
+        int relays = std::min(slot, 8);
+        for(int count : {129, 200, 257}){
+            std::vector<std::unique_ptr<Usbrelay>> boards;
+            RelayFleet fleet(slot);
+            for(int k = 0; k < count; k++){
+                boards.push_back(std::make_unique<Usbrelay>(std::make_unique<LoopbackTransport>(relays), relays));
+                boards[k]->setClock(&clock);
+                if(boards[k]->openCom() != 1 || boards[k]->initBoard() != 1 || fleet.addBoard(boards[k].get()) != k){
+                    printf("Cannot initialize loopback board %d of %d relays\n", k, relays);
+                    return -1;
+                }
+            }
+            fleet.commit(); //Boards added are written once
+            RelayMask mask = (RelayMask(1) << relays) - 1;
+            std::vector<RelayMask> committed(count);
+            for(int k = 0; k < count; k++)
+                committed[k] = fleet.getCommitted(k);
+
+            //Boards on the edges: first and last slot of each word, around 64 and 128 boards
+            int perword = 64 / slot;
+            std::vector<int> edges = {0, 63, 64, 127, 128, count - 1};
+            for(int k = 0; k < count; k += perword){
+                edges.push_back(k);
+                edges.push_back(std::min(k + perword - 1, count - 1));
+            }
+
+            for(int round = 0; round < 20; round++){
+                std::vector<RelayMask> desired = committed;
+                for(int k = 0; k < count; k++)
+                    if(random() % 8 == 0)
+                        desired[k] = RelayMask(random()) & mask;
+                for(int k : edges)
+                    if(round % 2 == 0)
+                        desired[k] = committed[k] ^ (RelayMask(1) << (random() % relays));
+                if(round % 3 == 0){
+                    spans = spans && fleet.setDesired(std::span<const RelayMask>(desired)) == 1;
+                } else {
+                    for(int k = 0; k < count; k++)
+                        fleet.setDesired(k, desired[k]);
+                }
+                std::vector<int> expected;
+                uint64_t relayschanged = 0;
+                for(int k = 0; k < count; k++){
+                    if(desired[k] != committed[k])
+                        expected.push_back(k);
+                    relayschanged += std::popcount(desired[k] ^ committed[k]);
+                }
+                std::vector<int> list;
+                fleet.diff(list);
+                listed = listed && list == expected;
+                RelayFleetStats before = fleet.getStats();
+                int writes = fleet.commit();
+                RelayFleetStats after = fleet.getStats();
+                counted = counted && writes == (int)expected.size()
+                          && after.relayschanged - before.relayschanged == relayschanged
+                          && after.lastavoided == count - (int)expected.size();
+                for(int k = 0; k < count; k++){
+                    written = written && fleet.getCommitted(k) == desired[k]
+                              && static_cast<LoopbackTransport*>(boards[k]->getTransport())->getBoard().getState() == desired[k];
+                }
+                committed = desired;
+            }
+
+            //Held boards on both sides of a word edge stay pending and out of the counters
+            std::vector<int> holding = {63, 64, count - 1};
+            for(int k : holding){
+                fleet.hold(k, true);
+                fleet.setDesired(k, committed[k] ^ 1);
+            }
+            fleet.setDesired(1, committed[1] ^ 1);
+            std::vector<int> list;
+            fleet.diff(list);
+            heldout = heldout && list == std::vector<int>({1});
+            RelayFleetStats before = fleet.getStats();
+            fleet.commit();
+            RelayFleetStats after = fleet.getStats();
+            heldout = heldout && after.lastwrites == 1 && after.lastheld == 3 && after.lastavoided == count - 4
+                      && after.relayschanged - before.relayschanged == 1;
+            committed[1] ^= 1;
+            for(int k : holding)
+                fleet.hold(k, false);
+            fleet.diff(list);
+            released = released && list == holding;
+            fleet.commit();
+            for(int k : holding)
+                committed[k] ^= 1;
+
+            //Invalidated boards are listed with nothing changed
+            fleet.invalidate(64);
+            fleet.invalidate(count - 1);
+            fleet.diff(list);
+            invalidated = invalidated && list == std::vector<int>({64, count - 1});
+            fleet.commit();
+            fleet.diff(list);
+            invalidated = invalidated && list.empty();
+            for(auto& board : boards)
+                board->closeCom();
+        }
+    }
+    check("diff lists the changed boards in order", listed);
+    check("commit counts writes, relays and avoided", counted);
+    check("boards hold the committed state", written);
+    check("whole fleet setDesired accepted", spans);
+    check("held boards left out of diff and counters", heldout);
+    check("released boards listed", released);
+    check("invalidated boards listed once", invalidated);
+
+    if(failures){
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "benchutil.hpp"
+#include <usbrelay.hpp>
+#include <relaysim.hpp>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+
+#include <pty.h>
+#include <unistd.h>
+
+
+// CPU budget check of the idle waits of serialib and Usbrelay: every scenario
+// waits on a silent port and the CPU time (user + system, getrusage) spent by
+// the waiting thread is divided by the wall time. The program exits with 1
+// when a scenario burns more than the budget, so busy-wait regressions fail
+// the build scripts that run it.
+
+
+struct Scenario
+{
+    const char* name;
+    std::function<void()> wait;
+};
+
+
+int main(int argc, char** argv){
+    std::string json = "idlecpu.json";
+    double budget = 0.02; // CPU seconds per second of waiting
+    for(int i=1;i+1<argc;i+=2){
+        std::string arg = argv[i];
+        if(arg == "--json") json = argv[i+1];
+        else if(arg == "--budget") budget = std::atof(argv[i+1]);
+    }
+
+    int master, slave; // Silent port: nobody ever answers on the master side
+    char name[128];
+    if(openpty(&master, &slave, name, nullptr, nullptr) != 0){
+        std::cerr << "Cannot create pseudo-terminal" << std::endl;
+        return -1;
+    }
+    serialib port;
+    if(port.openDevice(name, 9600) != 1){
+        std::cerr << "Cannot open " << name << std::endl;
+        return -1;
+    }
+    Usbrelay silent(name, 8);
+    silent.openCom();
+
+    RelaySimulator simulator; // Answering board for the pacing scenario
+    simulator.start();
+    Usbrelay paced(simulator.getPort(), 8);
+    if(paced.openCom() != 1 || paced.initBoard() != 1){
+        std::cerr << "Cannot initialize simulated board" << std::endl;
+        return -1;
+    }
+
+    char buffer[64];
+    Scenario scenarios[] = {
+        {"readChar timeout", [&]{ port.readChar(buffer, 500); }},
+        {"readBytes timeout", [&]{ port.readBytes(buffer, sizeof(buffer), 500); }},
+        {"readString timeout", [&]{ port.readString(buffer, '\n', sizeof(buffer), 500); }},
+        {"initBoard no answer", [&]{ silent.initBoard(); }},
+        {"setState pacing", [&]{ for(int k = 0; k < 10; k++) paced.setState(k); }},
+    };
+
+    BenchReport report("idlecpu");
+    int failures = 0;
+    printf("%-20s %10s %10s %12s %8s\n", "scenario", "wall_ms", "cpu_ms", "cpu_per_s", "result");
+    for(auto& scenario : scenarios){
+        uint64_t cpu = bench_cpu_ns(RUSAGE_THREAD);
+        uint64_t start = bench_now_ns();
+        scenario.wait();
+        double wall = (bench_now_ns() - start) / 1e9;
+        double used = (bench_cpu_ns(RUSAGE_THREAD) - cpu) / 1e9;
+        double ratio = used / wall;
+        bool pass = ratio <= budget;
+        failures += !pass;
+        printf("%-20s %10.1f %10.3f %12.4f %8s\n", scenario.name, wall * 1000, used * 1000, ratio, pass ? "ok" : "FAIL");
+        report.begin();
+        report.field("scenario", scenario.name);
+        report.field("wall_s", wall);
+        report.field("cpu_s", used);
+        report.field("cpu_per_s", ratio);
+        report.field("budget", budget);
+        report.field("pass", pass ? 1 : 0);
+        report.end();
+    }
+
+    silent.closeCom();
+    paced.closeCom();
+    simulator.stop();
+    close(master);
+    close(slave);
+    report.write(json);
+    if(failures){
+        std::cout << failures << " scenario(s) over the CPU budget of " << budget << " s/s" << std::endl;
+        return 1;
+    }
+    return 0;
+}
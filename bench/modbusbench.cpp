@@ -0,0 +1,179 @@
+#include "benchutil.hpp"
+#include <modbussim.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+
+// Modbus RTU benchmark: CRC-16 throughput of the slicing-by-8 tables against
+// a byte table and the bitwise definition, then transactions per second
+// against simulated relay modules on a pseudo-terminal, called one at a time
+// or submitted to the bus thread for several slaves. With --virtual the
+// silent intervals run on a VirtualClock, leaving the protocol cost only.
+
+
+// Bitwise CRC-16, definition of the specification
+static uint16_t crcBitwise(const uint8_t* data, size_t size){
+    uint16_t crc = 0xffff;
+    for(size_t k = 0; k < size; k++){
+        crc ^= data[k];
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+    return crc;
+}
+
+// Classic table driven CRC-16, one lookup per byte
+static uint16_t crcBytewise(const uint8_t* data, size_t size){
+    static uint16_t table[256];
+    if(table[1] == 0)
+        for(int i = 0; i < 256; i++){
+            uint16_t crc = i;
+            for(int bit = 0; bit < 8; bit++)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+            table[i] = crc;
+        }
+    uint16_t crc = 0xffff;
+    for(size_t k = 0; k < size; k++)
+        crc = (crc >> 8) ^ table[(crc ^ data[k]) & 0xff];
+    return crc;
+}
+
+static volatile uint16_t sink;
+
+
+int main(int argc, char** argv){
+    std::string json = "modbusbench.json";
+    int transactions = 2000;
+    bool virtualtime = false;
+    for(int i=1;i<argc;i++){
+        std::string arg = argv[i];
+        if(arg == "--virtual") virtualtime = true;
+        else if(i+1 < argc && arg == "--json") json = argv[++i];
+        else if(i+1 < argc && arg == "--transactions") transactions = std::atoi(argv[++i]);
+    }
+    BenchReport report("modbusbench");
+
+    //CRC throughput on short (write single coil) and long (full RTU) frames
+    std::vector<uint8_t> data(1 << 20);
+    std::mt19937 random(1);
+    for(uint8_t& byte : data)
+        byte = random();
+    printf("%-10s %6s %9s %9s %8s\n", "crc", "frame", "MB/s", "ns/frame", "check");
+    for(size_t frame : {6, 254}){
+        for(const char* name : {"bitwise", "bytewise", "slicing8"}){
+            size_t frames = data.size() / frame;
+            int rounds = strcmp(name, "bitwise") == 0 ? 4 : 32;
+            uint16_t sum = 0;
+            uint64_t start = bench_now_ns();
+            for(int round = 0; round < rounds; round++)
+                for(size_t k = 0; k < frames; k++){
+                    const uint8_t* bytes = data.data() + k * frame;
+                    if(strcmp(name, "bitwise") == 0)
+                        sum ^= crcBitwise(bytes, frame);
+                    else if(strcmp(name, "bytewise") == 0)
+                        sum ^= crcBytewise(bytes, frame);
+                    else
+                        sum ^= modbusCrc16(bytes, frame);
+                }
+            double elapsed = (bench_now_ns() - start) / 1e9;
+            double throughput = double(rounds) * frames * frame / elapsed / 1e6;
+            double perframe = elapsed * 1e9 / (double(rounds) * frames);
+            uint16_t crc = strcmp(name, "bytewise") == 0 ? crcBytewise(data.data(), frame) : modbusCrc16(data.data(), frame);
+            bool same = crc == crcBitwise(data.data(), frame);
+            sink = sum; //Keeps the loop from being optimized out
+            printf("%-10s %6zu %9.1f %9.1f %8s\n", name, frame, throughput, perframe, same ? "ok" : "MISMATCH");
+            report.begin();
+            report.field("stage", "crc");
+            report.field("crc", name);
+            report.field("frame_bytes", double(frame));
+            report.field("mb_per_s", throughput);
+            report.field("ns_per_frame", perframe);
+            report.end();
+        }
+    }
+
+    //Transactions against 4 simulated modules of 8 relays
+    printf("\n%-8s %7s %8s %10s %10s %10s %7s\n", "mode", "baud", "gap_us", "trans/s", "p50_us", "p99_us", "errors");
+    for(unsigned int baudrate : {9600u, 115200u}){
+        ModbusSimOptions options;
+        options.slaves = 4;
+        options.baudrate = baudrate;
+        ModbusSlaveSim simulator(options);
+        if(simulator.start() != 1){
+            std::cerr << "Cannot create pseudo-terminal" << std::endl;
+            return -1;
+        }
+        for(const char* mode : {"sync", "queued"}){
+            VirtualClock virtualclock;
+            ModbusClient client(simulator.getPort(), baudrate);
+            if(virtualtime)
+                client.setClock(&virtualclock);
+            if(client.open() != 1){
+                std::cerr << "Cannot open " << simulator.getPort() << std::endl;
+                return -1;
+            }
+            bool queued = strcmp(mode, "queued") == 0;
+            if(queued)
+                client.start();
+            std::vector<ModbusRequest> requests(4);
+            std::atomic<int> completed {0};
+            int failed = 0;
+            uint64_t start = bench_now_ns();
+            for(int k = 0; k < transactions; k += 4){
+                for(int s = 0; s < 4; s++){ //One write multiple coils per module: a counter pattern
+                    ModbusRequest& request = requests[s];
+                    request.slave = options.firstslave + s;
+                    request.function = MODBUS_WRITE_MULTIPLE_COILS;
+                    request.count = 8;
+                    request.coils[0] = uint8_t(k / 4 + s);
+                    if(!queued)
+                        failed += client.transact(request) != 1;
+                    else
+                        client.submit(&request, [&](ModbusRequest&){ completed++; });
+                }
+                if(queued){ //The batch is in flight, wait for the 4 answers before reusing the requests
+                    while(completed < 4)
+                        std::this_thread::yield();
+                    completed = 0;
+                    for(ModbusRequest& request : requests)
+                        failed += request.status != 1;
+                }
+            }
+            double elapsed = (bench_now_ns() - start) / 1e9;
+            client.stop();
+            const ModbusMetrics& metrics = client.getMetrics();
+            double rate = transactions / elapsed;
+            double p50 = metrics.transaction.percentile(50);
+            double p99 = metrics.transaction.percentile(99);
+            printf("%-8s %7u %8lu %10.0f %10.0f %10.0f %7d\n", mode, baudrate, client.getFrameGap_us(), rate, p50, p99, failed);
+            report.begin();
+            report.field("stage", "bus");
+            report.field("mode", mode);
+            report.field("baudrate", double(baudrate));
+            report.field("clock", virtualtime ? "virtual" : "system");
+            report.field("transactions_per_s", rate);
+            report.field("p50_us", p50);
+            report.field("p99_us", p99);
+            report.field("queuewait_p50_us", double(metrics.queuewait.percentile(50)));
+            report.field("errors", double(failed));
+            report.end();
+            client.close();
+        }
+        ModbusSimStats stats = simulator.getStats();
+        if(stats.crcerrors || stats.partial)
+            printf("simulator: %lu CRC errors, %lu partial frames\n", stats.crcerrors, stats.partial);
+        simulator.stop();
+    }
+
+    if(report.write(json) != 1){
+        std::cerr << "Cannot write " << json << std::endl;
+        return -1;
+    }
+    std::cout << "Results written to " << json << std::endl;
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include <modbus.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <vector>
+
+
+// Check of the Modbus RTU framing and of the answer checks of ModbusClient,
+// on a scripted bus and a VirtualClock: request frames against reference
+// frames of the specification examples, modbusResponseSize and
+// modbusRequestSize on every prefix of a frame, answers split across reads,
+// the echo check of writes, exception answers, bad CRCs, answers from
+// another slave and timeouts. The program exits with 1 when a check fails,
+// it is registered with ctest.
+
+
+static int failures = 0;
+
+static void check(const char* name, bool pass){
+    failures += !pass;
+    printf("%-48s %s\n", name, pass ? "ok" : "FAIL");
+}
+
+
+typedef std::vector<uint8_t> Frame;
+
+// Appends the CRC (low byte first) to a frame
+static Frame withCrc(Frame frame){
+    uint16_t crc = modbusCrc16(frame.data(), frame.size());
+    frame.push_back(crc & 0xff);
+    frame.push_back(crc >> 8);
+    return frame;
+}
+
+
+// Bus recording the frames written and answering each one with the next
+// scripted answer, handed out in the given pieces (one per read)
+class ScriptedBus : public Transport
+{
+
+public:
+
+    int open() override { opened = true; return 1; }
+    void close() override { opened = false; }
+    bool isOpen() override { return opened; }
+
+    int write(const void* data, unsigned int size) override {
+        written.push_back(Frame((const uint8_t*)data, (const uint8_t*)data + size));
+        pieces.clear();
+        if(!answers.empty()) {
+            pieces = answers.front();
+            answers.pop_front();
+        }
+        return 1;
+    }
+
+    int read(void* buffer, unsigned int size, unsigned int timeOut_ms) override {
+        (void)timeOut_ms;
+        if(pieces.empty())
+            return 0;
+        Frame piece = pieces.front();
+        pieces.pop_front();
+        if(piece.size() > size)
+            return -1;
+        std::copy(piece.begin(), piece.end(), (uint8_t*)buffer);
+        return (int)piece.size();
+    }
+
+    // Queues the answer to the next request, cut after the given sizes
+    void answer(const Frame& frame, std::vector<size_t> cuts = {}){
+        std::deque<Frame> split;
+        size_t begin = 0;
+        cuts.push_back(frame.size());
+        for(size_t end : cuts) {
+            split.push_back(Frame(frame.begin() + begin, frame.begin() + end));
+            begin = end;
+        }
+        answers.push_back(split);
+    }
+
+    std::vector<Frame> written;
+    std::deque<std::deque<Frame>> answers;
+    std::deque<Frame> pieces;
+    bool opened = false;
+
+};
+
+
+int main(){
+    VirtualClock clock;
+    auto link = std::make_unique<ScriptedBus>();
+    ScriptedBus* bus = link.get();
+    ModbusClient client(std::move(link), 9600);
+    client.setClock(&clock);
+    if(client.open() != 1){
+        printf("Cannot open the scripted bus\n");
+        return -1;
+    }
+    const ModbusMetrics& metrics = client.getMetrics();
+
+    //Request frames of the specification examples (slave 0x11), CRC included
+    uint8_t coils[2] = {0xcd, 0x01};
+    bus->answer(withCrc({0x11, 0x01, 0x05, 0xcd, 0x6b, 0xb2, 0x0e, 0x1b}));
+    uint8_t values[5] = {};
+    int read = client.readCoils(0x11, 0x13, 0x25, values);
+    bus->answer(withCrc({0x11, 0x05, 0x00, 0xac, 0xff, 0x00}));
+    int single = client.writeSingleCoil(0x11, 0xac, true);
+    bus->answer(withCrc({0x11, 0x0f, 0x00, 0x13, 0x00, 0x0a}));
+    int multiple = client.writeMultipleCoils(0x11, 0x13, 10, coils);
+    check("read coils frame", bus->written.size() == 3
+          && bus->written[0] == Frame({0x11, 0x01, 0x00, 0x13, 0x00, 0x25, 0x0e, 0x84}));
+    check("write single coil frame", bus->written.size() == 3
+          && bus->written[1] == Frame({0x11, 0x05, 0x00, 0xac, 0xff, 0x00, 0x4e, 0x8b}));
+    check("write multiple coils frame", bus->written.size() == 3
+          && bus->written[2] == Frame({0x11, 0x0f, 0x00, 0x13, 0x00, 0x0a, 0x02, 0xcd, 0x01, 0xbf, 0x0b}));
+    check("read coils values copied", read == 1 && values[0] == 0xcd && values[1] == 0x6b
+                                      && values[2] == 0xb2 && values[3] == 0x0e && values[4] == 0x1b);
+    check("writes accepted with their echo", single == 1 && multiple == 1 && metrics.transactions == 3);
+
+    //Frame sizes from every prefix: 0 until the size is known, then the full size
+    Frame readanswer = withCrc({0x11, 0x01, 0x05, 0xcd, 0x6b, 0xb2, 0x0e, 0x1b});
+    Frame writeanswer = withCrc({0x11, 0x05, 0x00, 0xac, 0xff, 0x00});
+    Frame exception = withCrc({0x11, 0x81, MODBUS_ILLEGAL_ADDRESS});
+    Frame writerequest = bus->written[2];
+    bool sizes = true;
+    for(int size = 0; size <= (int)readanswer.size(); size++)
+        sizes = sizes && modbusResponseSize(readanswer.data(), size) == (size < 3 ? 0 : 10);
+    for(int size = 0; size <= (int)writeanswer.size(); size++)
+        sizes = sizes && modbusResponseSize(writeanswer.data(), size) == (size < 2 ? 0 : 8);
+    for(int size = 0; size <= (int)exception.size(); size++)
+        sizes = sizes && modbusResponseSize(exception.data(), size) == (size < 2 ? 0 : 5);
+    check("modbusResponseSize on every prefix", sizes);
+    uint8_t unknown[2] = {0x11, 0x03};
+    check("unknown function has no size", modbusResponseSize(unknown, 2) == -1 && modbusRequestSize(unknown, 2) == -1);
+    sizes = true;
+    for(int size = 0; size <= (int)writerequest.size(); size++)
+        sizes = sizes && modbusRequestSize(writerequest.data(), size) == (size < 7 ? 0 : 11);
+    check("modbusRequestSize on every prefix", sizes && modbusRequestSize(bus->written[0].data(), 2) == 8);
+
+    //Answer split across reads, one byte at a time for the size bytes
+    bus->answer(readanswer, {1, 2, 3, 6});
+    values[0] = 0;
+    check("answer split across reads", client.readCoils(0x11, 0x13, 0x25, values) == 1 && values[0] == 0xcd);
+
+    //Writes whose echo differs from the request are refused
+    bus->answer(withCrc({0x11, 0x05, 0x00, 0xad, 0xff, 0x00}));
+    bool echo = client.writeSingleCoil(0x11, 0xac, true) == -1;
+    bus->answer(withCrc({0x11, 0x05, 0x00, 0xac, 0x00, 0x00}));
+    echo = echo && client.writeSingleCoil(0x11, 0xac, true) == -1;
+    bus->answer(withCrc({0x11, 0x0f, 0x00, 0x13, 0x00, 0x09}));
+    echo = echo && client.writeMultipleCoils(0x11, 0x13, 10, coils) == -1;
+    check("wrong echo refused", echo && metrics.transactions == 4);
+
+    //Exception answer: the code is kept and counted, the request fails
+    ModbusRequest request;
+    request.slave = 0x11;
+    request.function = MODBUS_READ_COILS;
+    request.address = 0x1000;
+    request.count = 8;
+    bus->answer(exception);
+    int status = client.transact(request);
+    check("exception answer fails the request", status == -1 && request.status == -1);
+    check("exception code kept and counted", request.exception == MODBUS_ILLEGAL_ADDRESS && metrics.exceptions == 1);
+    bus->answer(readanswer);
+    request.count = 0x25;
+    check("exception code cleared by the next answer", client.transact(request) == 1 && request.exception == 0);
+
+    //Bad CRC, answer from another slave, truncated answer, no answer
+    uint64_t crcerrors = metrics.crcerrors;
+    Frame corrupt = writeanswer;
+    corrupt.back() ^= 0x01;
+    bus->answer(corrupt);
+    bool refused = client.writeSingleCoil(0x11, 0xac, true) == -1;
+    bus->answer(withCrc({0x12, 0x05, 0x00, 0xac, 0xff, 0x00}));
+    refused = refused && client.writeSingleCoil(0x11, 0xac, true) == -1;
+    bus->answer(Frame(writeanswer.begin(), writeanswer.end() - 1));
+    refused = refused && client.writeSingleCoil(0x11, 0xac, true) == -1;
+    check("bad CRC, other slave, truncated refused", refused && metrics.crcerrors == crcerrors + 3);
+    uint64_t timeouts = metrics.timeouts;
+    check("no answer is a timeout", client.writeSingleCoil(0x11, 0xac, true) == -1 && metrics.timeouts == timeouts + 1);
+
+    //Broadcast: written, never answered, not waited for
+    size_t frames = bus->written.size();
+    check("broadcast write succeeds unanswered", client.writeSingleCoil(MODBUS_BROADCAST, 0xac, true) == 1
+                                                 && bus->written.size() == frames + 1 && metrics.broadcasts == 1);
+
+    client.close();
+    if(failures){
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
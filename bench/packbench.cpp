@@ -0,0 +1,114 @@
+#include "benchutil.hpp"
+#include <relaypack.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+
+// Relay pack benchmark: fleet states converted between per-relay values and
+// masks with the bulk packRelays/unpackRelays calls against the per-relay
+// loops they replace (the shift-or of setState(int*), the shift-and-test
+// of printStatus), for byte, bool and int values.
+
+
+static volatile RelayMask sink;
+
+// Per-relay packing loop of setState(int*)
+template <typename T>
+static void packLoop(const T* values, int relays, RelayMask* masks, size_t boards){
+    for(size_t board = 0; board < boards; board++){
+        RelayMask state = 0;
+        for(int k = 0; k < relays; k++)
+            state |= RelayMask(values[board * relays + k] != 0) << k;
+        masks[board] = state;
+    }
+}
+
+// Per-relay unpacking loop of printStatus
+template <typename T>
+static void unpackLoop(const RelayMask* masks, int relays, T* values, size_t boards){
+    for(size_t board = 0; board < boards; board++){
+        RelayMask state = masks[board];
+        for(int k = 0; k < relays; k++){
+            values[board * relays + k] = state & 1;
+            state >>= 1;
+        }
+    }
+}
+
+// Times one conversion of the whole fleet repeated rounds times
+// Returns: nanoseconds per relay
+template <typename F>
+static double timeRelays(F&& convert, int rounds, size_t relays){
+    convert(); //Warm up
+    uint64_t start = bench_now_ns();
+    for(int round = 0; round < rounds; round++)
+        convert();
+    return double(bench_now_ns() - start) / (double(rounds) * relays);
+}
+
+template <typename T>
+static void run(BenchReport& report, const char* type, int relays, size_t boards, int rounds){
+    std::mt19937 random(relays);
+    size_t total = boards * relays;
+    std::unique_ptr<T[]> values(new T[total]), unpacked(new T[total]), looped(new T[total]); //No std::vector<bool>
+    for(size_t k = 0; k < total; k++)
+        values[k] = T(random() % 3 == 0 ? 0 : (random() % 2) + 1); //Some values other than 1 are on too
+    std::vector<RelayMask> loopmasks(boards), bulkmasks(boards);
+
+    double packloop = timeRelays([&]{ packLoop(values.get(), relays, loopmasks.data(), boards); }, rounds, total);
+    double packbulk = timeRelays([&]{ packRelays(std::span<const T>(values.get(), total), relays, std::span<RelayMask>(bulkmasks)); }, rounds, total);
+    bool packok = loopmasks == bulkmasks;
+    double unpackloop = timeRelays([&]{ unpackLoop(bulkmasks.data(), relays, unpacked.get(), boards); }, rounds, total);
+    std::copy(unpacked.get(), unpacked.get() + total, looped.get());
+    double unpackbulk = timeRelays([&]{ unpackRelays(std::span<const RelayMask>(bulkmasks), relays, std::span<T>(unpacked.get(), total)); }, rounds, total);
+    bool unpackok = std::equal(looped.get(), looped.get() + total, unpacked.get());
+    sink = bulkmasks[boards / 2];
+
+    printf("%-6s %6d %9.3f %9.3f %7.1fx %9.3f %9.3f %7.1fx %s\n", type, relays, packloop, packbulk, packloop / packbulk,
+           unpackloop, unpackbulk, unpackloop / unpackbulk, packok && unpackok ? "ok" : "MISMATCH");
+    report.begin();
+    report.field("type", type);
+    report.field("relays", relays);
+    report.field("boards", double(boards));
+    report.field("pack_loop_ns_per_relay", packloop);
+    report.field("pack_bulk_ns_per_relay", packbulk);
+    report.field("unpack_loop_ns_per_relay", unpackloop);
+    report.field("unpack_bulk_ns_per_relay", unpackbulk);
+    report.field("match", packok && unpackok ? "yes" : "no");
+    report.end();
+}
+
+
+int main(int argc, char** argv){
+    std::string json = "packbench.json";
+    size_t boards = 65536;
+    int rounds = 50;
+    for(int i=1;i+1<argc;i+=2){
+        std::string arg = argv[i];
+        if(arg == "--json") json = argv[i+1];
+        else if(arg == "--boards") boards = std::strtoul(argv[i+1], nullptr, 10);
+        else if(arg == "--rounds") rounds = std::atoi(argv[i+1]);
+    }
+    BenchReport report("packbench");
+
+    //ns per relay; 24 relays boards do not share 64 bit words and take the per board path
+    printf("%-6s %6s %9s %9s %8s %9s %9s %8s\n", "type", "relays", "pack", "bulk", "speedup", "unpack", "bulk", "speedup");
+    for(int relays : {8, 16, 24, 32}){
+        run<uint8_t>(report, "uint8", relays, boards, rounds);
+        run<bool>(report, "bool", relays, boards, rounds);
+        run<int>(report, "int", relays, boards, rounds);
+    }
+
+    if(report.write(json) != 1){
+        std::cerr << "Cannot write " << json << std::endl;
+        return -1;
+    }
+    std::cout << "Results written to " << json << std::endl;
+    return 0;
+}
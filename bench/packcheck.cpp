@@ -0,0 +1,123 @@
+#include <relaypack.hpp>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+
+// Check of packRelays/unpackRelays against the per-relay loops for byte,
+// bool and int values, every board size from 1 to 32 relays and odd board
+// counts, so the 64 bit shared conversions, the 16/8 value blocks and their
+// tails are all crossed. Byte and int values include nonzero values other
+// than 1 (int ones with a zero low byte), unpacked masks have bits set above
+// the relays, and the entries around the output must stay untouched. The
+// program exits with 1 when a check fails, it is registered with ctest.
+
+
+static int failures = 0;
+
+static void check(const char* name, bool pass){
+    failures += !pass;
+    printf("%-44s %s\n", name, pass ? "ok" : "FAIL");
+}
+
+
+static const size_t guard = 16; // Entries checked on each side of an output
+
+// Random value, nonzero ones not always 1
+template <typename T>
+static T randomValue(std::mt19937& random){
+    switch(random() % 4){
+        case 0:
+        case 1:
+            return T(0);
+        case 2:
+            return T(1);
+    }
+    if constexpr (std::is_same_v<T, bool>)
+        return true;
+    else if constexpr (std::is_same_v<T, int>)
+        return int(random() % 3 == 0 ? 0x100 : random() | 1);
+    else
+        return T(2 + random() % 254);
+}
+
+// Compares both conversions with the per-relay loops for one board size
+// and board count
+// Returns: true if they agree and nothing outside the outputs was written
+template <typename T>
+static bool agree(std::mt19937& random, int relays, size_t boards){
+    size_t total = boards * relays;
+    std::unique_ptr<T[]> values(new T[total]);  //No std::vector<bool>
+    for(size_t k = 0; k < total; k++)
+        values[k] = randomValue<T>(random);
+
+    //Pack: one mask per board, bit k = relay k+1 nonzero
+    std::vector<RelayMask> masks(boards + 2 * guard, 0xa5a5a5a5);
+    std::span<RelayMask> packed(masks.data() + guard, boards);
+    if(packRelays(std::span<const T>(values.get(), total), relays, packed) != 1)
+        return false;
+    for(size_t board = 0; board < boards; board++){
+        RelayMask state = 0;
+        for(int k = 0; k < relays; k++)
+            state |= RelayMask(values[board * relays + k] != 0) << k;
+        if(packed[board] != state)
+            return false;
+    }
+    for(size_t k = 0; k < guard; k++)
+        if(masks[k] != 0xa5a5a5a5 || masks[guard + boards + k] != 0xa5a5a5a5)
+            return false;
+
+    //Unpack: random masks with bits above the relays, which must be ignored
+    std::vector<RelayMask> states(boards);
+    for(RelayMask& state : states)
+        state = RelayMask(random());
+    std::unique_ptr<T[]> output(new T[total + 2 * guard]);
+    for(size_t k = 0; k < total + 2 * guard; k++)
+        output[k] = T(7);
+    std::span<T> unpacked(output.get() + guard, total);
+    if(unpackRelays(std::span<const RelayMask>(states), relays, unpacked) != 1)
+        return false;
+    for(size_t board = 0; board < boards; board++)
+        for(int k = 0; k < relays; k++)
+            if(unpacked[board * relays + k] != T((states[board] >> k) & 1))
+                return false;
+    for(size_t k = 0; k < guard; k++)
+        if(output[k] != T(7) || output[guard + total + k] != T(7))
+            return false;
+    return true;
+}
+
+template <typename T>
+static void checkType(const char* name, std::mt19937& random){
+    bool pass = true;
+    for(int relays = 1; relays <= 32; relays++)
+        for(size_t boards : {1, 3, 5, 7, 9, 15, 33, 127})
+            pass = agree<T>(random, relays, boards) && pass;
+    char label[64];
+    snprintf(label, sizeof(label), "%s values match the per-relay loops", name);
+    check(label, pass);
+}
+
+
+int main(){
+    std::mt19937 random(48);
+    checkType<uint8_t>("byte", random);
+    checkType<bool>("bool", random);
+    checkType<int>("int", random);
+
+    //Sizes that do not match are refused
+    uint8_t values[24] = {};
+    RelayMask masks[3] = {};
+    check("size mismatch refused", packRelays(std::span<const uint8_t>(values, 23), 8, masks) == -1
+                                   && unpackRelays(std::span<const RelayMask>(masks, 2), 8, values) == -1);
+    check("relay count out of range refused", packRelays(std::span<const uint8_t>(values, 0), 0, std::span<RelayMask>()) == -1
+                                              && unpackRelays(std::span<const RelayMask>(masks, 0), 33, std::span<uint8_t>()) == -1);
+
+    if(failures){
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,185 @@
+#include "benchutil.hpp"
+#include <patterntrigger.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <pty.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// Pattern trigger benchmark: the Aho-Corasick scan against a naive
+// compare-every-pattern-at-every-offset loop in memory, then a pty stream
+// read byte per byte with readChar against burst reads with readAvailable.
+
+
+// Builds a status stream: random log text with one pattern every ~200 bytes
+// Returns: the number of patterns inserted
+static int makeStream(std::vector<uint8_t>& stream, const std::vector<std::string>& patterns, size_t size){
+    std::mt19937 random(1);
+    const char filler[] = "abcdefghijklmnopqrstuvwxyz 0123456789=:,\n";
+    int inserted = 0;
+    stream.clear();
+    while(stream.size() < size){
+        for(int k = random() % 400; k > 0; k--)
+            stream.push_back(filler[random() % (sizeof(filler) - 1)]);
+        const std::string& pattern = patterns[random() % patterns.size()];
+        stream.insert(stream.end(), pattern.begin(), pattern.end());
+        inserted++;
+    }
+    return inserted;
+}
+
+// Naive matcher: compares every pattern at every offset
+static int naiveScan(const std::vector<uint8_t>& stream, const std::vector<std::string>& patterns){
+    int found = 0;
+    for(size_t k = 0; k < stream.size(); k++)
+        for(const std::string& pattern : patterns)
+            if(k + pattern.size() <= stream.size() && memcmp(&stream[k], pattern.data(), pattern.size()) == 0)
+                found++;
+    return found;
+}
+
+// Pattern set of the given size: status words followed by generated tags
+static std::vector<std::string> makePatterns(int count){
+    std::vector<std::string> patterns = {"ALARM", "READY", "FAULT", "DOOR OPEN", "OVERTEMP", "E-STOP", "RESET", "BUSY"};
+    for(int k = patterns.size(); k < count; k++)
+        patterns.push_back("TAG" + std::to_string(1000 + k));
+    patterns.resize(count);
+    return patterns;
+}
+
+
+int main(int argc, char** argv){
+    std::string json = "patternbench.json";
+    size_t streamsize = 4 << 20;
+    for(int i=1;i+1<argc;i+=2){
+        std::string arg = argv[i];
+        if(arg == "--json") json = argv[i+1];
+        else if(arg == "--bytes") streamsize = std::strtoul(argv[i+1], nullptr, 10);
+    }
+    BenchReport report("patternbench");
+
+    //In memory scan
+    printf("%-10s %8s %9s %10s %8s\n", "matcher", "patterns", "MB/s", "ns/byte", "matches");
+    for(int count : {2, 8, 32}){
+        std::vector<std::string> patterns = makePatterns(count);
+        std::vector<uint8_t> stream;
+        int expected = makeStream(stream, patterns, streamsize);
+        PatternMatcher matcher;
+        for(const std::string& pattern : patterns)
+            matcher.addPattern(pattern);
+        matcher.compile();
+        for(const char* name : {"naive", "automaton"}){
+            uint64_t start = bench_now_ns();
+            int found;
+            if(strcmp(name, "naive") == 0)
+                found = naiveScan(stream, patterns);
+            else
+                found = matcher.scan(stream.data(), stream.size(), [](int, size_t){});
+            double elapsed = (bench_now_ns() - start) / 1e9;
+            double throughput = stream.size() / elapsed / 1e6;
+            printf("%-10s %8d %9.1f %10.2f %8d%s\n", name, count, throughput, elapsed * 1e9 / stream.size(),
+                   found, found == expected ? "" : " (mismatch)");
+            report.begin();
+            report.field("stage", "memory");
+            report.field("matcher", name);
+            report.field("patterns", count);
+            report.field("mb_per_s", throughput);
+            report.field("matches", found);
+            report.field("expected", expected);
+            report.end();
+        }
+    }
+
+    //Stream over a pseudo-terminal, matches split across reads included
+    std::vector<std::string> patterns = makePatterns(8);
+    std::vector<uint8_t> stream;
+    int expected = makeStream(stream, patterns, streamsize / 4);
+    printf("\n%-14s %9s %10s %11s %8s\n", "reader", "MB/s", "cpu_ns/B", "sys/KB", "matches");
+    for(const char* mode : {"readChar", "readAvailable"}){
+        int master, slave;
+        char name[128];
+        int start[2];
+        if(openpty(&master, &slave, name, nullptr, nullptr) != 0 || pipe(start) != 0){
+            std::cerr << "Cannot create pseudo-terminal" << std::endl;
+            return -1;
+        }
+        serialib port;
+        if(port.openDevice(name, 921600) != 1){
+            std::cerr << "Cannot open " << name << std::endl;
+            return -1;
+        }
+        pid_t child = fork();
+        if(child == 0){ //Writer: waits for the reader, then sends the whole stream
+            char go;
+            if(read(start[0], &go, 1) != 1)
+                _exit(1);
+            for(size_t done = 0; done < stream.size();){
+                int written = write(master, stream.data() + done, std::min<size_t>(stream.size() - done, 1024));
+                if(written <= 0)
+                    _exit(1);
+                done += written;
+            }
+            pause();
+            _exit(0);
+        }
+        PatternMatcher matcher;
+        for(const std::string& pattern : patterns)
+            matcher.addPattern(pattern);
+        matcher.compile();
+        std::vector<uint8_t> buffer(4096);
+        size_t received = 0;
+        int found = 0;
+        uint64_t syscalls = bench_syscalls();
+        uint64_t cpu = bench_cpu_ns();
+        uint64_t begin = bench_now_ns();
+        if(write(start[1], "g", 1) != 1)
+            return -1;
+        while(received < stream.size()){
+            int nbyte;
+            if(strcmp(mode, "readChar") == 0)
+                nbyte = port.readChar((char*)buffer.data(), 1000);
+            else
+                nbyte = port.readAvailable(buffer.data(), buffer.size(), 1000);
+            if(nbyte <= 0)
+                break;
+            found += matcher.scan(buffer.data(), nbyte, [](int, size_t){});
+            received += nbyte;
+        }
+        double elapsed = (bench_now_ns() - begin) / 1e9;
+        double cpu_ns = double(bench_cpu_ns() - cpu) / received;
+        double syscallsPerKB = double(bench_syscalls() - syscalls) * 1024 / received;
+        double throughput = received / elapsed / 1e6;
+        printf("%-14s %9.2f %10.1f %11.1f %8d%s\n", mode, throughput, cpu_ns, syscallsPerKB, found,
+               found == expected ? "" : " (mismatch)");
+        report.begin();
+        report.field("stage", "pty");
+        report.field("reader", mode);
+        report.field("mb_per_s", throughput);
+        report.field("cpu_ns_per_byte", cpu_ns);
+        report.field("syscalls_per_kb", syscallsPerKB);
+        report.field("matches", found);
+        report.field("expected", expected);
+        report.end();
+        kill(child, SIGTERM);
+        waitpid(child, nullptr, 0);
+        port.closeDevice();
+        close(master);
+        close(slave);
+        close(start[0]);
+        close(start[1]);
+    }
+
+    if(report.write(json) != 1){
+        std::cerr << "Cannot write " << json << std::endl;
+        return -1;
+    }
+    std::cout << "Results written to " << json << std::endl;
+    return 0;
+}
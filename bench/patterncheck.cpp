@@ -0,0 +1,129 @@
+#include <patterntrigger.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Check of the Aho-Corasick PatternMatcher against a naive scan: random
+// pattern sets over a small alphabet (so patterns overlap, nest and share
+// suffixes) matched on random text, whole and cut into random chunks to
+// cross the scan() calls. Every (pattern, end offset) pair must be reported
+// exactly as often as the naive scan finds it. The program exits with 1 when
+// a check fails, it is registered with ctest.
+
+
+static int failures = 0;
+
+static void check(const char* name, bool pass){
+    failures += !pass;
+    printf("%-44s %s\n", name, pass ? "ok" : "FAIL");
+}
+
+
+typedef std::vector<std::pair<int, size_t>> Matches; // (pattern id, end offset in the text)
+
+// Every occurrence of every pattern, by end offset then id (the order of the automaton)
+static Matches naive(const std::vector<std::string>& patterns, const std::string& text){
+    Matches found;
+    for(size_t end = 1; end <= text.size(); end++){
+        std::vector<std::pair<size_t, int>> ending; // Longest first, as the dictionary links go
+        for(size_t id = 0; id < patterns.size(); id++){
+            const std::string& pattern = patterns[id];
+            if(pattern.size() <= end && text.compare(end - pattern.size(), pattern.size(), pattern) == 0)
+                ending.push_back({pattern.size(), (int)id});
+        }
+        std::sort(ending.rbegin(), ending.rend());
+        for(auto& entry : ending)
+            found.push_back({entry.second, end});
+    }
+    return found;
+}
+
+// Matches of the automaton, the text cut at the given offsets
+static Matches scanned(PatternMatcher& matcher, const std::string& text, const std::vector<size_t>& cuts){
+    Matches found;
+    size_t begin = 0;
+    matcher.reset();
+    for(size_t k = 0; k <= cuts.size(); k++){
+        size_t end = k < cuts.size() ? cuts[k] : text.size();
+        matcher.scan((const uint8_t*)text.data() + begin, end - begin, [&](int id, size_t offset){
+            found.push_back({id, begin + offset});
+        });
+        begin = end;
+    }
+    return found;
+}
+
+static std::string randomString(std::mt19937& random, size_t length, int alphabet){
+    std::string text(length, 'a');
+    for(char& byte : text)
+        byte = char('a' + random() % alphabet);
+    return text;
+}
+
+
+int main(){
+    std::mt19937 random(2024);
+
+    //Random sets over 2 to 4 letters, 2 to 32 patterns of 1 to 6 bytes
+    bool whole = true, chunked = true;
+    int rounds = 0;
+    for(int alphabet = 2; alphabet <= 4; alphabet++){
+        for(int count : {2, 5, 12, 32}){
+            for(int trial = 0; trial < 20; trial++, rounds++){
+                PatternMatcher matcher;
+                std::vector<std::string> patterns;
+                for(int k = 0; k < count; k++){
+                    std::string pattern = randomString(random, 1 + random() % 6, alphabet);
+                    int id = matcher.addPattern(pattern);
+                    if(id == (int)patterns.size())
+                        patterns.push_back(pattern);
+                }
+                matcher.compile();
+                std::string text = randomString(random, 512, alphabet);
+                Matches expected = naive(patterns, text);
+                whole = whole && scanned(matcher, text, {}) == expected;
+                std::vector<size_t> cuts;
+                for(size_t cut = random() % 8; cut < text.size(); cut += 1 + random() % 8)
+                    cuts.push_back(cut);
+                chunked = chunked && scanned(matcher, text, cuts) == expected;
+            }
+        }
+    }
+    printf("%d random pattern sets\n", rounds);
+    check("matches equal the naive scan", whole);
+    check("matches equal across scan() chunks", chunked);
+
+    //Patterns nested in each other, reported at the same end offset
+    PatternMatcher nested;
+    for(const char* pattern : {"ALARM", "LARM", "ARM", "RM", "M"})
+        nested.addPattern(pattern);
+    nested.compile();
+    Matches all = scanned(nested, "xALARMx", {});
+    check("nested patterns all reported", all == Matches({{0, 6}, {1, 6}, {2, 6}, {3, 6}, {4, 6}}));
+
+    //A duplicate keeps its id, nothing can be added once compiled
+    PatternMatcher rules;
+    int first = rules.addPattern("READY");
+    bool duplicate = rules.addPattern("FAULT") == 1 && rules.addPattern("READY") == first;
+    rules.compile();
+    check("duplicate pattern keeps its id", duplicate && rules.getPatternCount() == 2);
+    check("no pattern added after compile", rules.addPattern("OTHER") == -1);
+
+    //reset() forgets a pattern prefix left by the previous stream
+    int found = 0;
+    rules.reset();
+    rules.scan((const uint8_t*)"REA", 3, [&](int, size_t){ found++; });
+    rules.reset();
+    rules.scan((const uint8_t*)"DY", 2, [&](int, size_t){ found++; });
+    check("reset forgets a split prefix", found == 0);
+
+    if(failures){
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include <relayreconciler.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+
+// Check of the RelayReconciler recovery paths on loopback boards driven by a
+// VirtualClock, so the retry and resync intervals pass instantly: a failed
+// write reopens the board after the retry interval and reasserts its state
+// without the init handshake, boardReset() runs the handshake again, and the
+// resync rewrites every relay of every board once per interval, LCUS boards
+// included. The program exits with 1 when a check fails, it is registered
+// with ctest.
+
+
+static int failures = 0;
+
+static void check(const char* name, bool pass){
+    failures += !pass;
+    printf("%-48s %s\n", name, pass ? "ok" : "FAIL");
+}
+
+
+// Loopback board recording the state it holds after every write
+class WatchedLoopback : public LoopbackTransport
+{
+
+public:
+
+    using LoopbackTransport::LoopbackTransport;
+
+    int write(const void* data, unsigned int size) override {
+        int status = LoopbackTransport::write(data, size);
+        states.push_back(this->getBoard().getState());
+        return status;
+    }
+
+    // Returns true if every state held since the last call is one of allowed
+    bool heldOnly(std::initializer_list<RelayMask> allowed){
+        bool only = std::all_of(states.begin(), states.end(), [&](RelayMask state){
+            return std::find(allowed.begin(), allowed.end(), state) != allowed.end();
+        });
+        states.clear();
+        return only;
+    }
+
+    std::vector<RelayMask> states;
+
+};
+
+
+int main(){
+    const int count = 5;
+    const int lcus = count - 1; // Last board speaks LCUS, the others the 0x50/0x51 protocol
+    VirtualClock clock;
+    std::vector<std::unique_ptr<Usbrelay>> boards;
+    std::vector<WatchedLoopback*> links;
+    RelayReconciler reconciler(8);
+    reconciler.setClock(&clock);
+    reconciler.setRetryInterval(1000);
+    reconciler.setResyncInterval(0);
+    for(int k = 0; k < count; k++){
+        RelayProtocol protocol = k == lcus ? RELAY_PROTOCOL_LCUS : RELAY_PROTOCOL_MASK;
+        auto link = std::make_unique<WatchedLoopback>(8, protocol);
+        links.push_back(link.get());
+        boards.push_back(std::make_unique<Usbrelay>(std::move(link), 8));
+        boards[k]->setProtocol(protocol);
+        boards[k]->setClock(&clock);
+        if(boards[k]->openCom() != 1 || boards[k]->initBoard() != 1){
+            printf("Cannot initialize loopback board %d\n", k);
+            return -1;
+        }
+        reconciler.addBoard(boards[k].get());
+    }
+    auto simulated = [&](int k){ return links[k]->getBoard().getState(); };
+    auto handshakes = [&](int k){ return boards[k]->getMetrics().inithandshake.getCount(); };
+    auto sent = [&](int k){ return boards[k]->getSerialMetrics().bytestx.load(); };
+    auto initial = [](int k){ return RelayMask(0x11) << (k % 4); };
+
+    for(int k = 0; k < count; k++)
+        reconciler.setDesired(k, initial(k));
+    reconciler.step();
+    bool applied = reconciler.isConverged();
+    for(int k = 0; k < count; k++)
+        applied = applied && simulated(k) == initial(k);
+    check("initial state applied", applied);
+    check("converged pass writes nothing", reconciler.step() == 0);
+
+    //Failed write: the board is held out, then reopened and reasserted after the retry interval
+    links[1]->states.clear();
+    boards[1]->closeCom();
+    reconciler.setDesired(1, 0x03);
+    reconciler.step();
+    RelayReconcilerStats stats = reconciler.getStats();
+    check("failed write counted", stats.failures == 1 && !reconciler.isConverged());
+    clock.advance_us(500000);
+    reconciler.step();
+    check("no reconnect before the retry interval", reconciler.getStats().reconnects == 0);
+    clock.advance_us(600000);
+    uint64_t before = handshakes(1);
+    reconciler.step();
+    stats = reconciler.getStats();
+    check("reopened after the retry interval", stats.reconnects == 1 && boards[1]->getTransport()->isOpen());
+    check("no handshake sent to a powered board", handshakes(1) == before);
+    check("desired state reasserted", simulated(1) == 0x03 && reconciler.isConverged());
+    check("only the old or new state held", links[1]->heldOnly({0x22, 0x03}));
+
+    //Power cycle: boardReset() runs the handshake again before the state is reasserted
+    links[2]->getBoard().reset();
+    links[2]->states.clear();
+    reconciler.boardReset(2);
+    before = handshakes(2);
+    reconciler.step();
+    check("boardReset runs the handshake", handshakes(2) == before + 1 && links[2]->getBoard().isReady()
+                                            && reconciler.getStats().reconnects == 2);
+    check("state reasserted after the reset", simulated(2) == initial(2) && reconciler.isConverged());
+    check("only the reset or desired state held", links[2]->heldOnly({0x00, 0x44}));
+
+    //Resync: every relay of each board rewritten once per interval, nothing changed on the host side
+    std::vector<uint64_t> bytes(count);
+    for(int k = 0; k < count; k++)
+        bytes[k] = sent(k);
+    uint64_t resyncs = reconciler.getStats().resyncs;
+    reconciler.setResyncInterval(1000);
+    uint64_t start = clock.now_us();
+    for(int interval = 1; interval <= 3; interval++){
+        //First rewrites one interval after the change, spread over the next one
+        uint64_t end = start + (interval + 1) * 1000000ull - 1;
+        while(clock.now_us() < end){
+            clock.sleepUntil_us(std::min(reconciler.nextDeadline_us(), end));
+            reconciler.step();
+        }
+        bool once = reconciler.getStats().resyncs - resyncs == uint64_t(interval * count);
+        for(int k = 0; k < count; k++){
+            uint64_t command = k == lcus ? 4 * 8 : 1; // One frame per relay on LCUS boards
+            once = once && sent(k) - bytes[k] == interval * command;
+        }
+        check(interval == 1 ? "resync rewrites each board once" : "resync repeats once per interval", once);
+    }
+
+    //Drift: an LCUS board that lost its relays behind the host's back is restored by the resync
+    links[lcus]->getBoard().reset();
+    uint64_t end = clock.now_us() + 1000000;
+    while(clock.now_us() < end){
+        clock.sleepUntil_us(std::min(reconciler.nextDeadline_us(), end));
+        reconciler.step();
+    }
+    check("resync restores a drifted LCUS board", simulated(lcus) == initial(lcus));
+
+    for(auto& board : boards)
+        board->closeCom();
+    if(failures){
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include "benchutil.hpp"
+#include <usbrelay.hpp>
+#include <relaysim.hpp>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// End-to-end latency of Usbrelay commands against a simulated board, split
+// into the stages recorded by Usbrelay::getTiming(): encoding, writeChar
+// syscall, pacing wait and receive path. With --virtual the pacing waits run
+// on a VirtualClock so that only the CPU and I/O stages remain; --wire enables
+// output queue tracking and adds the write-to-wire stage. --transport selects
+// the link to the simulated board: pty (default), tcp (local socket), rfc2217
+// (local socket with telnet COM-PORT-OPTION framing) or loopback (in-memory
+// board, no I/O: protocol logic only). --protocol selects the board
+// protocol: mask (default, one frame per state) or lcus (one 4 bytes frame per
+// relay changed, batched in one write).
+
+
+struct StageSamples
+{
+    std::vector<double> total, encode, write, pacing, receive, wire;
+};
+
+// Runs one operation repeatedly and records its stage timing
+// Parameters: relay - board under test
+//             iterations - number of calls
+//             operation - the call to measure, returns 1 on success
+static StageSamples measure(Usbrelay& relay, int iterations, const std::function<int()>& operation){
+    StageSamples samples;
+    for(int k = 0; k < iterations; k++){
+        uint64_t start = bench_now_ns();
+        if(operation() != 1){
+            std::cerr << "Command failed" << std::endl;
+            continue;
+        }
+        samples.total.push_back((bench_now_ns() - start) / 1000.0);
+        const RelayTiming& timing = relay.getTiming();
+        samples.encode.push_back(timing.encode_ns / 1000.0);
+        samples.write.push_back(timing.write_ns / 1000.0);
+        samples.pacing.push_back(timing.pacing_ns / 1000.0);
+        samples.receive.push_back(timing.receive_ns / 1000.0);
+        if(timing.wire_ns)
+            samples.wire.push_back(timing.wire_ns / 1000.0);
+    }
+    return samples;
+}
+
+// Prints and records the percentiles of every stage of one operation
+static void summarize(BenchReport& report, const std::string& operation, StageSamples& samples){
+    struct { const char* name; std::vector<double>* values; } stages[] = {
+        {"total", &samples.total}, {"encode", &samples.encode}, {"write", &samples.write},
+        {"pacing", &samples.pacing}, {"receive", &samples.receive}, {"wire", &samples.wire}};
+    for(auto& stage : stages){
+        if(stage.values->empty())
+            continue;
+        double p50 = bench_percentile(*stage.values, 50);
+        double p99 = bench_percentile(*stage.values, 99);
+        double max = bench_percentile(*stage.values, 100);
+        printf("%-14s %-8s %12.2f %12.2f %12.2f\n", operation.c_str(), stage.name, p50, p99, max);
+        report.begin();
+        report.field("operation", operation);
+        report.field("stage", stage.name);
+        report.field("samples", stage.values->size());
+        report.field("p50_us", p50);
+        report.field("p99_us", p99);
+        report.field("max_us", max);
+        report.end();
+    }
+}
+
+
+int main(int argc, char** argv){
+    std::string json = "relaybench.json";
+    int iterations = 40;
+    bool virtualtime = false;
+    bool wire = false;
+    std::string transport = "pty";
+    std::string protocol = "mask";
+    for(int i=1;i<argc;i++){
+        std::string arg = argv[i];
+        if(arg == "--virtual") virtualtime = true;
+        else if(arg == "--wire") wire = true;
+        else if(arg == "--json" && i+1 < argc) json = argv[++i];
+        else if(arg == "--iterations" && i+1 < argc) iterations = std::atoi(argv[++i]);
+        else if(arg == "--transport" && i+1 < argc) transport = argv[++i];
+        else if(arg == "--protocol" && i+1 < argc) protocol = argv[++i];
+    }
+
+    RelaySimOptions options;
+    options.protocol = protocol == "lcus" ? RELAY_PROTOCOL_LCUS : RELAY_PROTOCOL_MASK;
+    RelaySimulator simulator(options);
+    bool loopback = transport == "loopback";
+    int started = loopback ? 1 : transport == "tcp" ? simulator.startTcp() : transport == "rfc2217" ? simulator.startRfc2217() : simulator.start();
+    if(started != 1){
+        std::cerr << "Cannot start simulator" << std::endl;
+        return -1;
+    }
+    VirtualClock virtualclock;
+    std::unique_ptr<Usbrelay> board = loopback ? std::make_unique<Usbrelay>(std::make_unique<LoopbackTransport>(8, options.protocol), 8)
+                                               : std::make_unique<Usbrelay>(simulator.getPort(), 8);
+    Usbrelay& relay = *board;
+    relay.setProtocol(options.protocol);
+    if(virtualtime)
+        relay.setClock(&virtualclock);
+    relay.setWireTracking(wire);
+    if(relay.openCom() != 1 || relay.initBoard() != 1){
+        std::cerr << "Cannot initialize simulated board" << std::endl;
+        return -1;
+    }
+
+    BenchReport report("relaybench");
+    printf("transport: %s protocol: %s\n", transport.c_str(), protocol.c_str());
+    printf("%-14s %-8s %12s %12s %12s\n", "operation", "stage", "p50_us", "p99_us", "max_us");
+
+    int value = 0;
+    uint64_t bytes = relay.getSerialMetrics().bytestx;
+    StageSamples samples = measure(relay, iterations, [&]{ return relay.setState(++value & 0xff); });
+    summarize(report, "setState(int)", samples);
+    printf("%-14s %-8s %12.2f\n", "setState(int)", "bytes", (double)(relay.getSerialMetrics().bytestx - bytes) / iterations);
+
+    int commandarray[8] = {0};
+    samples = measure(relay, iterations, [&]{
+        commandarray[value++ & 7] ^= 1;
+        return relay.setState(commandarray);
+    });
+    summarize(report, "setState(int*)", samples);
+
+    samples = measure(relay, std::max(1, iterations / 8), [&]{
+        if(loopback) // The board answers 0x50 only after a power cycle
+            static_cast<LoopbackTransport*>(relay.getTransport())->getBoard().reset();
+        else
+            simulator.powerCycle();
+        return relay.initBoard();
+    });
+    summarize(report, "initBoard", samples);
+
+    std::vector<double> getstate;
+    volatile char sink = 0;
+    for(int k = 0; k < iterations * 100; k++){
+        uint64_t start = bench_now_ns();
+        sink = sink + relay.getState();
+        getstate.push_back((bench_now_ns() - start) / 1000.0);
+    }
+    StageSamples state;
+    state.total = getstate;
+    summarize(report, "getState", state);
+
+    relay.closeCom();
+    simulator.stop();
+    if(report.write(json) != 1){
+        std::cerr << "Cannot write " << json << std::endl;
+        return -1;
+    }
+    std::cout << "Results written to " << json << std::endl;
+    return 0;
+}
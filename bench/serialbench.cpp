@@ -0,0 +1,153 @@
+#include "benchutil.hpp"
+#include <serialib.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <pty.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+// Round-trip benchmark of serialib over a pseudo-terminal: a forked child
+// echoes every byte written on the slave side, the parent measures the
+// serialib read and write paths.
+
+
+// Echo loop of the child process, runs until the parent kills it
+static void echo(int master){
+    char buffer[4096];
+    while(true){
+        int nbyte = read(master, buffer, sizeof(buffer));
+        if(nbyte <= 0)
+            _exit(0);
+        for(int done = 0; done < nbyte;){
+            int written = write(master, buffer + done, nbyte - done);
+            if(written <= 0)
+                _exit(0);
+            done += written;
+        }
+    }
+}
+
+// Receives one echoed message with the requested serialib function
+// Returns: true if the whole message came back
+static bool receive(serialib& port, const std::string& mode, char* buffer, unsigned int size){
+    if(mode == "readBytes")
+        return port.readBytes(buffer, size, 1000) == (int)size;
+    if(mode == "readChar"){
+        for(unsigned int k = 0; k < size; k++)
+            if(port.readChar(&buffer[k], 1000) != 1)
+                return false;
+        return true;
+    }
+    if(mode == "readString")
+        return port.readString(buffer, '\n', size + 1, 1000) == (int)size;
+    if(mode == "available"){ //Poll the receive queue, then fetch everything at once
+        uint64_t deadline = bench_now_ns() + 1000000000ull;
+        while(port.available() < (int)size)
+            if(bench_now_ns() > deadline)
+                return false;
+        return port.readBytes(buffer, size, 1000) == (int)size;
+    }
+    return false;
+}
+
+
+int main(int argc, char** argv){
+    std::string json = "serialbench.json";
+    int messages = 2000;
+    for(int i=1;i+1<argc;i+=2){
+        std::string arg = argv[i];
+        if(arg == "--json") json = argv[i+1];
+        else if(arg == "--messages") messages = std::atoi(argv[i+1]);
+    }
+
+    int master, slave;
+    char name[128];
+    if(openpty(&master, &slave, name, nullptr, nullptr) != 0){
+        std::cerr << "Cannot create pseudo-terminal" << std::endl;
+        return -1;
+    }
+    pid_t child = fork();
+    if(child == 0){
+        close(slave);
+        echo(master);
+    }
+    close(master);
+
+    BenchReport report("serialbench");
+    const unsigned int bauds[] = {9600, 115200, 921600};
+    const unsigned int sizes[] = {1, 16, 256, 4000};
+    const char* modes[] = {"readBytes", "readChar", "readString", "available"};
+    printf("%-11s %7s %6s %9s %9s %9s %9s %10s %9s\n", "mode", "baud", "size", "MB/s", "sys/msg",
+           "cpu_us", "p50_us", "p99_us", "p999_us");
+
+    for(unsigned int baud : bauds){
+        serialib port;
+        if(port.openDevice(name, baud) != 1){
+            std::cerr << "Cannot open " << name << std::endl;
+            kill(child, SIGTERM);
+            return -1;
+        }
+        for(const char* mode : modes){
+            for(unsigned int size : sizes){
+                std::vector<char> payload(size, 'x');
+                std::vector<char> buffer(size + 1);
+                payload[size - 1] = '\n';
+                int count = size >= 256 ? messages / 4 : messages;
+                std::vector<double> latency;
+                latency.reserve(count);
+                uint64_t syscalls = bench_syscalls();
+                uint64_t cpu = bench_cpu_ns();
+                uint64_t start = bench_now_ns();
+                int failures = 0;
+                for(int k = 0; k < count; k++){
+                    uint64_t sent = bench_now_ns();
+                    if(port.writeBytes(payload.data(), size) != 1 || !receive(port, mode, buffer.data(), size)){
+                        failures++;
+                        port.flushReceiver();
+                        continue;
+                    }
+                    latency.push_back((bench_now_ns() - sent) / 1000.0);
+                }
+                double elapsed = (bench_now_ns() - start) / 1e9;
+                double cpu_us = (bench_cpu_ns() - cpu) / 1000.0 / count;
+                double syscallsPerMessage = double(bench_syscalls() - syscalls) / count;
+                double throughput = double(size) * latency.size() / elapsed / 1e6;
+                double p50 = bench_percentile(latency, 50);
+                double p99 = bench_percentile(latency, 99);
+                double p999 = bench_percentile(latency, 99.9);
+                printf("%-11s %7u %6u %9.3f %9.1f %9.2f %9.1f %10.1f %9.1f\n", mode, baud, size, throughput,
+                       syscallsPerMessage, cpu_us, p50, p99, p999);
+                report.begin();
+                report.field("mode", mode);
+                report.field("baud", baud);
+                report.field("payload_bytes", size);
+                report.field("messages", count);
+                report.field("failures", failures);
+                report.field("mb_per_s", throughput);
+                report.field("syscalls_per_msg", syscallsPerMessage);
+                report.field("cpu_us_per_msg", cpu_us);
+                report.field("p50_us", p50);
+                report.field("p99_us", p99);
+                report.field("p999_us", p999);
+                report.end();
+            }
+        }
+        port.closeDevice();
+    }
+
+    kill(child, SIGTERM);
+    waitpid(child, nullptr, 0);
+    if(report.write(json) != 1){
+        std::cerr << "Cannot write " << json << std::endl;
+        return -1;
+    }
+    std::cout << "Results written to " << json << std::endl;
+    return 0;
+}
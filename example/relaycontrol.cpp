@@ -5,12 +5,13 @@
 
 void printStatus(Usbrelay *usbrelay){ //Format for terminal usb board relays status
     std::cout<<"=====Board Status====="<<std::endl;
-    char status= usbrelay->getState();
+    RelayMask status= usbrelay->getMask();
     int relaynumber = usbrelay->getRelayNumber();
+    uint8_t kstates[32];
+    unpackRelays(std::span<const RelayMask>(&status, 1), relaynumber, std::span<uint8_t>(kstates, relaynumber)); //One bulk unpack
 
     for(int i=1;i<=relaynumber;i++){
-        int kstate = status & 1;
-        status = status >> 1; 
+        int kstate = kstates[i-1];
         if(kstate){
             std::cout<<"K"+std::to_string(i)+": "+"ON"<<std::endl;
         }
@@ -0,0 +1,88 @@
+#include <relaymux.hpp>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+
+static volatile std::sig_atomic_t stopped = 0;
+
+static void onSignal(int){
+    stopped = 1;
+}
+
+static void usage(){
+    std::cout << "usage: relaymux device [-n relays] [-c clients] [-l linkprefix]" << std::endl;
+}
+
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        usage();
+        return -1;
+    }
+    std::string device = argv[1];
+    int relaynumber = 8;
+    int clients = 4;
+    std::string linkprefix;
+    for(int i=2;i<argc;i++){ //Parse command line
+        std::string arg = argv[i];
+        if(i+1 >= argc){
+            usage();
+            return -1;
+        }
+        if(arg == "-n") relaynumber = std::atoi(argv[++i]);
+        else if(arg == "-c") clients = std::atoi(argv[++i]);
+        else if(arg == "-l") linkprefix = argv[++i];
+        else{
+            usage();
+            return -1;
+        }
+    }
+
+    Usbrelay board(device, relaynumber);
+    if(board.openCom()!=1 || board.initBoard()!=1){
+        std::cout << "Cannot initialize the board on " << device << std::endl;
+        return -1;
+    }
+    RelayMux mux(&board, clients);
+    if(mux.start()!=1){
+        std::cout << "Cannot create pseudo-terminals" << std::endl;
+        return -1;
+    }
+    for(int k=0;k<mux.getClientCount();k++){ //Stable names for the tools, e.g. /run/relay0
+        std::string port = mux.getClientPort(k);
+        if(!linkprefix.empty()){
+            std::string link = linkprefix + std::to_string(k);
+            unlink(link.c_str());
+            if(symlink(port.c_str(), link.c_str())!=0)
+                std::cout << "Cannot create " << link << std::endl;
+            else
+                port = link + " -> " + port;
+        }
+        std::cout << port << std::endl;
+    }
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    int laststate = -1;
+    while(!stopped){ //Print every merged state until interrupted
+        int state = mux.getShadowState();
+        if(state != laststate){
+            std::cout << "state 0x" << std::hex << state << std::dec << std::endl;
+            laststate = state;
+        }
+        usleep(10000);
+    }
+    mux.stop();
+
+    RelayMuxStats stats = mux.getStats();
+    std::cout << "=====Multiplexer Stats=====" << std::endl;
+    std::cout << "commands:" << stats.commands << " writes:" << stats.writes << " coalesced:" << stats.coalesced
+              << " connects:" << stats.connects << " failures:" << stats.failures << std::endl;
+    for(int k=0;k<mux.getClientCount() && !linkprefix.empty();k++)
+        unlink((linkprefix + std::to_string(k)).c_str());
+    board.closeCom();
+    return 0;
+}
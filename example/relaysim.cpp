@@ -0,0 +1,78 @@
+#include <relaysim.hpp>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+
+static volatile std::sig_atomic_t stopped = 0;
+
+static void onSignal(int){
+    stopped = 1;
+}
+
+static void usage(){
+    std::cout << "usage: relaysim [-n relays] [-c chained] [-P mask|lcus] [-b boards] [-g mingap_us] [-d replydelay_us] [-p droprate]" << std::endl;
+}
+
+
+int main(int argc, char** argv){
+    RelaySimOptions options;
+    int boards = 1;
+    for(int i=1;i<argc;i++){ //Parse command line
+        std::string arg = argv[i];
+        if(i+1 >= argc){
+            usage();
+            return -1;
+        }
+        if(arg == "-n") options.relaynumber = std::atoi(argv[++i]);
+        else if(arg == "-c") options.boards = std::atoi(argv[++i]); //Boards chained on each port
+        else if(arg == "-P") options.protocol = std::string(argv[++i]) == "lcus" ? RELAY_PROTOCOL_LCUS : RELAY_PROTOCOL_MASK;
+        else if(arg == "-b") boards = std::atoi(argv[++i]);
+        else if(arg == "-g") options.mingap_us = std::strtoul(argv[++i], nullptr, 10);
+        else if(arg == "-d") options.replydelay_us = std::strtoul(argv[++i], nullptr, 10);
+        else if(arg == "-p") options.droprate = std::atof(argv[++i]);
+        else{
+            usage();
+            return -1;
+        }
+    }
+
+    std::vector<std::unique_ptr<RelaySimulator>> fleet; //One pseudo-terminal per simulated board
+    for(int k=0;k<boards;k++){
+        options.seed = k + 1;
+        fleet.push_back(std::make_unique<RelaySimulator>(options));
+        if(fleet.back()->start()!=1){
+            std::cout << "Cannot create pseudo-terminal" << std::endl;
+            return -1;
+        }
+        std::cout << fleet.back()->getPort() << std::endl;
+    }
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    std::vector<int> laststate(boards, -1);
+    while(!stopped){ //Print every state change until interrupted
+        for(int k=0;k<boards;k++){
+            int state = fleet[k]->getState();
+            if(state != laststate[k]){
+                std::cout << fleet[k]->getPort() << " state 0x" << std::hex << state << std::dec << std::endl;
+                laststate[k] = state;
+            }
+        }
+        usleep(10000);
+    }
+
+    std::cout << "=====Simulator Stats=====" << std::endl;
+    for(auto& board : fleet){
+        RelaySimStats stats = board->getStats();
+        std::cout << board->getPort() << " bytes:" << stats.bytes << " commands:" << stats.commands
+                  << " gapviolations:" << stats.gapviolations << " dropped:" << stats.dropped << std::endl;
+        board->stop();
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+
+
+// Time source used by Usbrelay and serialib for pacing and timeouts.
+// All values are microseconds on a monotonic timeline whose origin is
+// implementation defined.
+class Clock
+{
+
+public:
+
+    virtual ~Clock() = default;
+    virtual uint64_t now_us() = 0;
+    virtual void sleep_us(uint64_t microseconds) = 0;
+    // Longest real-time wait (in ms) an I/O wait may block before it gives up
+    // and lets the clock jump to the deadline. A real clock waits the whole
+    // remaining time, a virtual clock only a short grace period.
+    virtual int ioWait_ms(int remaining_ms) { return remaining_ms; }
+    void sleep_ms(unsigned long milliseconds) { sleep_us(uint64_t(milliseconds) * 1000); }
+    void sleepUntil_us(uint64_t deadline);
+
+};
+
+
+
+// Wall time backed by the OS monotonic clock, default clock of the library
+class SystemClock : public Clock
+{
+
+public:
+
+    uint64_t now_us() override;
+    void sleep_us(uint64_t microseconds) override;
+
+};
+
+
+
+// Simulated time: sleeping advances the clock instantly to the deadline, so a
+// 24 hour schedule runs in a few milliseconds and always yields the same
+// timeline. Safe to share between threads; concurrent sleepers each move the
+// clock forward to their own deadline.
+class VirtualClock : public Clock
+{
+
+public:
+
+    VirtualClock(uint64_t start_us = 0, int iograce_ms = 20);
+    uint64_t now_us() override;
+    void sleep_us(uint64_t microseconds) override;
+    int ioWait_ms(int remaining_ms) override;
+    void advance_us(uint64_t microseconds);
+    void set_us(uint64_t time);
+
+private:
+
+    std::atomic<uint64_t> current;
+    int iograce;
+
+};
+
+// Clock used when none is given explicitly
+Clock& systemClock();
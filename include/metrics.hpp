@@ -0,0 +1,65 @@
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+
+
+// Lock-free latency histogram with HDR-style log-linear buckets: values below
+// 8 µs get one bucket each, every power of two above is split in 8 buckets,
+// so a value is stored with less than 12.5% error up to ~76 hours.
+// Recording is two relaxed atomic additions, cheap enough for production.
+class LatencyHistogram
+{
+
+public:
+
+    static constexpr int SUBBUCKETS = 8;
+    static constexpr int MAXEXPONENT = 38;
+    static constexpr int BUCKETS = SUBBUCKETS + (MAXEXPONENT - 2) * SUBBUCKETS;
+
+    void record(uint64_t value_us);
+    uint64_t getCount() const;
+    uint64_t getSum_us() const;
+    uint64_t getBucketCount(int bucket) const;
+    uint64_t countBelow(uint64_t bound_us) const;
+    uint64_t percentile(double percentile) const;
+    static int bucketOf(uint64_t value_us);
+    static uint64_t bucketUpper(int bucket);
+
+private:
+
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> count {0};
+    std::atomic<uint64_t> sum {0};
+
+};
+
+
+
+// Counters of one serial port, updated by serialib
+struct SerialMetrics
+{
+    std::atomic<uint64_t> bytestx {0};
+    std::atomic<uint64_t> bytesrx {0};
+    std::atomic<uint64_t> timeouts {0};
+    std::atomic<uint64_t> errors {0};
+    LatencyHistogram readwait; // time spent in read calls until data or timeout
+};
+
+// Counters of one relay board, updated by Usbrelay
+struct RelayMetrics
+{
+    std::atomic<uint64_t> commands {0};
+    std::atomic<uint64_t> coalesced {0}; // commands merged into another one or skipped as unchanged
+    std::atomic<uint64_t> timeouts {0};
+    std::atomic<uint64_t> errors {0};
+    LatencyHistogram submittowire;  // command submitted until the byte is handed to the OS
+    LatencyHistogram inithandshake; // whole initBoard sequence
+    LatencyHistogram submittoactuation; // command submitted until the byte left the output queue (wire tracking)
+};
+
+// Relaxed increment used on the recording side
+inline void metricAdd(std::atomic<uint64_t>& counter, uint64_t value = 1) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+}
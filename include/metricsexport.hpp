@@ -0,0 +1,64 @@
+
+#pragma once
+#include <usbrelay.hpp>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+
+// Collects the counters of several boards and serial ports and renders them
+// in the Prometheus text exposition format (version 0.0.4).
+class MetricsRegistry
+{
+
+public:
+
+    void addBoard(Usbrelay* relay, const std::string& name = "");
+    void addSerial(serialib* port, const std::string& name);
+    void remove(const std::string& name);
+    std::string render();
+    int writeTextfile(const std::string& path);
+
+private:
+
+    struct Entry
+    {
+        std::string name;
+        Usbrelay* relay;
+        serialib* port;
+    };
+    std::mutex lock;
+    std::vector<Entry> entries;
+
+};
+
+
+
+// Minimal HTTP endpoint answering every request with the registry snapshot
+// (POSIX only, one connection at a time, meant for a local scraper)
+class MetricsServer
+{
+
+public:
+
+    MetricsServer(MetricsRegistry& registry, int port, const std::string& address = "127.0.0.1");
+    ~MetricsServer();
+    int start();
+    void stop();
+    int getPort();
+
+private:
+
+    void run();
+    MetricsRegistry& registry;
+    int port;
+    std::string address;
+    int listener = -1;
+    int wakeup[2] = {-1, -1};
+    std::atomic<bool> running {false};
+    std::thread worker;
+
+};
@@ -0,0 +1,172 @@
+
+#pragma once
+#include <transport.hpp>
+#include <relayboard.hpp>
+#include <metrics.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+
+
+// Modbus RTU (RS-485 relay modules): function codes, CRC-16 and timing shared
+// by the client and the simulated slaves.
+
+enum ModbusFunction
+{
+    MODBUS_READ_COILS = 0x01,
+    MODBUS_WRITE_SINGLE_COIL = 0x05,
+    MODBUS_WRITE_MULTIPLE_COILS = 0x0f
+};
+
+enum ModbusException
+{
+    MODBUS_ILLEGAL_FUNCTION = 0x01,
+    MODBUS_ILLEGAL_ADDRESS = 0x02,
+    MODBUS_ILLEGAL_VALUE = 0x03
+};
+
+static constexpr int MODBUS_MAX_FRAME = 256;   // RTU frame limit, CRC included
+static constexpr int MODBUS_MAX_COILS = 1968;  // write multiple coils limit (read: 2000)
+static constexpr uint8_t MODBUS_BROADCAST = 0; // slave address of unanswered writes
+
+// Returns the Modbus CRC-16 (reflected 0x8005, initial 0xffff) of a frame,
+// computed 8 bytes per step with slicing-by-8 tables
+uint16_t modbusCrc16(const uint8_t* data, size_t size);
+
+// Returns the silent interval ending a frame (3.5 characters, 1750 us above 19200 baud)
+unsigned long modbusFrameGap_us(unsigned int baudrate);
+
+// Returns the size of a response from its first bytes
+// Returns: the frame size with CRC, 0 if more bytes are needed, -1 for an unknown function
+int modbusResponseSize(const uint8_t* frame, int size);
+
+// Returns the size of a request from its first bytes, see modbusResponseSize
+int modbusRequestSize(const uint8_t* frame, int size);
+
+
+
+// One transaction: coils address..address+count-1 of a slave. For writes
+// coils holds the values to send (bit k of byte k/8 = coil address+k), for
+// reads it receives the values.
+struct ModbusRequest
+{
+    uint8_t slave = 1;
+    uint8_t function = MODBUS_READ_COILS;
+    uint16_t address = 0;
+    uint16_t count = 1;
+    uint8_t coils[(MODBUS_MAX_COILS + 7) / 8] = {};
+    int status = 0;         // 1 done, -1 failed (timeout, CRC, exception), 0 pending
+    uint8_t exception = 0;  // exception code answered by the slave, 0 if none
+};
+
+// Counters of one bus, updated by ModbusClient
+struct ModbusMetrics
+{
+    std::atomic<uint64_t> transactions {0};
+    std::atomic<uint64_t> broadcasts {0};
+    std::atomic<uint64_t> timeouts {0};
+    std::atomic<uint64_t> crcerrors {0};  // answers with a bad CRC, truncated or from another slave
+    std::atomic<uint64_t> exceptions {0};
+    LatencyHistogram transaction;         // request written until the answer is checked
+    LatencyHistogram queuewait;           // submitted until the bus took the request
+};
+
+
+
+// Modbus RTU master on one bus. Requests are run one at a time with the
+// 3.5 characters silent interval before each frame. Called directly they run
+// in the caller's thread; after start() a bus thread runs the requests
+// submitted to any slave in order, back to back, and direct calls wait for
+// their turn in the same queue.
+class ModbusClient
+{
+
+public:
+
+    ModbusClient(const std::string& device, unsigned int baudrate = 9600);
+    ModbusClient(std::unique_ptr<Transport> transport, unsigned int baudrate = 9600);
+    ~ModbusClient();
+    int open();
+    void close();
+    int start();
+    void stop();
+    int submit(ModbusRequest* request, std::function<void(ModbusRequest&)> done = nullptr);
+    int transact(ModbusRequest& request);
+    int writeSingleCoil(uint8_t slave, uint16_t coil, bool on);
+    int writeMultipleCoils(uint8_t slave, uint16_t first, uint16_t count, const uint8_t* values);
+    int readCoils(uint8_t slave, uint16_t first, uint16_t count, uint8_t* values);
+    void setClock(Clock* clock);
+    void setTimeout(unsigned int timeOut_ms);
+    void setBroadcastDelay(unsigned int delay_ms);
+    unsigned long getFrameGap_us();
+    const ModbusMetrics& getMetrics();
+    Transport* getTransport();
+
+private:
+
+    struct Pending
+    {
+        ModbusRequest* request;
+        std::function<void(ModbusRequest&)> done;
+        uint64_t submitted;
+    };
+
+    void run();
+    int execute(ModbusRequest& request);
+    int exchange(ModbusRequest& request, const uint8_t* frame, int size, uint8_t* answer);
+    std::string device;
+    unsigned int baudrate;
+    std::unique_ptr<Transport> bus;
+    Clock* clock = &systemClock();
+    unsigned int timeout_ms = 100;         // answer timeout
+    unsigned int broadcastdelay_ms = 100;  // turnaround after a broadcast
+    unsigned long framegap_us;
+    unsigned long chartime_us;
+    uint64_t idlesince = 0;                // end of the last bus activity
+    ModbusMetrics metrics;
+    std::mutex buslock;                    // one transaction at a time without the bus thread
+    std::mutex lock;
+    std::condition_variable queued;
+    std::deque<Pending> queue;
+    std::atomic<bool> running {false};
+    std::thread worker;
+
+};
+
+
+
+// Relay module on a Modbus bus, driven with the Usbrelay calls: relay k+1 is
+// coil firstcoil+k. A change of one relay is a write single coil, any other
+// change a write multiple coils of every relay.
+class ModbusRelay
+{
+
+public:
+
+    ModbusRelay(ModbusClient* bus, uint8_t slave, int relaynumber = 8, uint16_t firstcoil = 0);
+    int initBoard();
+    int setState(int state);
+    int setMask(RelayMask state);
+    int updateMask(RelayMask setmask, RelayMask clearmask);
+    char getState();
+    RelayMask getMask();
+    int getRelayNumber();
+    uint8_t getSlave();
+
+private:
+
+    ModbusClient* bus;
+    uint8_t slave;
+    int relaynumber;
+    uint16_t firstcoil;
+    RelayMask mask;
+    RelayMask state = 0;
+    bool stateknown = false;
+
+};
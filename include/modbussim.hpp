@@ -0,0 +1,70 @@
+
+#pragma once
+#include <modbus.hpp>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+
+// Behaviour of a simulated Modbus bus
+struct ModbusSimOptions
+{
+    uint8_t firstslave = 1;          // address of the first relay module
+    int slaves = 1;                  // modules at firstslave, firstslave+1...
+    int coils = 8;                   // coils of each module, 1 to 32
+    unsigned int baudrate = 9600;    // sets the silent interval that ends a partial frame
+    unsigned long replydelay_us = 0; // delay injected before every answer
+};
+
+// Counters of a simulated bus
+struct ModbusSimStats
+{
+    unsigned long requests = 0;      // valid frames addressed to a module
+    unsigned long replies = 0;
+    unsigned long exceptions = 0;
+    unsigned long broadcasts = 0;
+    unsigned long crcerrors = 0;     // frames with a bad CRC, ignored
+    unsigned long partial = 0;       // frames cut by a silent interval, ignored
+    unsigned long otheraddress = 0;  // valid frames for a module not simulated
+};
+
+
+
+// Modbus RTU relay modules behind a pseudo-terminal: open getPort() with
+// ModbusClient as if it was an RS-485 adapter (Linux only). Every module
+// answers read coils, write single coil and write multiple coils; other
+// functions get an illegal function exception.
+class ModbusSlaveSim
+{
+
+public:
+
+    ModbusSlaveSim(const ModbusSimOptions& options = ModbusSimOptions());
+    ~ModbusSlaveSim();
+    int start();
+    void stop();
+    std::string getPort();
+    RelayMask getCoils(uint8_t slave);
+    bool waitCoils(uint8_t slave, RelayMask coils, unsigned long milliseconds);
+    ModbusSimStats getStats();
+
+private:
+
+    void run();
+    void process(const uint8_t* frame, int size);
+    int answer(RelayMask& coils, const uint8_t* frame, uint8_t* reply);
+    ModbusSimOptions options;
+    std::vector<RelayMask> coils;    // state of each module
+    ModbusSimStats stats;
+    std::mutex lock;
+    std::thread worker;
+    std::atomic<bool> running {false};
+    std::string port;
+    int master = -1;
+    int slave = -1;
+    int wakeup[2] = {-1, -1};
+
+};
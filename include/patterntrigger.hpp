@@ -0,0 +1,110 @@
+
+#pragma once
+#include <usbrelay.hpp>
+#include <relaywriter.hpp>
+#include <atomic>
+#include <thread>
+
+
+
+// Aho-Corasick automaton over bytes, compiled into a dense transition table
+// (one lookup per input byte whatever the number of patterns). The current
+// state is kept between scan() calls, so a pattern split across two reads
+// is still found.
+class PatternMatcher
+{
+
+public:
+
+    int addPattern(const std::string& pattern);
+    int compile();
+    void reset();
+    int getPatternCount();
+    int getStateCount();
+    const std::string& getPattern(int id);
+
+    // Feeds bytes to the automaton
+    // Parameters: data, size - bytes to scan
+    //             onmatch - called as onmatch(id, end) for each match, end being
+    //                       the offset in data just after the last byte of the match
+    // Returns: the number of matches
+    template <typename F>
+    int scan(const uint8_t* data, size_t size, F&& onmatch) {
+        int found = 0;
+        int32_t current = state;
+        const int32_t* table = next.data();
+        for (size_t k = 0; k < size; k++) {
+            current = table[((size_t)current << 8) | data[k]];
+            for (int32_t m = match[current]; m; m = dictlink[m]) {
+                onmatch(output[m], k + 1);
+                found++;
+            }
+        }
+        state = current;
+        return found;
+    }
+
+private:
+
+    std::vector<std::string> patterns;
+    std::vector<int32_t> next;      // states x 256 transitions
+    std::vector<int32_t> output;    // pattern ending at the state, -1 if none
+    std::vector<int32_t> match;     // the state or its closest suffix state with an output, 0 if none
+    std::vector<int32_t> dictlink;  // next suffix state with an output after match[state]
+    int32_t state = 0;
+    bool compiled = false;
+
+};
+
+
+
+// Relay change fired when a pattern is seen in the stream
+struct PatternRule
+{
+    std::string pattern;
+    Usbrelay* relay;
+    RelayMask setmask;   // relays switched on (bit k = relay k+1)
+    RelayMask clearmask; // relays switched off
+};
+
+
+
+// Scans the bytes received on a serial port for status strings ("ALARM",
+// "READY", ...) on a dedicated thread and applies the relay masks of the
+// matching rules. Reads take whole bursts (readAvailable), so the cost per
+// byte is a table lookup rather than a readChar call. The masks of all the
+// matches of a burst are merged per board and written by a RelayWriter, so
+// the reading thread never waits for a board.
+class PatternTrigger
+{
+
+public:
+
+    PatternTrigger(serialib* input);
+    ~PatternTrigger();
+    int addRule(const PatternRule& rule);
+    int start();
+    void stop();
+    int feed(const uint8_t* data, size_t size);
+    bool flush(unsigned long milliseconds);
+    const LatencyHistogram& getMatchToWire();
+    uint64_t getBytes();
+    uint64_t getMatches();
+
+private:
+
+    void run();
+    serialib* input;
+    PatternMatcher matcher;
+    std::vector<PatternRule> rules;
+    std::vector<int> ruleid;        // pattern id of each rule
+    std::vector<RelayUpdate> burst; // masks of the current burst, one entry per board
+    uint8_t buffer[4096];
+    LatencyHistogram matchtowire;
+    RelayWriter writer;
+    std::atomic<uint64_t> bytes {0};
+    std::atomic<uint64_t> matches {0};
+    std::atomic<bool> running {false};
+    std::thread worker;
+
+};
@@ -0,0 +1,136 @@
+
+#pragma once
+#include <array>
+#include <cstdint>
+
+
+
+// State of the relays of a board or of a chain of boards, bit k = relay k+1
+using RelayMask = uint32_t;
+
+// Layout of a state command: one byte per 8 relays, relay 1 in the low bit of
+// the first byte. Each byte is masked then XORed with invert, so encoding has
+// no branch whatever the board and vectorizes over wide frames. Boards of a
+// chain take the bytes in order: the first board keeps the first bytes and
+// forwards the rest.
+struct RelayFrameFormat
+{
+    int framebytes;   // bytes per state command
+    uint8_t bytemask; // bits of each byte driving relays (3 on 2 relays boards)
+    uint8_t invert;   // 0xff for inverted encoding
+    RelayMask mask;   // every relay of the board or chain
+
+    // Returns the format of a chain of boards with boardrelays relays each
+    static constexpr RelayFrameFormat of(int boardrelays, int boards = 1) {
+        int relays = boardrelays * boards;
+        return RelayFrameFormat{relays <= 8 ? 1 : relays / 8, uint8_t(boardrelays == 2 ? 0x03 : 0xff),
+                                uint8_t(boardrelays == 2 ? 0x00 : 0xff), relays >= 32 ? 0xffffffffu : (1u << relays) - 1};
+    }
+
+    // Writes the command frame of a state
+    constexpr void encode(RelayMask state, uint8_t* frame) const {
+        for (int k = 0; k < framebytes; k++)
+            frame[k] = uint8_t(((state >> (8 * k)) & bytemask) ^ invert);
+    }
+
+    // Returns the state of a command frame
+    constexpr RelayMask decode(const uint8_t* frame) const {
+        RelayMask state = 0;
+        for (int k = 0; k < framebytes; k++)
+            state |= RelayMask(uint8_t(frame[k] ^ invert)) << (8 * k);
+        return state & mask;
+    }
+};
+
+static constexpr int RELAY_MAX_FRAME = 4; // bytes of the widest state command
+
+// Boards of 16 and 32 relays and chains of boards are hypothetical: none has
+// been seen, so their identifiers (0xae, 0xaf), their one byte per 8 relays
+// frames and their start byte per frame byte are assumptions. They are only
+// identified and driven when built with USBRELAY_HYPOTHETICAL_MODELS (CMake
+// option of the same name); otherwise a bigger size or a chain drives the
+// first 8 relays of the first board.
+#if defined (USBRELAY_HYPOTHETICAL_MODELS)
+static constexpr bool RELAY_HYPOTHETICAL_MODELS = true;
+#else
+static constexpr bool RELAY_HYPOTHETICAL_MODELS = false;
+#endif
+
+// Returns the number of relays per board actually driven for a requested size
+constexpr int relayBoardSize(int relaynumber) {
+    return RELAY_HYPOTHETICAL_MODELS || relaynumber <= 8 ? relaynumber : 8;
+}
+
+// Returns the number of chained boards actually driven
+constexpr int relayChainLength(int relaynumber, int boards) {
+    if (!RELAY_HYPOTHETICAL_MODELS || relaynumber * boards > 32 || (boards > 1 && relaynumber < 8))
+        return 1; // Not a valid chain: first board only
+    return boards;
+}
+
+
+
+// Compile-time model of a USB relay board with N relays, or of a chain of
+// BOARDS such boards driven as one: identifier answered to the init request,
+// init bytes and state encoding. Everything is constexpr, so the encoding of
+// a board known at build time is a few instructions and can be checked with
+// static_assert.
+// 2 relays boards take the state bits as is, bigger boards take them
+// inverted. Hypothetical boards of 16 and 32 relays take 2 and 4 bytes per
+// command, and in a chain only the first board answers the init request.
+template <int N, int BOARDS = 1>
+struct RelayBoardModel
+{
+    static_assert(N == 2 || N == 4 || N == 8 || N == 16 || N == 32, "USB relay boards have 2, 4, 8, 16 or 32 relays");
+    static_assert(BOARDS >= 1 && N * BOARDS <= 32, "a chain drives at most 32 relays");
+    static_assert(BOARDS == 1 || N >= 8, "chained boards take whole bytes");
+    static_assert(RELAY_HYPOTHETICAL_MODELS || (N <= 8 && BOARDS == 1),
+                  "16/32 relay boards and chains are hypothetical, build with USBRELAY_HYPOTHETICAL_MODELS");
+
+    static constexpr int relays = N * BOARDS;
+    static constexpr RelayFrameFormat format = RelayFrameFormat::of(N, BOARDS);
+    static constexpr int framebytes = format.framebytes;
+    static constexpr RelayMask mask = format.mask;
+    static constexpr bool inverted = format.invert != 0;
+    static constexpr uint8_t identifier = N == 2 ? 0xad : N == 4 ? 0xab : N == 8 ? 0xac : N == 16 ? 0xae : 0xaf; // 0xae, 0xaf assumed
+    static constexpr uint8_t initrequest = 0x50;  // answered with identifier
+    static constexpr uint8_t startcommand = 0x51; // switches the board to command mode
+    static constexpr uint8_t startstate = 0xff;   // byte sent after startcommand
+
+    // Returns the command frame of a relay state
+    static constexpr std::array<uint8_t, framebytes> encode(RelayMask state) {
+        std::array<uint8_t, framebytes> frame {};
+        format.encode(state, frame.data());
+        return frame;
+    }
+
+    // Returns the relay state of a command frame
+    static constexpr RelayMask decode(const std::array<uint8_t, framebytes>& frame) {
+        return format.decode(frame.data());
+    }
+
+    // Returns the relay state of an array of on/off values, relay 1 first
+    static constexpr RelayMask pack(const int* commands) {
+        RelayMask state = 0;
+        for (int k = 0; k < relays; k++)
+            state |= RelayMask(commands[k] != 0) << k;
+        return state;
+    }
+
+    // Returns the state bit of a relay, 1 to relays, checked at compile time
+    template <int RELAY>
+    static constexpr RelayMask bit() {
+        static_assert(RELAY >= 1 && RELAY <= relays, "relay index out of range");
+        return RelayMask(1) << (RELAY - 1);
+    }
+};
+
+static_assert(RelayBoardModel<2>::encode(0x02)[0] == 0x02 && RelayBoardModel<2>::encode(0xff)[0] == 0x03);
+static_assert(RelayBoardModel<4>::encode(0x05)[0] == 0xfa && RelayBoardModel<4>::decode({0xfa}) == 0x05);
+static_assert(RelayBoardModel<8>::encode(0x81)[0] == 0x7e && RelayBoardModel<8>::decode({0xff}) == 0x00);
+static_assert(RelayBoardModel<8>::bit<8>() == 0x80 && RelayBoardModel<4>::mask == 0x0f);
+#if defined (USBRELAY_HYPOTHETICAL_MODELS)
+static_assert(RelayBoardModel<16>::encode(0x8001) == std::array<uint8_t, 2>{0xfe, 0x7f});
+static_assert(RelayBoardModel<32>::decode({0xff, 0xff, 0xff, 0x7f}) == 0x80000000u);
+static_assert(RelayBoardModel<8, 3>::framebytes == 3 && RelayBoardModel<8, 3>::bit<24>() == 0x800000);
+#endif
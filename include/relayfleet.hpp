@@ -0,0 +1,69 @@
+
+#pragma once
+#include <usbrelay.hpp>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+
+
+// Counters of a fleet
+struct RelayFleetStats
+{
+    uint64_t commits = 0;        // commit() calls
+    uint64_t writes = 0;         // boards written
+    uint64_t avoided = 0;        // boards skipped because nothing changed
+    uint64_t held = 0;           // boards left out because they were held (offline), changed or not
+    uint64_t failures = 0;       // writes that failed, retried at the next commit
+    uint64_t relayschanged = 0;  // relays that differed from the committed state, held boards excepted
+    int lastwrites = 0;          // boards written by the last commit
+    int lastavoided = 0;         // boards skipped by the last commit
+    int lastheld = 0;            // boards held during the last commit
+};
+
+
+
+// Desired and committed states of many boards, each kept as one packed bit
+// vector: board b owns a slot of slotbits bits (relays rounded up to a power
+// of two), so eight 8 relay boards share a 64 bit word. commit() XORs the
+// two vectors 128 bits at a time, skips equal words at once and writes only
+// the boards whose slot differs; the popcount of the difference gives the
+// relays switched. Held boards (offline) stay pending until released. Boards
+// are not owned and are written from the calling thread with setMask.
+class RelayFleet
+{
+
+public:
+
+    RelayFleet(int relays = 8);
+    int addBoard(Usbrelay* board);
+    int getBoardCount();
+    int setDesired(int board, RelayMask state);
+    int setDesired(std::span<const RelayMask> states);
+    RelayMask getDesired(int board);
+    RelayMask getCommitted(int board);
+    void invalidate(int board);
+    void invalidateAll();
+    void hold(int board, bool held);
+    int diff(std::vector<int>& boards);
+    int commit(std::vector<int>* failed = nullptr);
+    RelayFleetStats getStats();
+
+private:
+
+    RelayMask readSlot(const std::vector<uint64_t>& vector, int board);
+    void writeSlot(std::vector<uint64_t>& vector, int board, RelayMask state);
+    void markWord(size_t word, uint64_t difference);
+    int slotbits;
+    RelayMask slotmask;
+    std::vector<Usbrelay*> boards;
+    std::vector<uint64_t> desired;     // packed slots, kept in step with committed
+    std::vector<uint64_t> committed;   // state last written successfully
+    std::vector<uint64_t> stale;       // one bit per board written at the next commit whatever its state
+    std::vector<uint64_t> held;        // one bit per board left out of the commits (offline)
+    std::vector<uint64_t> pending;     // one bit per board found by the last diff
+    std::vector<int> changed;          // boards to write, reused between commits
+    uint64_t relayschanged = 0;        // relays found by the last diff
+    RelayFleetStats stats;
+
+};
@@ -0,0 +1,83 @@
+
+#pragma once
+#include <simboard.hpp>
+#include <usbrelay.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+
+// Counters of a multiplexer
+struct RelayMuxStats
+{
+    uint64_t commands = 0;   // state bytes received from the clients
+    uint64_t writes = 0;     // state bytes sent to the board
+    uint64_t coalesced = 0;  // client commands that did not cause their own write
+    uint64_t connects = 0;   // client opens of a pseudo-terminal
+    uint64_t failures = 0;   // failed board writes, retried with a backoff
+};
+
+
+
+// Shares one relay board between several applications (Linux only). The
+// multiplexer owns the board through Usbrelay and creates one pseudo-terminal
+// per client; every client talks the board protocol to its own terminal as
+// if it was the device (the handshake is answered locally, see SimBoard).
+// A state byte of a client only changes the relays that differ from that
+// client's previous state byte, merged into a shadow state that a writer
+// thread sends to the board with the usual pacing; commands arriving during
+// the pacing delay are coalesced into the next write. A failed write keeps
+// the state pending and is retried after 50 ms, doubling up to 2 s, or at
+// once when a client sends a new state. The state byte that
+// Usbrelay::initBoard sends after the handshake only sets the client's
+// reference, so a tool starting up does not reset the relays of the others.
+class RelayMux
+{
+
+public:
+
+    RelayMux(Usbrelay* board, int clients);
+    ~RelayMux();
+    int start();
+    void stop();
+    int getClientCount();
+    std::string getClientPort(int client);
+    RelayMask getShadowState();
+    RelayMuxStats getStats();
+
+private:
+
+    struct Client
+    {
+        int master = -1;
+        std::string port;
+        SimBoard decoder;
+        bool connected = false;
+        bool reference = false;  // next state is the one of the handshake
+        RelayMask view = 0;      // last state of the client, decoded
+    };
+
+    void serve();
+    void writer();
+    int receive(Client& client);
+    void merge(Client& client, RelayMask state);
+    void disconnect(Client& client);
+    Usbrelay* board;
+    std::vector<Client> clients;
+    RelayMask mask = 0xff;
+    RelayMask shadow = 0;
+    uint64_t queued = 0;         // client commands merged since the last write
+    bool dirty = false;
+    RelayMuxStats stats;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::atomic<bool> running {false};
+    std::thread server;
+    std::thread sender;
+    int wakeup[2] = {-1, -1};
+
+};
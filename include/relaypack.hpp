@@ -0,0 +1,36 @@
+
+#pragma once
+#include <relayboard.hpp>
+#include <cstdint>
+#include <span>
+
+
+
+// Bulk conversion between per-relay values (UI tables, historian rows) and
+// relay masks for whole fleets. values holds relays consecutive entries per
+// board, board 0 first, relay 1 first, so values.size() must equal
+// relays * masks.size(). Packing treats any nonzero value as on, unpacking
+// writes 0 or 1.
+//
+// The values are converted 16 at a time with SSE2 compares and movemask
+// (8 at a time with multiply tricks elsewhere), and with BMI2 pdep when the
+// build targets it (-mbmi2 or -march=native). When 64 is a multiple of
+// relays (2, 4, 8, 16, 32) several boards share one 64 bit conversion.
+
+// Packs per-relay values into one mask per board
+// Parameters: values - relays values per board
+//             relays - relays per board, 1 to 32
+//             masks - receives the state of each board, bit k = relay k+1
+// Returns: 1 on success, -1 if the sizes do not match
+int packRelays(std::span<const uint8_t> values, int relays, std::span<RelayMask> masks);
+int packRelays(std::span<const bool> values, int relays, std::span<RelayMask> masks);
+int packRelays(std::span<const int> values, int relays, std::span<RelayMask> masks);
+
+// Unpacks one mask per board into per-relay values (0 or 1)
+// Parameters: masks - state of each board, bit k = relay k+1
+//             relays - relays per board, 1 to 32
+//             values - receives relays values per board
+// Returns: 1 on success, -1 if the sizes do not match
+int unpackRelays(std::span<const RelayMask> masks, int relays, std::span<uint8_t> values);
+int unpackRelays(std::span<const RelayMask> masks, int relays, std::span<bool> values);
+int unpackRelays(std::span<const RelayMask> masks, int relays, std::span<int> values);
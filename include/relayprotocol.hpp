@@ -0,0 +1,91 @@
+
+#pragma once
+#include <relayboard.hpp>
+#include <bit>
+#include <cstdint>
+
+
+
+// Command protocols of the supported boards. A protocol is a struct of
+// static constexpr functions given as a template parameter (BasicUsbrelay)
+// or picked once per board (Usbrelay), so encoding a command costs no
+// virtual call. encode() writes the bytes that bring the board to state,
+// changed giving the relays that differ from what the board holds.
+
+enum RelayProtocol
+{
+    RELAY_PROTOCOL_MASK = 0, // 0x50/0x51 handshake then mask frames
+    RELAY_PROTOCOL_LCUS = 1  // LCUS/CH340 "A0 channel state checksum" frames
+};
+
+static constexpr int RELAY_MAX_COMMAND = 4 * 32; // bytes of the longest command (LCUS, 32 relays)
+
+
+
+// Boards identified by the 0x50 handshake, taking the whole state in one
+// frame (see RelayFrameFormat)
+struct MaskProtocol
+{
+    static constexpr RelayProtocol id = RELAY_PROTOCOL_MASK;
+    static constexpr bool handshake = true;
+
+    static constexpr int maxCommand(const RelayFrameFormat& format) {
+        return format.framebytes;
+    }
+
+    static constexpr int encode(const RelayFrameFormat& format, RelayMask changed, RelayMask state, uint8_t* command) {
+        (void)changed; // Every frame carries the whole state
+        format.encode(state, command);
+        return format.framebytes;
+    }
+};
+
+
+
+// LCUS boards (CH340 USB-serial, 1 to 8 relays at 9600 baud): no handshake,
+// one 4 bytes frame per relay: 0xa0, channel (1 based), 1 on / 0 off and
+// the sum of the three previous bytes. The frames of all the relays changed
+// by a command are sent in a single write.
+struct LcusProtocol
+{
+    static constexpr RelayProtocol id = RELAY_PROTOCOL_LCUS;
+    static constexpr bool handshake = false;
+    static constexpr uint8_t start = 0xa0;
+
+    static constexpr int maxCommand(const RelayFrameFormat& format) {
+        return 4 * std::popcount(format.mask);
+    }
+
+    // Writes the frame of one relay
+    static constexpr void frame(int channel, bool on, uint8_t* command) {
+        command[0] = start;
+        command[1] = uint8_t(channel);
+        command[2] = on;
+        command[3] = uint8_t(start + channel + on);
+    }
+
+    static constexpr int encode(const RelayFrameFormat& format, RelayMask changed, RelayMask state, uint8_t* command) {
+        int size = 0;
+        for (changed &= format.mask; changed; changed &= changed - 1) {
+            int k = std::countr_zero(changed);
+            frame(k + 1, (state >> k) & 1, command + size);
+            size += 4;
+        }
+        return size;
+    }
+
+    // Decodes one frame
+    // Parameters: command - 4 bytes
+    //             on - receives the requested relay state
+    // Returns: the channel, 1 based, or -1 if the frame is not valid
+    static constexpr int decode(const uint8_t* command, bool* on) {
+        if (command[0] != start || command[2] > 1 || uint8_t(command[0] + command[1] + command[2]) != command[3])
+            return -1;
+        *on = command[2];
+        return command[1];
+    }
+};
+
+static_assert([] { uint8_t c[4] = {}; LcusProtocol::frame(1, true, c); return c[0] == 0xa0 && c[1] == 1 && c[2] == 1 && c[3] == 0xa2; }());
+static_assert([] { uint8_t c[8] = {}; return LcusProtocol::encode(RelayFrameFormat::of(4), 0x5, 0x4, c) == 8 && c[3] == 0xa1 && c[7] == 0xa4; }());
+static_assert(LcusProtocol::maxCommand(RelayFrameFormat::of(8)) == 32 && MaskProtocol::maxCommand(RelayFrameFormat::of(16)) == 2);
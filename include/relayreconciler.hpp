@@ -0,0 +1,88 @@
+
+#pragma once
+#include <relayfleet.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+
+// Counters of a reconciliation controller
+struct RelayReconcilerStats
+{
+    uint64_t steps = 0;              // reconciliation passes
+    uint64_t writes = 0;             // boards written
+    uint64_t avoided = 0;            // boards left alone because they already matched
+    uint64_t failures = 0;           // writes that failed, the board is then reconnected
+    uint64_t reconnects = 0;         // boards brought back (reopen and init) and reasserted
+    uint64_t reconnectfailures = 0;  // reconnect attempts that failed, retried later
+    uint64_t resyncs = 0;            // boards rewritten by the periodic resync
+};
+
+
+
+// Keeps a fleet of boards converged to a declared state. setDesired only
+// records the state; each pass (step(), or the controller thread after
+// start()) commits the minimal writes through RelayFleet. A board whose
+// write fails, or reported with boardReset() after a power cycle, is held
+// out of the commits and brought back with closeCom/openCom/initBoard every
+// retry interval, then its desired state is reasserted. Every board is also
+// rewritten once per resync interval, spread over the interval, to undo
+// changes the host did not see. Times follow the controller Clock.
+class RelayReconciler
+{
+
+public:
+
+    RelayReconciler(int relays = 8);
+    ~RelayReconciler();
+    int addBoard(Usbrelay* board);
+    int setDesired(int board, RelayMask state);
+    int setDesired(std::span<const RelayMask> states);
+    int setRelay(int board, int relay, bool on);
+    RelayMask getDesired(int board);
+    bool isConverged();
+    void boardReset(int board);
+    void setResyncInterval(unsigned long interval_ms);
+    void setRetryInterval(unsigned long interval_ms);
+    void setClock(Clock* clock);
+    int step();
+    uint64_t nextDeadline_us();
+    int start();
+    void stop();
+    RelayReconcilerStats getStats();
+
+private:
+
+    // Health of one board
+    struct BoardHealth
+    {
+        bool down = false;       // write failed: reopen and init before writing again
+        bool reset = false;      // power cycled: init before writing again
+        uint64_t retryat = 0;    // next reconnect attempt
+        uint64_t resyncat = 0;   // next forced rewrite
+    };
+
+    void run();
+    int recover(int board, uint64_t now);
+    uint64_t deadline();
+    RelayFleet fleet;
+    std::vector<Usbrelay*> boards;
+    std::vector<RelayMask> requested;   // desired states, copied into the fleet by each pass
+    std::vector<BoardHealth> health;
+    std::vector<int> failed;
+    Clock* clock = &systemClock();
+    unsigned long resync_ms = 60000;
+    unsigned long retry_ms = 1000;
+    bool dirty = false;                  // desired state changed since the last pass
+    bool converged = false;              // last pass wrote everything it had to
+    RelayReconcilerStats stats;
+    std::mutex steplock;                 // one pass at a time
+    std::mutex lock;                     // requested, health, settings and stats
+    std::condition_variable wake;
+    std::atomic<bool> running {false};
+    std::thread worker;
+
+};
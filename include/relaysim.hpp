@@ -0,0 +1,89 @@
+
+#pragma once
+#include <simboard.hpp>
+#include <rfc2217.hpp>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+
+
+// Behaviour of a simulated board
+struct RelaySimOptions
+{
+    int relaynumber = 8;
+    int boards = 1;                  // boards of relaynumber relays chained
+    RelayProtocol protocol = RELAY_PROTOCOL_MASK;
+    unsigned long mingap_us = 0;     // bytes closer than this to the previous one are lost
+    unsigned long replydelay_us = 0; // delay injected before every answer
+    double droprate = 0;             // probability of losing an incoming byte
+    unsigned int seed = 1;           // seed of the drop generator
+};
+
+// Counters of a simulated board
+struct RelaySimStats
+{
+    unsigned long bytes = 0;
+    unsigned long commands = 0;
+    unsigned long replies = 0;
+    unsigned long gapviolations = 0;
+    unsigned long dropped = 0;
+    unsigned long invalidframes = 0; // LCUS frames rejected
+    unsigned long controls = 0;      // RFC 2217 commands received
+    unsigned int baudrate = 0;       // last speed set over RFC 2217
+    bool dtr = false;                // last DTR/RTS set over RFC 2217
+    bool rts = false;
+};
+
+
+
+// Simulated board behind a pseudo-terminal: open getPort() with Usbrelay or
+// serialib as if it was a real /dev/ttyACM device (Linux only). With
+// startTcp() the board is served on a local TCP port instead, with
+// startRfc2217() it stands for an RFC 2217 terminal server.
+class RelaySimulator
+{
+
+public:
+
+    RelaySimulator(const RelaySimOptions& options = RelaySimOptions());
+    ~RelaySimulator();
+    int start();
+    int startTcp(unsigned int tcpport = 0);
+    int startRfc2217(unsigned int tcpport = 0);
+    void stop();
+    std::string getPort();
+    RelayMask getState();
+    bool isReady();
+    RelaySimStats getStats();
+    bool waitState(RelayMask state, unsigned long milliseconds);
+    void powerCycle();
+
+private:
+
+    void run();
+    void process(const uint8_t* data, int nbyte, uint64_t arrival);
+    void answerOption(uint8_t command, uint8_t option, std::vector<uint8_t>& output);
+    void answerComPort(const uint8_t* sub, size_t size, std::vector<uint8_t>& output);
+    void reply(const uint8_t* data, size_t size);
+    RelaySimOptions options;
+    SimBoard board;
+    RelaySimStats stats;
+    std::mutex lock;
+    std::mt19937 random;
+    std::thread worker;
+    std::atomic<bool> running {false};
+    std::string port;
+    int master = -1;
+    int slave = -1;
+    int listener = -1;
+    int wakeup[2] = {-1, -1};
+    uint64_t lastbyte = 0;
+    bool telnet = false;
+    TelnetDecoder decoder;
+    bool negotiated[2][256] = {};    // WILL/DO already answered, per option
+
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include <usbrelay.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+
+
+// Relay change requested by an event (input edge, pattern match...)
+struct RelayUpdate
+{
+    Usbrelay* relay;
+    RelayMask setmask;   // relays switched on (bit k = relay k+1)
+    RelayMask clearmask; // relays switched off
+};
+
+// Counters of a writer
+struct RelayWriterStats
+{
+    uint64_t updates = 0;    // updates submitted
+    uint64_t writes = 0;     // board commands sent
+    uint64_t coalesced = 0;  // updates merged into the write of another one
+    uint64_t failures = 0;   // failed board commands
+};
+
+
+
+// Applies relay updates on a thread of its own, so that the thread detecting
+// the events never waits for the 50 ms pacing of a board. The updates of a
+// board submitted while a write is in progress are merged into its next
+// write, a later update winning for the relays it names. Boards live in a
+// fixed table, so no allocation happens per event.
+class RelayWriter
+{
+
+public:
+
+    static constexpr int MAXBOARDS = 32;
+
+    ~RelayWriter();
+    int start();
+    void stop();
+    int submit(const RelayUpdate* updates, int count, uint64_t detected_us = 0, LatencyHistogram* latency = nullptr);
+    bool flush(unsigned long milliseconds);
+    RelayWriterStats getStats();
+
+private:
+
+    struct Pending
+    {
+        Usbrelay* relay = nullptr;
+        RelayMask setmask = 0;
+        RelayMask clearmask = 0;
+        uint64_t updates = 0;       // updates merged since the last write
+        uint64_t detected_us = 0;   // earliest event merged, 0 if not timed
+        LatencyHistogram* latency = nullptr;
+    };
+
+    void run();
+    Pending pending[MAXBOARDS];
+    int boards = 0;
+    int queued = 0;                 // boards with updates to write
+    bool writing = false;
+    RelayWriterStats stats;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::condition_variable idle;
+    std::atomic<bool> running {false};
+    std::thread worker;
+
+};
@@ -0,0 +1,151 @@
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+
+// Telnet (RFC 854) and COM-PORT-OPTION (RFC 2217) protocol elements shared
+// by the RFC 2217 transport and the simulated terminal server.
+
+enum TelnetCode
+{
+    TELNET_SE = 240,
+    TELNET_SB = 250,
+    TELNET_WILL = 251,
+    TELNET_WONT = 252,
+    TELNET_DO = 253,
+    TELNET_DONT = 254,
+    TELNET_IAC = 255
+};
+
+enum TelnetOption
+{
+    TELNET_BINARY = 0,
+    TELNET_SGA = 3,
+    TELNET_COMPORT = 44
+};
+
+// COM-PORT-OPTION commands sent by the client, the server answers with the
+// same command plus RFC2217_SERVER
+enum Rfc2217Command
+{
+    RFC2217_SIGNATURE = 0,
+    RFC2217_SET_BAUDRATE = 1,
+    RFC2217_SET_DATASIZE = 2,
+    RFC2217_SET_PARITY = 3,
+    RFC2217_SET_STOPSIZE = 4,
+    RFC2217_SET_CONTROL = 5,
+    RFC2217_NOTIFY_LINESTATE = 6,
+    RFC2217_NOTIFY_MODEMSTATE = 7,
+    RFC2217_SET_LINESTATE_MASK = 10,
+    RFC2217_SET_MODEMSTATE_MASK = 11,
+    RFC2217_PURGE_DATA = 12,
+    RFC2217_SERVER = 100
+};
+
+// SET-CONTROL values
+enum Rfc2217Control
+{
+    RFC2217_DTR_ON = 8,
+    RFC2217_DTR_OFF = 9,
+    RFC2217_RTS_ON = 11,
+    RFC2217_RTS_OFF = 12
+};
+
+// NOTIFY-MODEMSTATE bits
+enum Rfc2217ModemState
+{
+    RFC2217_MODEM_CTS = 0x10,
+    RFC2217_MODEM_DSR = 0x20,
+    RFC2217_MODEM_RI = 0x40,
+    RFC2217_MODEM_DCD = 0x80
+};
+
+
+
+// Splits a telnet byte stream into data bytes, option negotiations and
+// subnegotiations. The state is kept between calls, so a command split
+// across two reads is decoded.
+class TelnetDecoder
+{
+
+public:
+
+    // Decodes received bytes
+    // Parameters: input, size - bytes received
+    //             data - receives the data bytes (IAC IAC unescaped)
+    //             onoption - called as onoption(command, option) for WILL/WONT/DO/DONT
+    //             onsub - called as onsub(const uint8_t* sb, size_t size) with the
+    //                     subnegotiation between SB and IAC SE, option byte first
+    template <typename OnOption, typename OnSub>
+    void decode(const uint8_t* input, size_t size, std::vector<uint8_t>& data, OnOption&& onoption, OnSub&& onsub) {
+        for (size_t k = 0; k < size; k++) {
+            uint8_t byte = input[k];
+            switch (state) {
+                case DATA:
+                    if (byte == TELNET_IAC)
+                        state = IAC;
+                    else
+                        data.push_back(byte);
+                    break;
+                case IAC:
+                    if (byte == TELNET_IAC) {
+                        data.push_back(byte);
+                        state = DATA;
+                    } else if (byte >= TELNET_WILL && byte <= TELNET_DONT) {
+                        command = byte;
+                        state = OPTION;
+                    } else if (byte == TELNET_SB) {
+                        sub.clear();
+                        state = SUB;
+                    } else { // NOP, GA, BRK...: nothing to do on a serial link
+                        state = DATA;
+                    }
+                    break;
+                case OPTION:
+                    onoption(command, byte);
+                    state = DATA;
+                    break;
+                case SUB:
+                    if (byte == TELNET_IAC)
+                        state = SUBIAC;
+                    else
+                        sub.push_back(byte);
+                    break;
+                case SUBIAC:
+                    if (byte == TELNET_IAC) {
+                        sub.push_back(byte);
+                        state = SUB;
+                    } else { // SE, or a malformed end handled the same way
+                        if (!sub.empty())
+                            onsub(sub.data(), sub.size());
+                        state = DATA;
+                    }
+                    break;
+            }
+        }
+    }
+
+    void reset() { state = DATA; }
+
+private:
+
+    enum State { DATA, IAC, OPTION, SUB, SUBIAC };
+    State state = DATA;
+    uint8_t command = 0;
+    std::vector<uint8_t> sub;
+
+};
+
+
+
+// Appends data bytes to a telnet stream, doubling IAC
+void telnetEscape(const uint8_t* data, size_t size, std::vector<uint8_t>& output);
+
+// Appends an option negotiation (IAC command option)
+void telnetOption(uint8_t command, uint8_t option, std::vector<uint8_t>& output);
+
+// Appends a COM-PORT-OPTION subnegotiation (IAC SB 44 command value IAC SE)
+void rfc2217Command(uint8_t command, const uint8_t* value, size_t size, std::vector<uint8_t>& output);
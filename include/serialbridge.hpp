@@ -0,0 +1,76 @@
+
+#pragma once
+#include <serialib.hpp>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+
+// Direction of the traffic in a bridge
+enum SerialBridgeDirection
+{
+    BRIDGE_A_TO_B = 0,
+    BRIDGE_B_TO_A = 1
+};
+
+// Called with every chunk forwarded, before it is written to the other port
+typedef std::function<void(SerialBridgeDirection direction, const uint8_t* data, size_t size)> SerialBridgeTap;
+
+// Counters of a bridge, indexed by SerialBridgeDirection
+struct SerialBridgeStats
+{
+    uint64_t bytes[2] = {0, 0};
+    uint64_t chunks[2] = {0, 0};
+    uint64_t stalls[2] = {0, 0};    // writes that did not fit the destination queue
+};
+
+
+
+// Forwards the traffic between two opened serial ports on a dedicated
+// epoll thread (Linux only), for example an upstream controller and a relay
+// board, with optional taps to log or match what goes through.
+// Each read takes everything the driver holds and is written at once; when
+// the destination queue is full, the rest is kept and the source is no longer
+// read until it drains, so the slow side throttles the fast one.
+class SerialBridge
+{
+
+public:
+
+    SerialBridge(serialib* a, serialib* b);
+    ~SerialBridge();
+    void setTap(SerialBridgeTap tap);
+    int start();
+    void stop();
+    SerialBridgeStats getStats();
+
+private:
+
+    struct Pending
+    {
+        std::vector<uint8_t> buffer;
+        size_t offset = 0;
+        size_t size = 0;
+    };
+
+    void run();
+    int transfer(int direction);
+    int flush(int direction);
+    int updateInterest();
+    serialib* ports[2];
+    int fds[2] = {-1, -1};
+    int interest[2] = {-1, -1};       // events watched on each port, -1 when out of the set
+    bool hungup[2] = {false, false};  // hang-up seen while the port still had bytes to forward
+    Pending pending[2];
+    SerialBridgeTap tap;
+    int epoll = -1;
+    int wakeup = -1;
+    SerialBridgeStats stats;
+    std::mutex lock;
+    std::atomic<bool> running {false};
+    std::thread worker;
+
+};
@@ -0,0 +1,89 @@
+
+#pragma once
+#include <serialib.hpp>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+
+// Counters of a capture
+struct SerialCaptureStats
+{
+    uint64_t bytes = 0;     // bytes written to the segments
+    uint64_t chunks = 0;    // transfers from the device
+    uint64_t segments = 0;  // segment files opened
+    uint64_t dropped = 0;   // bytes left unread in the read pipe when the capture stopped
+    uint64_t overflow = 0;  // bytes recorded but not passed to the reads, their pipe being full
+    bool copying = false;   // splice() refused by the driver, read/write fallback in use
+};
+
+// Record of a segment index file (<prefix>.<segment>.idx): the chunk
+// starting at offset in the data file was received at time_us
+struct SerialCaptureIndex
+{
+    uint64_t time_us;
+    uint64_t offset;
+};
+
+
+
+// Records every byte received on a serial port into rotating segment files
+// (<prefix>.000000.bin, <prefix>.000001.bin, ...) while the application
+// keeps reading the port as usual (Linux only).
+// A thread splices the device into a pipe, tee()s that pipe into a second
+// one the serialib reads are switched to, then splices the data into the
+// current segment: no byte is copied through user space. Each segment has an
+// index of monotonic timestamps (serialib clock) taken at most every
+// millisecond, used by locate() to seek in a recording.
+// The recording never waits for the application: while its read pipe is
+// full, the bytes still go to the segment but are not passed to the reads
+// (counted as overflow). A hang-up of the device ends the capture and gives
+// the device back to the reads. Bytes taken directly from the device
+// descriptor (serialib::getFd, SerialBridge) bypass the capture and are
+// neither recorded nor seen by the capture thread; such users must not
+// share the port with a capture.
+class SerialCapture
+{
+
+public:
+
+    SerialCapture(serialib* port);
+    ~SerialCapture();
+    int start(const std::string& prefix, uint64_t segmentbytes = 64ull << 20, int keepsegments = 0);
+    void stop();
+    bool isRunning();
+    SerialCaptureStats getStats();
+    static std::string segmentPath(const std::string& prefix, uint64_t segment, const char* extension);
+    static int locate(const std::string& prefix, uint64_t time_us, uint64_t* segment, uint64_t* offset);
+
+private:
+
+    void run();
+    int beginChunk();
+    int forward(ssize_t nbyte);
+    int copy(ssize_t nbyte);
+    void release();
+    int openSegment();
+    void closeSegment();
+    serialib* port;
+    std::string prefix;
+    uint64_t segmentbytes = 0;
+    int keepsegments = 0;
+    uint64_t segment = 0;
+    uint64_t segmentoffset = 0;
+    uint64_t lastindex_us = 0;
+    int data = -1;
+    int index = -1;
+    int transfer[2] = {-1, -1};  // device -> transfer pipe (splice)
+    int readpipe[2] = {-1, -1};  // transfer pipe -> serialib reads (tee)
+    int wakeup[2] = {-1, -1};
+    std::vector<char> buffer;    // read/write fallback only
+    SerialCaptureStats stats;
+    std::mutex lock;
+    std::atomic<bool> running {false};
+    std::thread worker;
+
+};
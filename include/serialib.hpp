@@ -50,7 +50,21 @@ This is a licence-free software, it can be used by anyone who try to build a bet
     #include <fcntl.h>
     #include <unistd.h>
     #include <sys/ioctl.h>
+    #include <poll.h>
+    #include <errno.h>
 #endif
+#if defined (__linux__)
+    // Driver counters (TIOCGICOUNT)
+    #include <linux/serial.h>
+    // Thread waiting for modem changes (TIOCMIWAIT)
+    #include <pthread.h>
+    #include <condition_variable>
+    #include <mutex>
+#endif
+
+#include <atomic>
+#include "clock.hpp"
+#include "metrics.hpp"
 
 /*! To avoid unused parameters */
 #define UNUSED(x) (void)(x)
@@ -86,6 +100,43 @@ enum SerialParity {
     SERIAL_PARITY_SPACE /**< space bit */
 };
 
+/**
+ * bits of the modem lines returned by modemLines
+ */
+enum SerialModemLine {
+    SERIAL_LINE_CTS = 0x01, /**< Clear To Send (input) */
+    SERIAL_LINE_DSR = 0x02, /**< Data Set Ready (input) */
+    SERIAL_LINE_DCD = 0x04, /**< Data Carrier Detect (input) */
+    SERIAL_LINE_RI  = 0x08, /**< Ring Indicator (input) */
+    SERIAL_LINE_DTR = 0x10, /**< Data Terminal Ready (output) */
+    SERIAL_LINE_RTS = 0x20, /**< Request To Send (output) */
+    SERIAL_LINE_INPUTS = 0x0f /**< every input line */
+};
+
+/**
+ * transitions of the input lines counted by the driver (TIOCGICOUNT)
+ */
+struct SerialModemCounters {
+    unsigned long transitions[4]; /**< CTS, DSR, DCD and RI, in the order of the SERIAL_LINE_* bits */
+};
+
+/**
+ * snapshot of the kernel counters and queues of a port
+ */
+struct SerialLinkStats {
+    bool counters;           /**< false when the driver does not report the counters below */
+    unsigned long rx;        /**< bytes received by the driver */
+    unsigned long tx;        /**< bytes transmitted by the driver */
+    unsigned long frame;     /**< framing errors */
+    unsigned long overrun;   /**< UART overruns */
+    unsigned long parity;    /**< parity errors */
+    unsigned long brk;       /**< breaks received */
+    unsigned long bufoverrun;/**< tty buffer overruns */
+    unsigned long cts, dsr, rng, dcd; /**< modem line transitions */
+    int inqueue;             /**< bytes waiting to be read (-1 unknown) */
+    int outqueue;            /**< bytes waiting to be sent (-1 unknown) */
+};
+
 /*!  \class     serialib
      \brief     This class is used for communication over a serial device.
 */
@@ -163,6 +214,9 @@ public:
     // Read an array of byte (with timeout)
     int     readBytes   (void *buffer,unsigned int maxNbBytes,const unsigned int timeOut_ms=0, unsigned int sleepDuration_us=100);
 
+    // Read the bytes already received, waiting only for the first one (with timeout)
+    int     readAvailable(void *buffer,unsigned int maxNbBytes,const unsigned int timeOut_ms=0);
+
 
 
 
@@ -176,6 +230,15 @@ public:
     // Return the number of bytes in the received buffer
     int     available();
 
+    // Kernel error counters and queue depths of the port
+    int     linkStats(SerialLinkStats *stats);
+
+    // Wait until the output queue is empty (bytes handed to the hardware)
+    int     waitSent(unsigned int timeOut_ms);
+
+    // Descriptor of the device, for event loops (UNIX only)
+    int     getFd();
+
 
 
 
@@ -211,15 +274,79 @@ public:
     // Get CTR status (Data Terminal Ready, pin 4)
     bool    isDTR();
 
+    // Get every modem line at once (SerialModemLine bits)
+    int     modemLines();
+
+    // Read the transition counters of the input lines
+    int     modemCounters(SerialModemCounters *counters);
+
+    // Wait until one of the selected input lines changes
+    int     waitModemChange(int mask, unsigned int timeOut_ms=0, int *lines=nullptr, SerialModemCounters *counters=nullptr);
+
+    // Make the waitModemChange in progress, or else the next one, return 0
+    void    interruptModemWait();
+
+
+
+
+    // _________________________
+    // ::: Time source :::
+
+
+    // Select the clock used for timeouts (nullptr restores the system clock)
+    void    setClock(Clock *clock);
+
+
+
+
+    // _________________________
+    // ::: Metrics :::
+
+
+    // Select where the byte, timeout and error counters are kept (nullptr restores the internal ones)
+    void    setMetrics(SerialMetrics *metrics);
+
+    // Counters of the port
+    const SerialMetrics& getMetrics();
+
 
 private:
     // Read a string (no timeout)
     int             readStringNoTimeOut  (char *String,char FinalChar,unsigned int MaxNbBytes);
 
+    // Poll the modem lines when the driver cannot wait for a change
+    int             pollModemChange(int mask, unsigned int timeOut_ms, int *lines);
+
+#if defined (__linux__)
+    // Thread sleeping in TIOCMIWAIT on behalf of waitModemChange
+    int             startModemWatch();
+    void            stopModemWatch();
+    static void*    watchModem(void *port);
+#endif
+
+    // Bodies of readChar and readBytes (wrapped by the probes)
+    int             waitChar    (char *pByte,unsigned int timeOut_ms);
+    int             waitBytes   (void *buffer,unsigned int maxNbBytes,unsigned int timeOut_ms,unsigned int sleepDuration_us);
+
+#if defined (__linux__) || defined(__APPLE__)
+    // Descriptor a read call is served from, held until releaseInput
+    int             acquireInput();
+    void            releaseInput(int in);
+#endif
+
     // Current DTR and RTS state (can't be read on WIndows)
     bool            currentStateRTS;
     bool            currentStateDTR;
 
+    // Time source for timeouts and CPU relaxing (not owned)
+    Clock           *clock;
+
+    // Set by interruptModemWait until a waitModemChange returns for it
+    std::atomic<bool> modeminterrupt;
+
+    // Counters of the port, internal ones unless setMetrics was called
+    SerialMetrics   ownMetrics;
+    SerialMetrics   *metrics;
 
 
 
@@ -232,8 +359,23 @@ private:
 #endif
 #if defined (__linux__) || defined(__APPLE__)
     int             fd;
+    // Descriptor the reads are served from: fd, or the pipe fed by a running SerialCapture
+    std::atomic<int> infd;
+    // Read calls currently using the capture pipe, which stays open until they leave it
+    std::atomic<int> pipereaders;
+#endif
+#if defined (__linux__)
+    // Modem watch thread: 1 waiting, -1 ended (driver without TIOCMIWAIT or
+    // port error), -2 not created, 0 not started. Each wake-up bumps modemgeneration
+    pthread_t       modemwatcher;
+    int             modemwatch;
+    uint64_t        modemgeneration;
+    std::mutex      modemlock;
+    std::condition_variable modemchanged;
 #endif
 
+    friend class SerialCapture;
+
 };
 
 
@@ -247,7 +389,7 @@ class timeOut
 public:
 
     // Constructor
-    timeOut();
+    timeOut(Clock *clock=nullptr);
 
     // Init the timer
     void                initTimer();
@@ -256,6 +398,9 @@ public:
     unsigned long int   elapsedTime_ms();
 
 private:
+    // Optional time source, replaces the OS timer when set
+    Clock               *clock;
+    uint64_t            previousClock_us;
 #if defined (NO_POSIX_TIME)
     // Used to store the previous time (for computing timeout)
     LONGLONG       counterFrequency;
@@ -0,0 +1,47 @@
+
+#pragma once
+#include <relayboard.hpp>
+#include <relayprotocol.hpp>
+#include <cstdint>
+
+
+
+// Protocol model of a USB relay board, without any I/O.
+// The host sends 0x50 and the board answers its identifier (0xad: 2 relays,
+// 0xab: 4 relays, 0xac: 8 relays), then 0x51 switches the board to command
+// mode where every frame is a relay state: direct bits on 2 relays boards,
+// inverted bits on bigger boards. With RELAY_HYPOTHETICAL_MODELS, boards of
+// 16 and 32 relays (assumed to answer 0xae and 0xaf) take one byte per 8
+// relays (see RelayFrameFormat), and a chain of boards is modelled as one
+// board taking the frame of the whole chain.
+// With RELAY_PROTOCOL_LCUS the board has no handshake and takes
+// "A0 channel state checksum" frames, invalid frames are counted and ignored.
+class SimBoard
+{
+
+public:
+
+    SimBoard(int relaynumber = 8, int boards = 1, RelayProtocol protocol = RELAY_PROTOCOL_MASK);
+    int input(uint8_t byte, uint8_t* reply);
+    RelayMask getState();
+    uint8_t getIdentifier();
+    int getRelayNumber();
+    bool isReady();
+    bool isInFrame();
+    unsigned long getInvalidFrames();
+    void reset();
+
+private:
+
+    enum Phase { WAITINIT, IDENTIFIED, READY };
+    int inputLcus(uint8_t byte);
+    int relaynumber;
+    RelayProtocol protocol;
+    RelayFrameFormat format;
+    RelayMask state = 0;
+    uint8_t frame[RELAY_MAX_FRAME] = {}; // also holds an LCUS frame
+    unsigned long invalidframes = 0;
+    int received = 0; // bytes of the frame received so far
+    Phase phase = WAITINIT;
+
+};
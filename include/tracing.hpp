@@ -0,0 +1,73 @@
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+
+// Timeline tracer for serial bytes, pacing waits and board init phases.
+// Events go to a buffer preallocated per thread, written without locks by
+// its owner thread; writeChromeJson() flushes every buffer as Chrome
+// trace-event JSON, which chrome://tracing and ui.perfetto.dev both load.
+// Build with USBRELAY_TRACING defined (CMake option USBRELAY_ENABLE_TRACING)
+// to compile the probes in; otherwise the TRACE_* macros expand to nothing.
+namespace tracing
+{
+
+struct Event
+{
+    const char* name; // string literal, never copied
+    uint64_t ts_ns;
+    uint64_t arg;
+    char phase;       // 'B' begin, 'E' end, 'i' instant
+};
+
+extern std::atomic<bool> active;
+
+// Starts recording, each thread gets a buffer of the given size on its first event
+void start(size_t eventsPerThread = 65536);
+// Stops recording, buffers are kept until clear()
+void stop();
+// Releases every buffer (no thread may be recording)
+void clear();
+// Number of events lost because a buffer was full
+uint64_t dropped();
+// Writes every buffered event as Chrome trace-event JSON, returns 1 or -1
+int writeChromeJson(const std::string& path);
+// Appends one event to the buffer of the calling thread
+void record(const char* name, char phase, uint64_t arg);
+
+class Scope
+{
+
+public:
+
+    Scope(const char* name, uint64_t arg = 0) : name(name) {
+        if (active.load(std::memory_order_relaxed))
+            record(name, 'B', arg);
+    }
+    ~Scope() {
+        if (active.load(std::memory_order_relaxed))
+            record(name, 'E', 0);
+    }
+
+private:
+
+    const char* name;
+
+};
+
+}
+
+#if defined (USBRELAY_TRACING)
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name, arg) tracing::Scope TRACE_CONCAT(tracescope_, __LINE__)(name, arg)
+#define TRACE_INSTANT(name, arg) \
+    do { if (tracing::active.load(std::memory_order_relaxed)) tracing::record(name, 'i', arg); } while (0)
+#else
+#define TRACE_SCOPE(name, arg) do {} while (0)
+#define TRACE_INSTANT(name, arg) do {} while (0)
+#endif
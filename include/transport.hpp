@@ -0,0 +1,201 @@
+
+#pragma once
+#include <serialib.hpp>
+#include <simboard.hpp>
+#include <rfc2217.hpp>
+#include <deque>
+#include <memory>
+#include <string>
+
+
+
+// Byte link between Usbrelay and a board. Implementations count their
+// traffic in the SerialMetrics given by setMetrics and use the Clock given
+// by setClock for read timeouts, like serialib.
+class Transport
+{
+
+public:
+
+    virtual ~Transport() {}
+
+    // Opens the link
+    // Returns: 1 on success, -1 otherwise
+    virtual int open() = 0;
+    virtual void close() = 0;
+    virtual bool isOpen() = 0;
+
+    // Writes all the bytes
+    // Returns: 1 on success, -1 otherwise
+    virtual int write(const void* data, unsigned int size) = 0;
+
+    // Reads up to size bytes, waiting at most timeOut_ms for the first one
+    // Returns: the number of bytes read, 0 on timeout, a negative value on error
+    virtual int read(void* buffer, unsigned int size, unsigned int timeOut_ms) = 0;
+
+    // Waits until written bytes left the local output queue
+    // Returns: 1 when sent, 0 on timeout, -1 if the link cannot tell
+    virtual int waitSent(unsigned int timeOut_ms) { (void)timeOut_ms; return -1; }
+
+    // Driver counters and queue depths, see serialib::linkStats
+    // Returns: 1 with counters, 0 with queues only, -1 if the link has none
+    virtual int linkStats(SerialLinkStats* stats) { (void)stats; return -1; }
+
+    // Modem control lines, see serialib::DTR, serialib::RTS and serialib::modemLines
+    // Returns: 1 (or the SerialModemLine bits) on success, -1 if the link has no lines
+    virtual int setDTR(bool status) { (void)status; return -1; }
+    virtual int setRTS(bool status) { (void)status; return -1; }
+    virtual int modemLines() { return -1; }
+
+    virtual void setClock(Clock* clock) { this->clock = clock ? clock : &systemClock(); }
+    virtual void setMetrics(SerialMetrics* metrics) { this->metrics = metrics ? metrics : &ownMetrics; }
+
+protected:
+
+    Clock* clock = &systemClock();
+    SerialMetrics ownMetrics;
+    SerialMetrics* metrics = &ownMetrics;
+
+};
+
+
+
+// Local serial port (serialib)
+class SerialTransport : public Transport
+{
+
+public:
+
+    SerialTransport(const std::string& device, unsigned int baudrate);
+    int open() override;
+    void close() override;
+    bool isOpen() override;
+    int write(const void* data, unsigned int size) override;
+    int read(void* buffer, unsigned int size, unsigned int timeOut_ms) override;
+    int waitSent(unsigned int timeOut_ms) override;
+    int linkStats(SerialLinkStats* stats) override;
+    int setDTR(bool status) override;
+    int setRTS(bool status) override;
+    int modemLines() override;
+    void setClock(Clock* clock) override;
+    void setMetrics(SerialMetrics* metrics) override;
+    serialib& getSerial();
+
+private:
+
+    std::string device;
+    unsigned int baudrate;
+    serialib port;
+
+};
+
+
+
+// In-memory board: bytes written are handed to a SimBoard and its answers
+// are read back, without any I/O or thread. Meant for tests and for
+// benchmarking the protocol logic alone. Nothing can arrive later than the
+// write that caused it, so a read on an empty queue times out at once.
+class LoopbackTransport : public Transport
+{
+
+public:
+
+    LoopbackTransport(int relaynumber = 8, RelayProtocol protocol = RELAY_PROTOCOL_MASK);
+    int open() override;
+    void close() override;
+    bool isOpen() override;
+    int write(const void* data, unsigned int size) override;
+    int read(void* buffer, unsigned int size, unsigned int timeOut_ms) override;
+    int waitSent(unsigned int timeOut_ms) override;
+    SimBoard& getBoard();
+
+private:
+
+    SimBoard board;
+    std::deque<uint8_t> replies;
+    bool opened = false;
+
+};
+
+
+
+// Raw TCP connection to a terminal server port (ser2net "raw" or "telnet"
+// less mode, Moxa/Lantronix TCP server mode), Nagle disabled so that every
+// command leaves at once (UNIX only)
+class TcpTransport : public Transport
+{
+
+public:
+
+    TcpTransport(const std::string& host, unsigned int port);
+    ~TcpTransport();
+    int open() override;
+    void close() override;
+    bool isOpen() override;
+    int write(const void* data, unsigned int size) override;
+    int read(void* buffer, unsigned int size, unsigned int timeOut_ms) override;
+    int linkStats(SerialLinkStats* stats) override;
+
+    // waitSent is not supported (-1): the socket send queue empties when the
+    // peer acknowledges the bytes, delayed ACKs included, which says nothing
+    // of when the terminal server put them on its serial line
+
+protected:
+
+    // Waits for the socket to become readable
+    // Returns: 1 readable, 0 timeout, -1 error
+    int waitReadable(unsigned int timeOut_ms);
+    // Sends bytes without counting them
+    // Returns: 1 on success, -1 otherwise
+    int sendRaw(const void* data, size_t size);
+    std::string host;
+    unsigned int port;
+    int fd = -1;
+
+};
+
+
+
+// Serial port of a networked terminal server speaking RFC 2217 (telnet
+// COM-PORT-OPTION): the line settings are negotiated at open, DTR/RTS are
+// set remotely and the modem lines are those last notified by the server.
+// Control messages are pipelined with the data, nothing waits for their
+// acknowledgement once the link is open (UNIX only).
+class Rfc2217Transport : public TcpTransport
+{
+
+public:
+
+    Rfc2217Transport(const std::string& host, unsigned int port, unsigned int baudrate);
+    int open() override;
+    int write(const void* data, unsigned int size) override;
+    int read(void* buffer, unsigned int size, unsigned int timeOut_ms) override;
+    int setDTR(bool status) override;
+    int setRTS(bool status) override;
+    int modemLines() override;
+    unsigned int getConfirmedBaudrate();
+
+private:
+
+    int receive(unsigned int timeOut_ms);
+    int control(uint8_t value);
+    void onOption(uint8_t command, uint8_t option);
+    void onSub(const uint8_t* sub, size_t size);
+    unsigned int baudrate;
+    unsigned int confirmedbaudrate = 0;
+    bool refused = false;
+    int modemstate = 0;                 // last NOTIFY-MODEMSTATE byte
+    int outputs = SERIAL_LINE_DTR | SERIAL_LINE_RTS;
+    TelnetDecoder decoder;
+    std::vector<uint8_t> pending;       // decoded data not read yet
+    size_t pendingoffset = 0;
+    std::vector<uint8_t> outgoing;      // replies to negotiations and control messages
+
+};
+
+
+
+// Creates the transport of a device name: "tcp://host:port" for a terminal
+// server, "rfc2217://host:port" for an RFC 2217 one, "loop://" or
+// "loop://<relays>" for an in-memory board, anything else is a serial device
+std::unique_ptr<Transport> makeTransport(const std::string& device, unsigned int baudrate);
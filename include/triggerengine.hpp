@@ -0,0 +1,81 @@
+
+#pragma once
+#include <usbrelay.hpp>
+#include <relaywriter.hpp>
+#include <atomic>
+#include <thread>
+
+
+
+// Edge of a modem input line that fires a rule
+enum TriggerEdge
+{
+    TRIGGER_RISING = 1,
+    TRIGGER_FALLING = 2,
+    TRIGGER_BOTH = 3
+};
+
+// Maps an edge of one input line (CTS, DSR, DCD or RI) to a relay change
+struct TriggerRule
+{
+    int line;                   // one SERIAL_LINE_* input bit
+    TriggerEdge edge;
+    unsigned long debounce_us;  // transitions following an edge within this window are ignored
+    Usbrelay* relay;
+    RelayMask setmask;          // relays switched on (bit k = relay k+1)
+    RelayMask clearmask;        // relays switched off
+};
+
+
+
+// Watches the modem input lines of a serial port (typically a spare USB
+// adapter wired to limit switches) on a dedicated thread and applies the
+// relay masks of the matching rules. Debouncing is leading edge: the first
+// transition fires at once, the line is re-sampled when the window closes.
+// Edges come from the transition counters of the driver when it has them,
+// so a pulse that rises and falls between two samples fires both edges.
+// The rules of an edge are merged per board and written by a RelayWriter,
+// so the event thread never waits for the pacing of a board.
+// Rules live in a fixed table, so no allocation happens per event.
+class TriggerEngine
+{
+
+public:
+
+    static constexpr int MAXRULES = 32;
+
+    TriggerEngine(serialib* input);
+    ~TriggerEngine();
+    int addRule(const TriggerRule& rule);
+    int start();
+    void stop();
+    int feed(int lines, uint64_t now_us, const SerialModemCounters* counters = nullptr);
+    uint64_t nextDeadline_us();
+    bool flush(unsigned long milliseconds);
+    const LatencyHistogram& getEdgeToWire();
+    uint64_t getEdges();
+    uint64_t getBounces();
+
+private:
+
+    void run();
+    void fire(int line, bool level, uint64_t detected_us);
+    serialib* input;
+    TriggerRule rules[MAXRULES];
+    int rulecount = 0;
+    int watched = 0;
+    int stable = 0;                 // level of each line as last reported to the rules
+    int raw = 0;                    // level read at the last sample
+    SerialModemCounters counted = {};   // transition counters at the last sample
+    bool counting = false;          // the driver counts transitions
+    int borrowed = 0;               // lines with a transition seen in the levels before the counters
+    uint64_t lockout[4] = {0, 0, 0, 0}; // end of the debounce window of each line
+    bool initialized = false;
+    LatencyHistogram edgetowire;
+    RelayWriter writer;
+    std::atomic<uint64_t> edges {0};
+    std::atomic<uint64_t> bounces {0};
+    std::atomic<bool> running {false};
+    std::thread worker;
+
+};
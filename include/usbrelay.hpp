@@ -1,7 +1,14 @@
 
 #pragma once
 #include <serialib.hpp>
+#include <transport.hpp>
+#include <relayboard.hpp>
+#include <relayprotocol.hpp>
+#include <relaypack.hpp>
+#include <clock.hpp>
+#include <metrics.hpp>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <bitset>
@@ -12,40 +19,171 @@ using std::string;
 
 
 
+// Time spent in each stage of the last command (setState or initBoard), in nanoseconds
+struct RelayTiming
+{
+    uint64_t encode_ns = 0;  // building the command byte
+    uint64_t write_ns = 0;   // writeChar syscall(s)
+    uint64_t pacing_ns = 0;  // waits after each byte sent
+    uint64_t receive_ns = 0; // waiting for and reading the answer
+    uint64_t wire_ns = 0;    // write return until the output queue drained (wire tracking only, 0 otherwise)
+};
+
+
 
+// USB relay board whose size is detected by initBoard, or chain of boards of
+// that size. The frame format is chosen once, when the size is known, and
+// the command protocol when the board is created (setProtocol); see
+// BasicUsbrelay for boards whose size and protocol are known at compile time.
 class Usbrelay
 {
 
 public:
     
-    Usbrelay(const string& port,int relaynumber = 8);
+    Usbrelay(const string& port,int relaynumber = 8,int boards = 1);
+    Usbrelay(std::unique_ptr<Transport> transport,int relaynumber = 8,int boards = 1);
+    virtual ~Usbrelay() = default;
     int openCom();  
     int closeCom();
-    int  initBoard();
+    virtual int initBoard();
     int setState(int*);
     int setState(int);
+    int setMask(RelayMask state);
+    int forceMask(RelayMask state);
+    int updateState(uint8_t setmask, uint8_t clearmask);
+    int updateMask(RelayMask setmask, RelayMask clearmask);
     char getState();
+    RelayMask getMask();
     char getrx();
     int getSpeed();
     std::string getPort();
     int getRelayNumber();
+    int getBoardCount();
+    void setProtocol(RelayProtocol protocol);
+    RelayProtocol getProtocol();
     int setPort(const std::string &port);
-    
+    void setClock(Clock* clock);
+    Clock* getClock();
+    const RelayTiming& getTiming();
+    const RelayMetrics& getMetrics();
+    const SerialMetrics& getSerialMetrics();
+    int getLinkStats(SerialLinkStats* stats);
+    void setWireTracking(bool enabled);
+    void countCoalesced(uint64_t commands);
+    Transport* getTransport();
+
+protected:
+
+    static uint64_t stampNs();
+    void selectModel(int relaynumber);
+    int sendState(RelayMask state, const uint8_t* command, int size, uint64_t start, int probe);
+    RelayMask changedRelays(RelayMask state);
+    std::recursive_mutex commandlock; // one command at a time when several threads drive the board
+
 private:
 
+    int handshake();
+    int command(RelayMask state, int probe);
     int send(char  data, unsigned long milliseconds);
+    int send(const uint8_t* frame, int size, unsigned long milliseconds);
     int recieve(int nbyte);
     void bufferrxAdd(char elt);
     void buffertxAdd(char elt);
     int baudrate;
-    int relaynumber;
+    int relaynumber; // relays of one board
+    int boards;      // boards chained on the port
     std::string device; 
     std::vector<char> buffertx =  std::vector<char>(8);
     std::vector<char> bufferrx =  std::vector<char>(8);
-    std::unique_ptr<serialib> boardinterface;
+    std::unique_ptr<Transport> boardinterface; // created from device by openCom unless given to the constructor
+    std::mutex linklock; // boardinterface replaced or closed by openCom/closeCom while getLinkStats reads it from another thread
+    Clock* clock = &systemClock();
+    RelayTiming timing;
+    RelayMetrics metrics;
+    SerialMetrics serialmetrics;
+    bool wiretracking = false;
+    RelayFrameFormat format = RelayFrameFormat::of(8); // selected by selectModel
+    RelayProtocol protocol = RELAY_PROTOCOL_MASK;
+    int (*encodecommand)(const RelayFrameFormat&, RelayMask, RelayMask, uint8_t*) = MaskProtocol::encode; // selected by setProtocol
+    bool handshaking = MaskProtocol::handshake; // selected by setProtocol
+    RelayMask state = 0; // last state sent
+    bool stateknown = false; // the board holds state (LCUS boards are only updated for the relays changed)
     
 };
 
+
+
+// USB relay board with N relays known at compile time, or chain of BOARDS
+// such boards, speaking Protocol (MaskProtocol or LcusProtocol): commands are
+// encoded inline with the constexpr RelayBoardModel and protocol, relay
+// indices are checked at compile time and initBoard fails if the board
+// answers another size. It can be used wherever a Usbrelay is expected:
+// initBoard is virtual, so the size check also applies through a Usbrelay*.
+// setState and getState hide the base methods instead; through a Usbrelay*
+// they take the runtime encoder, which sends the same frames since the
+// format stays that of N (masked to the N relays), and getState returns the
+// first 8 relays as a char.
+template <int N, int BOARDS = 1, typename Protocol = MaskProtocol>
+class BasicUsbrelay : public Usbrelay
+{
+
+public:
+
+    using Model = RelayBoardModel<N, BOARDS>;
+
+    BasicUsbrelay(const string& port) : Usbrelay(port, N, BOARDS) { this->setProtocol(Protocol::id); }
+    BasicUsbrelay(std::unique_ptr<Transport> transport) : Usbrelay(std::move(transport), N, BOARDS) { this->setProtocol(Protocol::id); }
+
+    // Runs the init handshake
+    // Returns: 1 if a board with N relays answered, -1 otherwise
+    int initBoard() override {
+        int status = Usbrelay::initBoard();
+        if (this->getRelayNumber() != Model::relays) { // Another board: keep encoding for N
+            this->selectModel(N);
+            return -1;
+        }
+        return status;
+    }
+
+    // Sets the state of the relays, bit k = relay k+1
+    // Returns: 1 if the state is successfully set, -1 otherwise
+    int setState(int state) {
+        return this->send(RelayMask(state) & Model::mask, state);
+    }
+
+    // Sets the state of the relays from on/off values, relay 1 first
+    int setState(const int* commandarray) {
+        return this->send(Model::pack(commandarray), -1);
+    }
+
+    // Switches one relay, keeping the others as last set
+    // Parameters: RELAY - relay index, 1 to Model::relays
+    //             on - new state of the relay
+    template <int RELAY>
+    int setRelay(bool on) {
+        std::lock_guard<std::recursive_mutex> guard(this->commandlock);
+        RelayMask state = this->getMask();
+        return this->setState(on ? state | Model::template bit<RELAY>() : state & ~Model::template bit<RELAY>());
+    }
+
+    // Returns the state last sent, bit k = relay k+1
+    RelayMask getState() {
+        return this->getMask();
+    }
+
+private:
+
+    int send(RelayMask state, int probe) {
+        std::lock_guard<std::recursive_mutex> guard(this->commandlock);
+        uint64_t start = stampNs();
+        uint8_t command[Protocol::maxCommand(Model::format)];
+        int size = Protocol::encode(Model::format, this->changedRelays(state), state, command);
+        return this->sendState(state, command, size, start, probe);
+    }
+
+};
+
 std::vector<std::string> scanBoard();
 std::bitset<8> charToBitset(char);
+std::bitset<32> maskToBitset(RelayMask);
 void os_sleep(unsigned long);
\ No newline at end of file
@@ -0,0 +1,78 @@
+
+#pragma once
+#include <cstdint>
+
+
+
+// Statically defined tracepoints compatible with <sys/sdt.h> (SystemTap
+// "stapsdt" v3 ELF notes), without depending on systemtap headers.
+// Each probe site is a single nop plus a note describing where its
+// arguments live; bpftrace, perf and bcc attach to it at run time. The
+// serial and relay libraries are static, so the probes live in the linked
+// executable and the tracer targets it:
+//
+//     bpftrace -e 'usdt:./usbrelay:usbrelay:readchar_return { @[arg1] = count(); }'
+//     perf buildid-cache --add ./usbrelay && perf record -e sdt_usbrelay:send_entry
+//
+// Nothing is executed when no tracer is attached. Arguments are widened to
+// signed 64 bit integers. Probes are emitted on x86-64 and AArch64 ELF
+// targets; elsewhere, or with USBRELAY_NO_USDT defined, they compile to nothing.
+
+#if !defined (USBRELAY_NO_USDT) && defined (__ELF__) && (defined (__x86_64__) || defined (__aarch64__)) \
+    && (defined (__GNUC__) || defined (__clang__))
+#define USDT_ENABLED 1
+#endif
+
+#if defined (USDT_ENABLED)
+
+#if defined (__x86_64__)
+#define USDT_CONSTRAINT "nor"
+#else
+#define USDT_CONSTRAINT "r"
+#endif
+
+#define USDT_ARG(value) ((int64_t)(value))
+
+#define USDT_NOTE(provider, name, argformat)                                      \
+    "990: nop\n"                                                                  \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                 \
+    ".balign 4\n"                                                                 \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                            \
+    "991: .asciz \"stapsdt\"\n"                                                   \
+    "992: .balign 4\n"                                                            \
+    "993: .8byte 990b\n"                                                          \
+    ".8byte _.stapsdt.base\n"                                                     \
+    ".8byte 0\n"                                                                  \
+    ".asciz \"" #provider "\"\n"                                                  \
+    ".asciz \"" #name "\"\n"                                                      \
+    ".asciz \"" argformat "\"\n"                                                  \
+    "994: .balign 4\n"                                                            \
+    ".popsection\n"                                                               \
+    ".ifndef _.stapsdt.base\n"                                                    \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"      \
+    ".weak _.stapsdt.base\n"                                                      \
+    ".hidden _.stapsdt.base\n"                                                    \
+    "_.stapsdt.base: .space 1\n"                                                  \
+    ".size _.stapsdt.base, 1\n"                                                   \
+    ".popsection\n"                                                               \
+    ".endif\n"
+
+#define USDT_PROBE0(provider, name) \
+    __asm__ __volatile__(USDT_NOTE(provider, name, ""))
+#define USDT_PROBE1(provider, name, a1) \
+    __asm__ __volatile__(USDT_NOTE(provider, name, "-8@%0") :: USDT_CONSTRAINT(USDT_ARG(a1)))
+#define USDT_PROBE2(provider, name, a1, a2) \
+    __asm__ __volatile__(USDT_NOTE(provider, name, "-8@%0 -8@%1") \
+        :: USDT_CONSTRAINT(USDT_ARG(a1)), USDT_CONSTRAINT(USDT_ARG(a2)))
+#define USDT_PROBE3(provider, name, a1, a2, a3) \
+    __asm__ __volatile__(USDT_NOTE(provider, name, "-8@%0 -8@%1 -8@%2") \
+        :: USDT_CONSTRAINT(USDT_ARG(a1)), USDT_CONSTRAINT(USDT_ARG(a2)), USDT_CONSTRAINT(USDT_ARG(a3)))
+
+#else
+
+#define USDT_PROBE0(provider, name) do {} while (0)
+#define USDT_PROBE1(provider, name, a1) do {} while (0)
+#define USDT_PROBE2(provider, name, a1, a2) do {} while (0)
+#define USDT_PROBE3(provider, name, a1, a2, a3) do {} while (0)
+
+#endif
@@ -0,0 +1,74 @@
+#include <clock.hpp>
+#include <chrono>
+#include <thread>
+
+
+
+// Sleeps until the clock reaches an absolute deadline
+// Parameters: deadline - absolute time in microseconds
+void Clock::sleepUntil_us(uint64_t deadline) {
+    uint64_t now = this->now_us();
+    if (deadline > now)
+        this->sleep_us(deadline - now);
+}
+
+// Returns the current monotonic time in microseconds
+uint64_t SystemClock::now_us() {
+    auto elapsed = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+// Blocks the calling thread for the given number of microseconds
+// Parameters: microseconds - time to sleep
+void SystemClock::sleep_us(uint64_t microseconds) {
+    if (microseconds == 0)
+        return;
+    std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+}
+
+// Constructor for the VirtualClock class
+// Parameters: start_us - initial value of the clock
+//             iograce_ms - real time granted to pending I/O before a wait jumps to its deadline
+VirtualClock::VirtualClock(uint64_t start_us, int iograce_ms) : current(start_us), iograce(iograce_ms) {
+}
+
+// Returns the simulated time in microseconds
+uint64_t VirtualClock::now_us() {
+    return current.load(std::memory_order_acquire);
+}
+
+// Jumps the clock forward instead of blocking
+// Parameters: microseconds - simulated time to skip
+void VirtualClock::sleep_us(uint64_t microseconds) {
+    this->set_us(this->now_us() + microseconds);
+}
+
+// Bounds I/O waits to the grace period so that a missing answer costs real
+// milliseconds instead of the whole simulated timeout
+// Parameters: remaining_ms - time left before the deadline (negative = infinite)
+// Returns: the real time to wait in milliseconds
+int VirtualClock::ioWait_ms(int remaining_ms) {
+    if (remaining_ms < 0 || remaining_ms > iograce)
+        return iograce;
+    return remaining_ms;
+}
+
+// Moves the clock forward
+// Parameters: microseconds - amount of simulated time to add
+void VirtualClock::advance_us(uint64_t microseconds) {
+    current.fetch_add(microseconds, std::memory_order_acq_rel);
+}
+
+// Sets the clock to an absolute time, never moving it backwards
+// Parameters: time - new simulated time in microseconds
+void VirtualClock::set_us(uint64_t time) {
+    uint64_t now = current.load(std::memory_order_acquire);
+    while (time > now && !current.compare_exchange_weak(now, time, std::memory_order_acq_rel)) {
+    }
+}
+
+// Returns the process wide system clock
+Clock& systemClock() {
+    static SystemClock clock;
+    return clock;
+}
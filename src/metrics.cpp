@@ -0,0 +1,80 @@
+#include <metrics.hpp>
+#include <bit>
+
+
+
+// Returns the bucket index of a value
+// Parameters: value_us - recorded value in microseconds
+int LatencyHistogram::bucketOf(uint64_t value_us) {
+    if (value_us < SUBBUCKETS)
+        return int(value_us);
+    int exponent = std::bit_width(value_us) - 1;
+    if (exponent >= MAXEXPONENT)
+        return BUCKETS - 1;
+    int mantissa = int(value_us >> (exponent - 3)) & (SUBBUCKETS - 1);
+    return SUBBUCKETS + (exponent - 3) * SUBBUCKETS + mantissa;
+}
+
+// Returns the exclusive upper bound of a bucket in microseconds
+// Parameters: bucket - bucket index
+uint64_t LatencyHistogram::bucketUpper(int bucket) {
+    if (bucket < SUBBUCKETS)
+        return uint64_t(bucket) + 1;
+    int exponent = (bucket - SUBBUCKETS) / SUBBUCKETS + 3;
+    int mantissa = (bucket - SUBBUCKETS) % SUBBUCKETS;
+    return uint64_t(SUBBUCKETS + mantissa + 1) << (exponent - 3);
+}
+
+// Records one value
+// Parameters: value_us - latency in microseconds
+void LatencyHistogram::record(uint64_t value_us) {
+    counts[bucketOf(value_us)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value_us, std::memory_order_relaxed);
+}
+
+// Returns the number of recorded values
+uint64_t LatencyHistogram::getCount() const {
+    return count.load(std::memory_order_relaxed);
+}
+
+// Returns the sum of the recorded values in microseconds
+uint64_t LatencyHistogram::getSum_us() const {
+    return sum.load(std::memory_order_relaxed);
+}
+
+// Returns the number of values stored in one bucket
+// Parameters: bucket - bucket index
+uint64_t LatencyHistogram::getBucketCount(int bucket) const {
+    return counts[bucket].load(std::memory_order_relaxed);
+}
+
+// Returns the number of values in the buckets that end at or below a bound
+// Parameters: bound_us - bound in microseconds
+uint64_t LatencyHistogram::countBelow(uint64_t bound_us) const {
+    uint64_t total = 0;
+    for (int k = 0; k < BUCKETS && bucketUpper(k) <= bound_us; k++)
+        total += this->getBucketCount(k);
+    return total;
+}
+
+// Estimates a percentile from the buckets
+// Parameters: percentile - between 0 and 100
+// Returns: the upper bound of the bucket holding the percentile, in microseconds
+uint64_t LatencyHistogram::percentile(double percentile) const {
+    uint64_t total = 0;
+    for (int k = 0; k < BUCKETS; k++)
+        total += this->getBucketCount(k);
+    if (total == 0)
+        return 0;
+    uint64_t rank = uint64_t(percentile / 100.0 * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int k = 0; k < BUCKETS; k++) {
+        seen += this->getBucketCount(k);
+        if (seen >= rank)
+            return bucketUpper(k);
+    }
+    return bucketUpper(BUCKETS - 1);
+}
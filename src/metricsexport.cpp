@@ -0,0 +1,324 @@
+#include <metricsexport.hpp>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#if defined (__linux__) || defined(__APPLE__)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// A scraper closing mid-response must not raise SIGPIPE in the host process
+#ifdef MSG_NOSIGNAL
+static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static constexpr int SEND_FLAGS = 0; // macOS: SO_NOSIGPIPE set on the socket instead
+#endif
+#endif
+
+
+
+// Bucket bounds of the exported histograms, in microseconds
+static const uint64_t exportBounds[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000,
+                                        25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000};
+
+// Escapes a label value for the exposition format
+// Parameters: value - raw label value
+// Returns: the escaped value
+static std::string escapeLabel(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// Formats microseconds as seconds
+static std::string seconds(uint64_t microseconds) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%g", microseconds / 1e6);
+    return text;
+}
+
+// Writes the HELP and TYPE lines of a metric family
+static void family(std::ostringstream& out, const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+}
+
+// Writes the samples of one histogram; the HDR buckets are folded into the
+// coarse exported bounds (a bucket straddling a bound counts above it)
+static void histogram(std::ostringstream& out, const char* name, const std::string& label, const LatencyHistogram& values) {
+    for (uint64_t bound : exportBounds)
+        out << name << "_bucket{" << label << ",le=\"" << seconds(bound) << "\"} " << values.countBelow(bound) << "\n";
+    out << name << "_bucket{" << label << ",le=\"+Inf\"} " << values.getCount() << "\n";
+    out << name << "_sum{" << label << "} " << seconds(values.getSum_us()) << "\n";
+    out << name << "_count{" << label << "} " << values.getCount() << "\n";
+}
+
+// Registers a relay board, its serial counters are exported with it
+// Parameters: relay - board to export (must outlive the registration)
+//             name - value of the board label, the port name when empty
+void MetricsRegistry::addBoard(Usbrelay* relay, const std::string& name) {
+    std::lock_guard<std::mutex> guard(lock);
+    entries.push_back({name.empty() ? relay->getPort() : name, relay, nullptr});
+}
+
+// Registers a bare serial port
+// Parameters: port - port to export (must outlive the registration)
+//             name - value of the board label
+void MetricsRegistry::addSerial(serialib* port, const std::string& name) {
+    std::lock_guard<std::mutex> guard(lock);
+    entries.push_back({name, nullptr, port});
+}
+
+// Unregisters a board or a port
+// Parameters: name - label given at registration
+void MetricsRegistry::remove(const std::string& name) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (it->name == name)
+            it = entries.erase(it);
+        else
+            ++it;
+    }
+}
+
+// Renders a snapshot of every registered counter
+// Returns: the metrics in Prometheus text format
+std::string MetricsRegistry::render() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::ostringstream out;
+    struct Counter {
+        const char* name;
+        const char* help;
+        std::atomic<uint64_t> SerialMetrics::*member;
+    };
+    const Counter serialcounters[] = {
+        {"usbrelay_serial_tx_bytes_total", "Bytes written to the serial port.", &SerialMetrics::bytestx},
+        {"usbrelay_serial_rx_bytes_total", "Bytes read from the serial port.", &SerialMetrics::bytesrx},
+        {"usbrelay_serial_timeouts_total", "Reads that reached their timeout.", &SerialMetrics::timeouts},
+        {"usbrelay_serial_errors_total", "Failed serial reads and writes.", &SerialMetrics::errors},
+    };
+    for (const Counter& counter : serialcounters) {
+        family(out, counter.name, "counter", counter.help);
+        for (Entry& entry : entries) {
+            const SerialMetrics& serial = entry.relay ? entry.relay->getSerialMetrics() : entry.port->getMetrics();
+            out << counter.name << "{board=\"" << escapeLabel(entry.name) << "\"} "
+                << (serial.*counter.member).load(std::memory_order_relaxed) << "\n";
+        }
+    }
+    std::vector<SerialLinkStats> links(entries.size());
+    std::vector<int> linkstatus(entries.size());
+    for (size_t k = 0; k < entries.size(); k++) {
+        Entry& entry = entries[k];
+        linkstatus[k] = entry.relay ? entry.relay->getLinkStats(&links[k]) : entry.port->linkStats(&links[k]);
+    }
+    struct LinkCounter {
+        const char* name;
+        const char* help;
+        unsigned long SerialLinkStats::*member;
+    };
+    const LinkCounter linkcounters[] = {
+        {"usbrelay_tty_rx_total", "Bytes received by the tty driver (TIOCGICOUNT).", &SerialLinkStats::rx},
+        {"usbrelay_tty_tx_total", "Bytes transmitted by the tty driver (TIOCGICOUNT).", &SerialLinkStats::tx},
+        {"usbrelay_tty_frame_errors_total", "Framing errors reported by the driver.", &SerialLinkStats::frame},
+        {"usbrelay_tty_overruns_total", "UART overruns reported by the driver.", &SerialLinkStats::overrun},
+        {"usbrelay_tty_parity_errors_total", "Parity errors reported by the driver.", &SerialLinkStats::parity},
+        {"usbrelay_tty_breaks_total", "Breaks received by the driver.", &SerialLinkStats::brk},
+        {"usbrelay_tty_buffer_overruns_total", "tty flip buffer overruns.", &SerialLinkStats::bufoverrun},
+    };
+    for (const LinkCounter& counter : linkcounters) {
+        family(out, counter.name, "counter", counter.help);
+        for (size_t k = 0; k < entries.size(); k++) {
+            if (linkstatus[k] == 1)
+                out << counter.name << "{board=\"" << escapeLabel(entries[k].name) << "\"} " << links[k].*counter.member << "\n";
+        }
+    }
+    family(out, "usbrelay_tty_input_queue_bytes", "gauge", "Bytes received but not read yet (FIONREAD).");
+    for (size_t k = 0; k < entries.size(); k++) {
+        if (linkstatus[k] >= 0 && links[k].inqueue >= 0)
+            out << "usbrelay_tty_input_queue_bytes{board=\"" << escapeLabel(entries[k].name) << "\"} " << links[k].inqueue << "\n";
+    }
+    family(out, "usbrelay_tty_output_queue_bytes", "gauge", "Bytes written but not sent yet (TIOCOUTQ).");
+    for (size_t k = 0; k < entries.size(); k++) {
+        if (linkstatus[k] >= 0 && links[k].outqueue >= 0)
+            out << "usbrelay_tty_output_queue_bytes{board=\"" << escapeLabel(entries[k].name) << "\"} " << links[k].outqueue << "\n";
+    }
+    family(out, "usbrelay_serial_read_wait_seconds", "histogram", "Time spent waiting in serial reads.");
+    for (Entry& entry : entries) {
+        const SerialMetrics& serial = entry.relay ? entry.relay->getSerialMetrics() : entry.port->getMetrics();
+        histogram(out, "usbrelay_serial_read_wait_seconds", "board=\"" + escapeLabel(entry.name) + "\"", serial.readwait);
+    }
+
+    struct RelayCounter {
+        const char* name;
+        const char* help;
+        std::atomic<uint64_t> RelayMetrics::*member;
+    };
+    const RelayCounter relaycounters[] = {
+        {"usbrelay_commands_total", "Relay state commands sent.", &RelayMetrics::commands},
+        {"usbrelay_coalesced_commands_total", "Commands merged or skipped because nothing changed.", &RelayMetrics::coalesced},
+        {"usbrelay_timeouts_total", "Board answers that did not arrive in time.", &RelayMetrics::timeouts},
+        {"usbrelay_errors_total", "Failed commands and init sequences.", &RelayMetrics::errors},
+    };
+    for (const RelayCounter& counter : relaycounters) {
+        family(out, counter.name, "counter", counter.help);
+        for (Entry& entry : entries) {
+            if (entry.relay)
+                out << counter.name << "{board=\"" << escapeLabel(entry.name) << "\"} "
+                    << (entry.relay->getMetrics().*counter.member).load(std::memory_order_relaxed) << "\n";
+        }
+    }
+    family(out, "usbrelay_submit_to_wire_seconds", "histogram", "Time from command submission to the write syscall return.");
+    for (Entry& entry : entries) {
+        if (entry.relay)
+            histogram(out, "usbrelay_submit_to_wire_seconds", "board=\"" + escapeLabel(entry.name) + "\"", entry.relay->getMetrics().submittowire);
+    }
+    family(out, "usbrelay_submit_to_actuation_seconds", "histogram", "Time from command submission until the byte left the output queue.");
+    for (Entry& entry : entries) {
+        if (entry.relay)
+            histogram(out, "usbrelay_submit_to_actuation_seconds", "board=\"" + escapeLabel(entry.name) + "\"", entry.relay->getMetrics().submittoactuation);
+    }
+    family(out, "usbrelay_init_handshake_seconds", "histogram", "Duration of the board init sequence.");
+    for (Entry& entry : entries) {
+        if (entry.relay)
+            histogram(out, "usbrelay_init_handshake_seconds", "board=\"" + escapeLabel(entry.name) + "\"", entry.relay->getMetrics().inithandshake);
+    }
+    return out.str();
+}
+
+// Writes the snapshot for the node exporter textfile collector; the file is
+// written next to the target and renamed so that readers never see it partial
+// Parameters: path - destination file, should end with .prom
+// Returns: 1 if the file is written, -1 otherwise
+int MetricsRegistry::writeTextfile(const std::string& path) {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::trunc);
+        if (!out)
+            return -1;
+        out << this->render();
+        if (!out.good())
+            return -1;
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0)
+        return -1;
+    return 1;
+}
+
+
+
+// Constructor for the MetricsServer class
+// Parameters: registry - metrics to serve
+//             port - TCP port to listen on, 0 picks a free one
+//             address - IPv4 address to bind
+MetricsServer::MetricsServer(MetricsRegistry& registry, int port, const std::string& address)
+    : registry(registry), port(port), address(address) {
+}
+
+MetricsServer::~MetricsServer() {
+    this->stop();
+}
+
+// Starts listening and serving in a background thread
+// Returns: 1 if the server is running, -1 otherwise
+int MetricsServer::start() {
+#if defined (__linux__) || defined(__APPLE__)
+    if (running)
+        return 1;
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+        return -1;
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &local.sin_addr) != 1
+        || bind(listener, (struct sockaddr*)&local, sizeof(local)) != 0
+        || listen(listener, 8) != 0 || pipe(wakeup) != 0) {
+        close(listener);
+        listener = -1;
+        return -1;
+    }
+    socklen_t length = sizeof(local);
+    getsockname(listener, (struct sockaddr*)&local, &length);
+    port = ntohs(local.sin_port);
+    running = true;
+    worker = std::thread(&MetricsServer::run, this);
+    return 1;
+#else
+    return -1;
+#endif
+}
+
+// Stops the server and closes the listening socket
+void MetricsServer::stop() {
+#if defined (__linux__) || defined(__APPLE__)
+    if (!running)
+        return;
+    running = false;
+    char stop = 0;
+    if (write(wakeup[1], &stop, 1) != 1) {
+    }
+    worker.join();
+    close(listener);
+    close(wakeup[0]);
+    close(wakeup[1]);
+    listener = wakeup[0] = wakeup[1] = -1;
+#endif
+}
+
+// Returns the TCP port the server listens on
+int MetricsServer::getPort() {
+    return port;
+}
+
+// Accept loop: reads the request head and answers with the current snapshot
+void MetricsServer::run() {
+#if defined (__linux__) || defined(__APPLE__)
+    struct pollfd fds[2];
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeup[0];
+    fds[1].events = POLLIN;
+    while (running) {
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, 2, -1) < 0)
+            continue;
+        if (fds[1].revents)
+            break;
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
+            continue;
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        struct pollfd request = {client, POLLIN, 0};
+        char head[1024];
+        if (poll(&request, 1, 1000) > 0 && read(client, head, sizeof(head)) > 0) {
+            std::string body = registry.render();
+            std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                                   + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            for (size_t done = 0; done < response.size();) {
+                ssize_t written = send(client, response.data() + done, response.size() - done, SEND_FLAGS);
+                if (written <= 0)
+                    break;
+                done += written;
+            }
+        }
+        close(client);
+    }
+#endif
+}
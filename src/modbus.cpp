@@ -0,0 +1,459 @@
+#include <modbus.hpp>
+#include <bit>
+#include <cstring>
+
+
+
+// CRC-16 tables for slicing-by-8: table[0] is the classic byte table,
+// table[k] gives the CRC of a byte followed by k zero bytes
+struct ModbusCrcTables
+{
+    uint16_t table[8][256];
+};
+
+static constexpr ModbusCrcTables makeCrcTables() {
+    ModbusCrcTables tables {};
+    for (int i = 0; i < 256; i++) {
+        uint16_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+        tables.table[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+        for (int i = 0; i < 256; i++)
+            tables.table[k][i] = (tables.table[k - 1][i] >> 8) ^ tables.table[0][tables.table[k - 1][i] & 0xff];
+    return tables;
+}
+
+static constexpr ModbusCrcTables crctables = makeCrcTables();
+
+static constexpr uint16_t crc16(const uint8_t* data, size_t size) {
+    const auto& t = crctables.table;
+    uint16_t crc = 0xffff;
+    for (; size >= 8; data += 8, size -= 8) { // 8 independent lookups per step
+        crc = t[7][(data[0] ^ crc) & 0xff] ^ t[6][data[1] ^ (crc >> 8)] ^ t[5][data[2]] ^ t[4][data[3]]
+            ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    for (; size; data++, size--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xff];
+    return crc;
+}
+
+static constexpr uint8_t crccheck[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+static_assert(crc16(crccheck, sizeof(crccheck)) == 0x4b37, "CRC-16/MODBUS check value");
+
+uint16_t modbusCrc16(const uint8_t* data, size_t size) {
+    return crc16(data, size);
+}
+
+unsigned long modbusFrameGap_us(unsigned int baudrate) {
+    if (baudrate == 0 || baudrate > 19200)
+        return 1750; // Fixed value of the specification above 19200 baud
+    return (38500000ul + baudrate - 1) / baudrate; // 3.5 characters of 11 bits
+}
+
+int modbusResponseSize(const uint8_t* frame, int size) {
+    if (size < 2)
+        return 0;
+    if (frame[1] & 0x80) // Exception: address, function, code, CRC
+        return 5;
+    switch (frame[1]) {
+        case MODBUS_READ_COILS:
+            return size < 3 ? 0 : 5 + frame[2];
+        case MODBUS_WRITE_SINGLE_COIL:
+        case MODBUS_WRITE_MULTIPLE_COILS:
+            return 8;
+    }
+    return -1;
+}
+
+int modbusRequestSize(const uint8_t* frame, int size) {
+    if (size < 2)
+        return 0;
+    switch (frame[1]) {
+        case MODBUS_READ_COILS:
+        case MODBUS_WRITE_SINGLE_COIL:
+            return 8;
+        case MODBUS_WRITE_MULTIPLE_COILS:
+            return size < 7 ? 0 : 9 + frame[6];
+    }
+    return -1;
+}
+
+
+
+// Constructor for the ModbusClient class
+// Parameters: device - bus device (/dev/ttyUSB0, tcp://host:port...), see makeTransport
+//             baudrate - bus speed, sets the silent interval between frames
+ModbusClient::ModbusClient(const std::string& device, unsigned int baudrate) {
+    this->device = device;
+    this->baudrate = baudrate;
+    this->framegap_us = modbusFrameGap_us(baudrate);
+    this->chartime_us = baudrate ? (11000000ul + baudrate - 1) / baudrate : 0;
+}
+
+// Constructor for the ModbusClient class on a given transport
+// Parameters: transport - link to the bus, owned by the client
+//             baudrate - bus speed, sets the silent interval between frames
+ModbusClient::ModbusClient(std::unique_ptr<Transport> transport, unsigned int baudrate)
+    : ModbusClient(std::string(), baudrate) {
+    this->bus = std::move(transport);
+}
+
+ModbusClient::~ModbusClient() {
+    this->stop();
+    this->close();
+}
+
+// Opens the bus
+// Returns: 1 on success, -1 otherwise
+int ModbusClient::open() {
+    if (!device.empty())
+        bus = makeTransport(device, baudrate);
+    if (!bus)
+        return -1;
+    bus->setClock(clock);
+    if (bus->open() != 1)
+        return -1;
+    idlesince = clock->now_us();
+    return 1;
+}
+
+void ModbusClient::close() {
+    if (bus)
+        bus->close();
+}
+
+// Starts the bus thread running the submitted requests
+// Returns: 1 if the thread runs, -1 if the bus is not open
+int ModbusClient::start() {
+    if (running)
+        return 1;
+    if (!bus || !bus->isOpen())
+        return -1;
+    running = true;
+    worker = std::thread(&ModbusClient::run, this);
+    return 1;
+}
+
+// Stops the bus thread once the queued requests are done
+void ModbusClient::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!running)
+            return;
+        running = false;
+    }
+    queued.notify_one();
+    worker.join();
+}
+
+// Queues a request for the bus thread
+// Parameters: request - transaction, kept alive by the caller until done
+//             done - called from the bus thread once request.status is set
+// Returns: 1 if queued, -1 if the bus thread is not running
+int ModbusClient::submit(ModbusRequest* request, std::function<void(ModbusRequest&)> done) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!running)
+        return -1;
+    request->status = 0;
+    queue.push_back(Pending{request, std::move(done), clock->now_us()});
+    queued.notify_one();
+    return 1;
+}
+
+// Runs a request and waits for its answer, through the queue when the bus thread runs
+// Returns: request.status, 1 on success, -1 otherwise
+int ModbusClient::transact(ModbusRequest& request) {
+    if (!running)
+        return this->execute(request);
+    std::mutex donelock;
+    std::condition_variable finished;
+    bool complete = false;
+    int status = this->submit(&request, [&](ModbusRequest&) {
+        std::lock_guard<std::mutex> guard(donelock);
+        complete = true;
+        finished.notify_one();
+    });
+    if (status != 1)
+        return this->execute(request); // Stopped meanwhile
+    std::unique_lock<std::mutex> guard(donelock);
+    finished.wait(guard, [&] { return complete; });
+    return request.status;
+}
+
+// Writes one coil
+// Returns: 1 on success, -1 otherwise
+int ModbusClient::writeSingleCoil(uint8_t slave, uint16_t coil, bool on) {
+    ModbusRequest request;
+    request.slave = slave;
+    request.function = MODBUS_WRITE_SINGLE_COIL;
+    request.address = coil;
+    request.coils[0] = on;
+    return this->transact(request);
+}
+
+// Writes consecutive coils in one frame
+// Parameters: values - bit k of byte k/8 = coil first+k
+// Returns: 1 on success, -1 otherwise
+int ModbusClient::writeMultipleCoils(uint8_t slave, uint16_t first, uint16_t count, const uint8_t* values) {
+    if (count == 0 || count > MODBUS_MAX_COILS)
+        return -1;
+    ModbusRequest request;
+    request.slave = slave;
+    request.function = MODBUS_WRITE_MULTIPLE_COILS;
+    request.address = first;
+    request.count = count;
+    memcpy(request.coils, values, (count + 7) / 8);
+    return this->transact(request);
+}
+
+// Reads consecutive coils
+// Parameters: values - receives bit k of byte k/8 = coil first+k
+// Returns: 1 on success, -1 otherwise
+int ModbusClient::readCoils(uint8_t slave, uint16_t first, uint16_t count, uint8_t* values) {
+    if (count == 0 || count > MODBUS_MAX_COILS)
+        return -1;
+    ModbusRequest request;
+    request.slave = slave;
+    request.address = first;
+    request.count = count;
+    if (this->transact(request) != 1)
+        return -1;
+    memcpy(values, request.coils, (count + 7) / 8);
+    return 1;
+}
+
+// Sets the time source used for the silent intervals and timeouts
+void ModbusClient::setClock(Clock* clock) {
+    this->clock = clock ? clock : &systemClock();
+    if (bus)
+        bus->setClock(this->clock);
+}
+
+// Sets how long a slave has to start answering
+void ModbusClient::setTimeout(unsigned int timeOut_ms) {
+    this->timeout_ms = timeOut_ms;
+}
+
+// Sets the wait after a broadcast, while the slaves process it
+void ModbusClient::setBroadcastDelay(unsigned int delay_ms) {
+    this->broadcastdelay_ms = delay_ms;
+}
+
+// Returns the silent interval kept before every frame
+unsigned long ModbusClient::getFrameGap_us() {
+    return framegap_us;
+}
+
+const ModbusMetrics& ModbusClient::getMetrics() {
+    return metrics;
+}
+
+Transport* ModbusClient::getTransport() {
+    return bus.get();
+}
+
+// Bus thread: runs the queued requests in order
+void ModbusClient::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        queued.wait(guard, [this] { return !queue.empty() || !running; });
+        if (queue.empty())
+            break;
+        Pending pending = std::move(queue.front());
+        queue.pop_front();
+        guard.unlock();
+        metrics.queuewait.record(clock->now_us() - pending.submitted);
+        this->execute(*pending.request);
+        if (pending.done)
+            pending.done(*pending.request);
+        guard.lock();
+    }
+}
+
+// Builds the frame of a request, runs it and checks the answer
+// Returns: request.status
+int ModbusClient::execute(ModbusRequest& request) {
+    std::lock_guard<std::mutex> guard(buslock);
+    uint8_t frame[MODBUS_MAX_FRAME];
+    int size = 0;
+    frame[size++] = request.slave;
+    frame[size++] = request.function;
+    frame[size++] = request.address >> 8;
+    frame[size++] = request.address & 0xff;
+    int bytes = (request.count + 7) / 8;
+    switch (request.function) {
+        case MODBUS_READ_COILS:
+            frame[size++] = request.count >> 8;
+            frame[size++] = request.count & 0xff;
+            break;
+        case MODBUS_WRITE_SINGLE_COIL:
+            frame[size++] = (request.coils[0] & 1) ? 0xff : 0x00;
+            frame[size++] = 0x00;
+            break;
+        case MODBUS_WRITE_MULTIPLE_COILS:
+            frame[size++] = request.count >> 8;
+            frame[size++] = request.count & 0xff;
+            frame[size++] = bytes;
+            memcpy(frame + size, request.coils, bytes);
+            size += bytes;
+            break;
+        default:
+            request.status = -1;
+            return -1;
+    }
+    uint16_t crc = modbusCrc16(frame, size);
+    frame[size++] = crc & 0xff; // CRC is sent low byte first
+    frame[size++] = crc >> 8;
+
+    uint8_t answer[MODBUS_MAX_FRAME];
+    int answersize = this->exchange(request, frame, size, answer);
+    request.status = -1;
+    request.exception = 0;
+    if (answersize < 0)
+        return -1;
+    if (request.slave == MODBUS_BROADCAST) {
+        request.status = 1;
+        return 1;
+    }
+    if (answer[1] == (request.function | 0x80)) {
+        request.exception = answer[2];
+        metricAdd(metrics.exceptions);
+        return -1;
+    }
+    if (answer[1] != request.function)
+        return -1;
+    if (request.function == MODBUS_READ_COILS) {
+        if (answer[2] != bytes)
+            return -1;
+        memcpy(request.coils, answer + 3, bytes);
+    } else if (memcmp(answer + 2, frame + 2, 4) != 0) { // Writes echo the address and value or count
+        return -1;
+    }
+    metricAdd(metrics.transactions);
+    request.status = 1;
+    return 1;
+}
+
+// Sends a request frame after the silent interval and receives the answer
+// Parameters: request - request being run
+//             frame, size - request frame
+//             answer - receives the answer frame
+// Returns: the answer size, 0 for a broadcast, -1 on timeout or invalid answer
+int ModbusClient::exchange(ModbusRequest& request, const uint8_t* frame, int size, uint8_t* answer) {
+    if (!bus)
+        return -1;
+    clock->sleepUntil_us(idlesince + framegap_us);
+    uint64_t start = clock->now_us();
+    if (bus->write(frame, size) != 1)
+        return -1;
+    idlesince = start + size * chartime_us; // The frame is on the wire until then
+    if (request.slave == MODBUS_BROADCAST) {
+        metricAdd(metrics.broadcasts);
+        idlesince += broadcastdelay_ms * 1000ul;
+        return 0;
+    }
+    unsigned int gap_ms = (unsigned int)((framegap_us + 999) / 1000);
+    int received = 0;
+    int expected = 0;
+    while (expected == 0 || received < expected) {
+        unsigned int wait_ms = received ? gap_ms : timeout_ms + (unsigned int)(size * chartime_us / 1000);
+        int nbyte = bus->read(answer + received, MODBUS_MAX_FRAME - received, wait_ms);
+        if (nbyte <= 0) {
+            if (received == 0)
+                metricAdd(metrics.timeouts);
+            else
+                metricAdd(metrics.crcerrors); // Frame cut by a silent interval
+            idlesince = clock->now_us();
+            return -1;
+        }
+        received += nbyte;
+        expected = modbusResponseSize(answer, received);
+        if (expected < 0 || expected > MODBUS_MAX_FRAME)
+            break;
+    }
+    idlesince = clock->now_us();
+    metrics.transaction.record(idlesince - start);
+    if (expected < 0 || received != expected || answer[0] != request.slave
+        || modbusCrc16(answer, expected - 2) != (answer[expected - 2] | answer[expected - 1] << 8)) {
+        metricAdd(metrics.crcerrors);
+        return -1;
+    }
+    return expected;
+}
+
+
+
+// Constructor for the ModbusRelay class
+// Parameters: bus - Modbus client of the bus (not owned)
+//             slave - address of the module
+//             relaynumber - number of relays, 1 to 32
+//             firstcoil - coil of relay 1
+ModbusRelay::ModbusRelay(ModbusClient* bus, uint8_t slave, int relaynumber, uint16_t firstcoil) {
+    this->bus = bus;
+    this->slave = slave;
+    this->relaynumber = relaynumber;
+    this->firstcoil = firstcoil;
+    this->mask = relaynumber >= 32 ? 0xffffffffu : (1u << relaynumber) - 1;
+}
+
+// Reads the coils of the module to learn its state
+// Returns: 1 if the module answered, -1 otherwise
+int ModbusRelay::initBoard() {
+    uint8_t values[4] = {};
+    if (bus->readCoils(slave, firstcoil, relaynumber, values) != 1)
+        return -1;
+    state = (values[0] | values[1] << 8 | values[2] << 16 | (RelayMask)values[3] << 24) & mask;
+    stateknown = true;
+    return 1;
+}
+
+// Sets the state of the relays, bit k = relay k+1
+// Returns: 1 if the state is successfully set, -1 otherwise
+int ModbusRelay::setState(int state) {
+    return this->setMask(RelayMask(state));
+}
+
+// Sets the state of every relay with a single frame
+// Returns: 1 if the state is successfully set, -1 otherwise
+int ModbusRelay::setMask(RelayMask state) {
+    state &= mask;
+    RelayMask changed = stateknown ? state ^ this->state : mask;
+    if (changed == 0)
+        return 1;
+    int status;
+    if (std::has_single_bit(changed)) {
+        int k = std::countr_zero(changed);
+        status = bus->writeSingleCoil(slave, firstcoil + k, (state >> k) & 1);
+    } else {
+        uint8_t values[4] = {uint8_t(state), uint8_t(state >> 8), uint8_t(state >> 16), uint8_t(state >> 24)};
+        status = bus->writeMultipleCoils(slave, firstcoil, relaynumber, values);
+    }
+    this->state = state;
+    stateknown = status == 1;
+    return status;
+}
+
+// Switches some relays on and others off, keeping the rest as last set
+int ModbusRelay::updateMask(RelayMask setmask, RelayMask clearmask) {
+    return this->setMask((state | setmask) & ~clearmask);
+}
+
+// Returns the state of relays 1 to 8 as a character
+char ModbusRelay::getState() {
+    return (char)state;
+}
+
+// Returns the state last set, bit k = relay k+1
+RelayMask ModbusRelay::getMask() {
+    return state;
+}
+
+int ModbusRelay::getRelayNumber() {
+    return relaynumber;
+}
+
+uint8_t ModbusRelay::getSlave() {
+    return slave;
+}
@@ -0,0 +1,241 @@
+#include <modbussim.hpp>
+#include <clock.hpp>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+
+// Constructor for the ModbusSlaveSim class
+// Parameters: options - modules simulated on the bus
+ModbusSlaveSim::ModbusSlaveSim(const ModbusSimOptions& options)
+    : options(options), coils(options.slaves, 0) {
+}
+
+ModbusSlaveSim::~ModbusSlaveSim() {
+    this->stop();
+}
+
+// Creates the pseudo-terminal and starts answering the master
+// Returns: 1 if the simulator is running, -1 otherwise
+int ModbusSlaveSim::start() {
+    if (running)
+        return 1;
+    char name[128];
+    if (openpty(&master, &slave, name, nullptr, nullptr) != 0)
+        return -1;
+    struct termios raw;
+    tcgetattr(slave, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(slave, TCSANOW, &raw);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    if (pipe(wakeup) != 0) {
+        close(master);
+        close(slave);
+        return -1;
+    }
+    port = name;
+    running = true;
+    worker = std::thread(&ModbusSlaveSim::run, this);
+    return 1;
+}
+
+// Stops the simulator and removes the pseudo-terminal
+void ModbusSlaveSim::stop() {
+    if (!running)
+        return;
+    running = false;
+    char stop = 0;
+    if (write(wakeup[1], &stop, 1) != 1) {
+    }
+    worker.join();
+    close(wakeup[0]);
+    close(wakeup[1]);
+    close(master);
+    close(slave);
+    master = slave = wakeup[0] = wakeup[1] = -1;
+}
+
+// Returns the path of the device to open on the master side
+std::string ModbusSlaveSim::getPort() {
+    return port;
+}
+
+// Returns the coils of a module, bit k = coil k
+RelayMask ModbusSlaveSim::getCoils(uint8_t slave) {
+    std::lock_guard<std::mutex> guard(lock);
+    int index = slave - options.firstslave;
+    return index >= 0 && index < options.slaves ? coils[index] : 0;
+}
+
+// Waits until the coils of a module reach a given state
+// Parameters: slave - module address
+//             coils - expected coils
+//             milliseconds - maximum wait
+// Returns: true if the state was reached in time
+bool ModbusSlaveSim::waitCoils(uint8_t slave, RelayMask coils, unsigned long milliseconds) {
+    uint64_t deadline = systemClock().now_us() + milliseconds * 1000;
+    while (this->getCoils(slave) != coils) {
+        if (systemClock().now_us() >= deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    return true;
+}
+
+// Returns a copy of the counters of the simulated bus
+ModbusSimStats ModbusSlaveSim::getStats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+// Event loop of the simulator thread: bytes are gathered until a request is
+// complete, a silent interval in the middle of a frame discards it
+void ModbusSlaveSim::run() {
+    struct pollfd fds[2];
+    fds[0].fd = master;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeup[0];
+    fds[1].events = POLLIN;
+    int gap_ms = (int)((modbusFrameGap_us(options.baudrate) + 999) / 1000);
+    uint8_t frame[MODBUS_MAX_FRAME];
+    int size = 0;
+    while (running) {
+        fds[0].revents = fds[1].revents = 0;
+        int ready = poll(fds, 2, size ? gap_ms : -1);
+        if (ready < 0)
+            continue;
+        if (fds[1].revents)
+            break;
+        if (ready == 0) { // Silent interval: what was gathered is a frame
+            if (modbusRequestSize(frame, size) < 0) {
+                this->process(frame, size); // Unknown function, size given by the gap
+            } else {
+                std::lock_guard<std::mutex> guard(lock);
+                stats.partial++;
+            }
+            size = 0;
+            continue;
+        }
+        int nbyte = read(master, frame + size, sizeof(frame) - size);
+        if (nbyte <= 0)
+            continue;
+        size += nbyte;
+        int expected;
+        while ((expected = modbusRequestSize(frame, size)) > 0 && expected <= size) {
+            this->process(frame, expected);
+            size -= expected;
+            memmove(frame, frame + expected, size);
+        }
+        if (expected > MODBUS_MAX_FRAME || size == (int)sizeof(frame))
+            size = 0;
+    }
+}
+
+// Checks a request, applies it and answers
+// Parameters: frame, size - request with its CRC
+void ModbusSlaveSim::process(const uint8_t* frame, int size) {
+    uint8_t reply[MODBUS_MAX_FRAME];
+    int nreply = 0;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (size < 4 || modbusCrc16(frame, size - 2) != (frame[size - 2] | frame[size - 1] << 8)) {
+            stats.crcerrors++;
+            return;
+        }
+        if (frame[0] == MODBUS_BROADCAST) {
+            stats.broadcasts++;
+            for (RelayMask& module : coils)
+                this->answer(module, frame, reply);
+            return;
+        }
+        int index = frame[0] - options.firstslave;
+        if (index < 0 || index >= options.slaves) {
+            stats.otheraddress++;
+            return;
+        }
+        stats.requests++;
+        nreply = this->answer(coils[index], frame, reply);
+        if (reply[1] & 0x80)
+            stats.exceptions++;
+        stats.replies++;
+    }
+    if (options.replydelay_us)
+        std::this_thread::sleep_for(std::chrono::microseconds(options.replydelay_us));
+    if (write(master, reply, nreply) != nreply) {
+    }
+}
+
+// Applies a request to the coils of one module
+// Parameters: coils - coils of the module
+//             frame - request, CRC already checked
+//             reply - receives the answer with its CRC
+// Returns: the answer size
+int ModbusSlaveSim::answer(RelayMask& coils, const uint8_t* frame, uint8_t* reply) {
+    uint8_t function = frame[1];
+    int address = frame[2] << 8 | frame[3];
+    int value = frame[4] << 8 | frame[5];
+    int size = 0;
+    reply[size++] = frame[0];
+    reply[size++] = function;
+    uint8_t exception = 0;
+    switch (function) {
+        case MODBUS_READ_COILS:
+            if (value < 1 || value > 2000)
+                exception = MODBUS_ILLEGAL_VALUE;
+            else if (address + value > options.coils)
+                exception = MODBUS_ILLEGAL_ADDRESS;
+            else {
+                RelayMask bits = coils >> address;
+                int bytes = (value + 7) / 8;
+                reply[size++] = bytes;
+                for (int k = 0; k < bytes; k++) {
+                    int left = value - 8 * k;
+                    reply[size++] = uint8_t(bits >> 8 * k) & (left >= 8 ? 0xff : (1 << left) - 1);
+                }
+            }
+            break;
+        case MODBUS_WRITE_SINGLE_COIL:
+            if (value != 0xff00 && value != 0x0000)
+                exception = MODBUS_ILLEGAL_VALUE;
+            else if (address >= options.coils)
+                exception = MODBUS_ILLEGAL_ADDRESS;
+            else {
+                coils = value ? coils | (RelayMask(1) << address) : coils & ~(RelayMask(1) << address);
+                memcpy(reply + size, frame + 2, 4);
+                size += 4;
+            }
+            break;
+        case MODBUS_WRITE_MULTIPLE_COILS:
+            if (value < 1 || value > MODBUS_MAX_COILS || frame[6] != (value + 7) / 8)
+                exception = MODBUS_ILLEGAL_VALUE;
+            else if (address + value > options.coils)
+                exception = MODBUS_ILLEGAL_ADDRESS;
+            else {
+                RelayMask bits = 0;
+                for (int k = 0; k < frame[6]; k++)
+                    bits |= RelayMask(frame[7 + k]) << 8 * k;
+                RelayMask written = (value >= 32 ? ~RelayMask(0) : (RelayMask(1) << value) - 1) << address;
+                coils = (coils & ~written) | ((bits << address) & written);
+                memcpy(reply + size, frame + 2, 4);
+                size += 4;
+            }
+            break;
+        default:
+            exception = MODBUS_ILLEGAL_FUNCTION;
+    }
+    if (exception) {
+        size = 2;
+        reply[1] = function | 0x80;
+        reply[size++] = exception;
+    }
+    uint16_t crc = modbusCrc16(reply, size);
+    reply[size++] = crc & 0xff;
+    reply[size++] = crc >> 8;
+    return size;
+}
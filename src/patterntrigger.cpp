@@ -0,0 +1,214 @@
+#include <patterntrigger.hpp>
+#include <tracing.hpp>
+#include <algorithm>
+
+
+
+// Adds a pattern to the automaton, only allowed before compile()
+// Parameters: pattern - non empty byte string
+// Returns: the pattern id (an identical pattern keeps its id), -1 on error
+int PatternMatcher::addPattern(const std::string& pattern) {
+    if (compiled || pattern.empty())
+        return -1;
+    for (size_t k = 0; k < patterns.size(); k++) {
+        if (patterns[k] == pattern)
+            return (int)k;
+    }
+    patterns.push_back(pattern);
+    return (int)patterns.size() - 1;
+}
+
+// Builds the trie, the failure links and the full transition table
+// Returns: 1 if the automaton is ready, -1 if there is no pattern
+int PatternMatcher::compile() {
+    if (patterns.empty())
+        return -1;
+    next.assign(256, -1);
+    output.assign(1, -1);
+    for (size_t id = 0; id < patterns.size(); id++) {
+        int32_t current = 0;
+        for (unsigned char byte : patterns[id]) {
+            int32_t& child = next[((size_t)current << 8) | byte];
+            if (child < 0) {
+                child = (int32_t)output.size();
+                output.push_back(-1);
+                next.resize(next.size() + 256, -1);
+            }
+            current = next[((size_t)current << 8) | byte];
+        }
+        output[current] = (int32_t)id;
+    }
+
+    // Breadth first: a state's failure is resolved before its children's
+    size_t states = output.size();
+    std::vector<int32_t> fail(states, 0);
+    std::vector<int32_t> queue;
+    queue.reserve(states);
+    match.assign(states, 0);
+    dictlink.assign(states, 0);
+    for (int byte = 0; byte < 256; byte++) {
+        int32_t& child = next[byte];
+        if (child < 0)
+            child = 0;
+        else
+            queue.push_back(child);
+    }
+    for (size_t head = 0; head < queue.size(); head++) {
+        int32_t current = queue[head];
+        match[current] = output[current] >= 0 ? current : match[fail[current]];
+        dictlink[current] = match[fail[current]];
+        for (int byte = 0; byte < 256; byte++) {
+            int32_t& child = next[((size_t)current << 8) | byte];
+            int32_t fallback = next[((size_t)fail[current] << 8) | byte];
+            if (child < 0) {
+                child = fallback;
+            } else {
+                fail[child] = fallback;
+                queue.push_back(child);
+            }
+        }
+    }
+    state = 0;
+    compiled = true;
+    return 1;
+}
+
+// Forgets the bytes seen so far (start of a new stream)
+void PatternMatcher::reset() {
+    state = 0;
+}
+
+// Returns the number of distinct patterns
+int PatternMatcher::getPatternCount() {
+    return (int)patterns.size();
+}
+
+// Returns the number of automaton states (0 before compile)
+int PatternMatcher::getStateCount() {
+    return (int)output.size();
+}
+
+// Returns the pattern registered with an id
+const std::string& PatternMatcher::getPattern(int id) {
+    return patterns[id];
+}
+
+
+
+// Constructor for the PatternTrigger class
+// Parameters: input - opened serial port whose received bytes are scanned
+PatternTrigger::PatternTrigger(serialib* input) {
+    this->input = input;
+}
+
+PatternTrigger::~PatternTrigger() {
+    this->stop();
+}
+
+// Adds a rule, only allowed before start()
+// Parameters: rule - pattern to relay mapping
+// Returns: 1 if the rule is added, -1 otherwise
+int PatternTrigger::addRule(const PatternRule& rule) {
+    if (running || !rule.relay)
+        return -1;
+    int id = matcher.addPattern(rule.pattern);
+    if (id < 0)
+        return -1;
+    rules.push_back(rule);
+    ruleid.push_back(id);
+    burst.reserve(rules.size()); // No allocation while scanning
+    return 1;
+}
+
+// Compiles the patterns and starts the reading thread
+// Returns: 1 if the thread runs, -1 if there is no rule
+int PatternTrigger::start() {
+    if (running)
+        return 1;
+    if (matcher.getStateCount() == 0 && matcher.compile() != 1)
+        return -1;
+    writer.start();
+    running = true;
+    worker = std::thread(&PatternTrigger::run, this);
+    return 1;
+}
+
+// Stops the reading thread (returns within the 50 ms read slice), then the
+// writer once the commands of the last matches are sent
+void PatternTrigger::stop() {
+    if (running) {
+        running = false;
+        worker.join();
+    }
+    writer.stop();
+}
+
+// Waits until the commands of the matches seen so far are written
+// Parameters: milliseconds - maximum wait
+// Returns: true if nothing is left to write
+bool PatternTrigger::flush(unsigned long milliseconds) {
+    return writer.flush(milliseconds);
+}
+
+// Scans received bytes and hands the masks of the matching rules, merged per
+// board, to the writer; called by the reading thread, public so that the
+// matching can be driven without a port (see flush)
+// Parameters: data, size - bytes in reception order
+// Returns: the number of matches
+int PatternTrigger::feed(const uint8_t* data, size_t size) {
+    if (matcher.getStateCount() == 0 && matcher.compile() != 1)
+        return -1;
+    uint64_t received = systemClock().now_us();
+    metricAdd(bytes, size);
+    burst.clear();
+    int found = matcher.scan(data, size, [&](int id, size_t end) {
+        TRACE_SCOPE("pattern", id);
+        (void)end;
+        metricAdd(matches);
+        for (size_t k = 0; k < rules.size(); k++) {
+            if (ruleid[k] != id)
+                continue;
+            const PatternRule& rule = rules[k];
+            auto board = std::find_if(burst.begin(), burst.end(),
+                                      [&](const RelayUpdate& update) { return update.relay == rule.relay; });
+            if (board == burst.end()) {
+                burst.push_back({rule.relay, rule.setmask, rule.clearmask});
+                continue;
+            }
+            // A later match wins for the relays it names
+            board->setmask = (board->setmask & ~rule.clearmask) | rule.setmask;
+            board->clearmask = (board->clearmask & ~rule.setmask) | rule.clearmask;
+        }
+    });
+    if (!burst.empty()) {
+        writer.start(); // Already running unless feed is driven directly
+        writer.submit(burst.data(), (int)burst.size(), received, &matchtowire);
+    }
+    return found;
+}
+
+// Reading loop: one readAvailable per burst, bounded so that stop() is seen
+void PatternTrigger::run() {
+    while (running) {
+        int nbyte = input->readAvailable(buffer, sizeof(buffer), 50);
+        if (nbyte > 0)
+            this->feed(buffer, (size_t)nbyte);
+        else if (nbyte < 0)
+            systemClock().sleep_us(50000); // Port lost, retry at the slice rate
+    }
+}
+
+// Returns the latency between the read holding a match and the write of the command
+const LatencyHistogram& PatternTrigger::getMatchToWire() {
+    return matchtowire;
+}
+
+// Returns the number of bytes scanned
+uint64_t PatternTrigger::getBytes() {
+    return bytes.load(std::memory_order_relaxed);
+}
+
+// Returns the number of pattern matches
+uint64_t PatternTrigger::getMatches() {
+    return matches.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,205 @@
+#include <relayfleet.hpp>
+#include <algorithm>
+#include <bit>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+
+// Constructor for the RelayFleet class
+// Parameters: relays - largest number of relays of one board (chains included), 1 to 32
+RelayFleet::RelayFleet(int relays) {
+    slotbits = (int)std::bit_ceil((unsigned)std::clamp(relays, 1, 32));
+    slotmask = slotbits >= 32 ? 0xffffffffu : (RelayMask(1) << slotbits) - 1;
+}
+
+// Adds a board to the fleet. Its current mask becomes the desired state and
+// the board is written at the next commit.
+// Parameters: board - opened and initialized board, not owned
+// Returns: the index of the board, -1 if it has more relays than a slot holds
+int RelayFleet::addBoard(Usbrelay* board) {
+    if (board == nullptr || board->getRelayNumber() > slotbits)
+        return -1;
+    int index = boards.size();
+    boards.push_back(board);
+    size_t words = (boards.size() * slotbits + 63) / 64;
+    desired.resize(words, 0);
+    committed.resize(words, 0);
+    stale.resize((boards.size() + 63) / 64, 0);
+    held.resize(stale.size(), 0);
+    pending.resize(stale.size(), 0);
+    writeSlot(desired, index, board->getMask());
+    writeSlot(committed, index, board->getMask());
+    this->invalidate(index);
+    return index;
+}
+
+int RelayFleet::getBoardCount() {
+    return boards.size();
+}
+
+// Sets the desired state of one board, written by the next commit if it differs
+// Returns: 1 on success, -1 for an unknown board
+int RelayFleet::setDesired(int board, RelayMask state) {
+    if (board < 0 || board >= (int)boards.size())
+        return -1;
+    writeSlot(desired, board, state);
+    return 1;
+}
+
+// Sets the desired state of every board, board 0 first (see packRelays to
+// build them from per-relay values)
+// Returns: 1 on success, -1 if states does not hold one mask per board
+int RelayFleet::setDesired(std::span<const RelayMask> states) {
+    if (states.size() != boards.size())
+        return -1;
+    int perword = 64 / slotbits;
+    for (size_t word = 0; word < desired.size(); word++) { // Whole words, no read-modify-write
+        uint64_t bits = 0;
+        for (int k = 0; k < perword && word * perword + k < states.size(); k++)
+            bits |= uint64_t(states[word * perword + k] & slotmask) << (k * slotbits);
+        desired[word] = bits;
+    }
+    return 1;
+}
+
+RelayMask RelayFleet::getDesired(int board) {
+    return board >= 0 && board < (int)boards.size() ? readSlot(desired, board) : 0;
+}
+
+// Returns the state last written successfully to a board
+RelayMask RelayFleet::getCommitted(int board) {
+    return board >= 0 && board < (int)boards.size() ? readSlot(committed, board) : 0;
+}
+
+// Forces a write of a board at the next commit, whether its state changed or
+// not (after a reconnect or a power cycle the committed state is not trusted).
+// The write goes through forceMask, so every relay is sent even on boards
+// that are otherwise sent the changed relays only.
+void RelayFleet::invalidate(int board) {
+    if (board >= 0 && board < (int)boards.size())
+        stale[board / 64] |= uint64_t(1) << (board % 64);
+}
+
+void RelayFleet::invalidateAll() {
+    for (int board = 0; board < (int)boards.size(); board++)
+        this->invalidate(board);
+}
+
+// Leaves a board out of the commits, or puts it back, keeping its changes pending
+// Parameters: board - board index
+//             held - true while the board cannot be written (disconnected)
+void RelayFleet::hold(int board, bool held) {
+    if (board < 0 || board >= (int)boards.size())
+        return;
+    uint64_t bit = uint64_t(1) << (board % 64);
+    this->held[board / 64] = held ? this->held[board / 64] | bit : this->held[board / 64] & ~bit;
+}
+
+// Lists the boards whose desired state differs from the committed one or
+// that were invalidated, held boards excepted, in increasing order
+// Parameters: boards - receives the board indexes
+// Returns: the number of boards
+int RelayFleet::diff(std::vector<int>& boards) {
+    std::fill(pending.begin(), pending.end(), 0);
+    relayschanged = 0;
+    size_t word = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; word + 2 <= desired.size(); word += 2) {
+        __m128i difference = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&desired[word]),
+                                           _mm_loadu_si128((const __m128i*)&committed[word]));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(difference, zero)) == 0xffff)
+            continue; // 128 bits of boards unchanged
+        this->markWord(word, desired[word] ^ committed[word]);
+        this->markWord(word + 1, desired[word + 1] ^ committed[word + 1]);
+    }
+#endif
+    for (; word < desired.size(); word++)
+        this->markWord(word, desired[word] ^ committed[word]);
+    boards.clear();
+    for (size_t k = 0; k < pending.size(); k++) {
+        for (uint64_t bits = (pending[k] | stale[k]) & ~held[k]; bits; bits &= bits - 1)
+            boards.push_back(k * 64 + std::countr_zero(bits));
+    }
+    return boards.size();
+}
+
+// Writes the boards found by diff() and records the others as coalesced
+// Parameters: failed - receives the boards whose write failed, if not null
+// Returns: the number of boards written, -1 if a write failed (the board
+//          stays pending and is retried by the next commit)
+int RelayFleet::commit(std::vector<int>* failed) {
+    this->diff(changed);
+    if (failed)
+        failed->clear();
+    int failures = 0;
+    for (int board : changed) {
+        RelayMask state = readSlot(desired, board);
+        bool forced = (stale[board / 64] >> (board % 64)) & 1;
+        if ((forced ? boards[board]->forceMask(state) : boards[board]->setMask(state)) != 1) {
+            failures++;
+            if (failed)
+                failed->push_back(board);
+            continue;
+        }
+        writeSlot(committed, board, state);
+        stale[board / 64] &= ~(uint64_t(1) << (board % 64));
+    }
+    int written = changed.size() - failures;
+    int held = 0;
+    for (uint64_t bits : this->held)
+        held += std::popcount(bits);
+    int avoided = boards.size() - changed.size() - held;
+    for (int board = 0, next = 0; board < (int)boards.size() && avoided; board++) { // Boards skipped count as coalesced
+        if (next < (int)changed.size() && changed[next] == board)
+            next++;
+        else if (!((this->held[board / 64] >> (board % 64)) & 1))
+            boards[board]->countCoalesced(1);
+    }
+    stats.commits++;
+    stats.writes += written;
+    stats.avoided += avoided;
+    stats.held += held;
+    stats.failures += failures;
+    stats.relayschanged += relayschanged;
+    stats.lastwrites = written;
+    stats.lastavoided = avoided;
+    stats.lastheld = held;
+    return failures ? -1 : written;
+}
+
+// Returns a copy of the counters of the fleet
+RelayFleetStats RelayFleet::getStats() {
+    return stats;
+}
+
+RelayMask RelayFleet::readSlot(const std::vector<uint64_t>& vector, int board) {
+    size_t bit = size_t(board) * slotbits;
+    return RelayMask(vector[bit / 64] >> (bit % 64)) & slotmask;
+}
+
+void RelayFleet::writeSlot(std::vector<uint64_t>& vector, int board, RelayMask state) {
+    size_t bit = size_t(board) * slotbits;
+    uint64_t& word = vector[bit / 64];
+    word = (word & ~(uint64_t(slotmask) << (bit % 64))) | (uint64_t(state & slotmask) << (bit % 64));
+}
+
+// Marks the boards of one word whose slot differs and counts their relays,
+// held boards excepted
+// Parameters: word - index in the packed vectors
+//             difference - desired XOR committed for that word
+void RelayFleet::markWord(size_t word, uint64_t difference) {
+    int perword = 64 / slotbits;
+    while (difference) {
+        int slot = std::countr_zero(difference) / slotbits;
+        size_t board = word * perword + slot;
+        uint64_t owned = uint64_t(slotmask) << (slot * slotbits);
+        pending[board / 64] |= uint64_t(1) << (board % 64);
+        if (!((held[board / 64] >> (board % 64)) & 1))
+            relayschanged += std::popcount(difference & owned);
+        difference &= ~owned;
+    }
+}
@@ -0,0 +1,237 @@
+#include <relaymux.hpp>
+#include <tracing.hpp>
+#include <algorithm>
+#include <chrono>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+
+// Constructor for the RelayMux class
+// Parameters: board - opened and initialized board
+//             clients - number of pseudo-terminals to create
+RelayMux::RelayMux(Usbrelay* board, int clients) {
+    this->board = board;
+    this->clients.resize(clients > 0 ? clients : 1);
+}
+
+RelayMux::~RelayMux() {
+    this->stop();
+}
+
+// Creates the pseudo-terminals and starts serving them
+// Returns: 1 if the multiplexer runs, -1 if a pseudo-terminal cannot be created
+int RelayMux::start() {
+    if (running)
+        return 1;
+    int boards = board->getBoardCount();
+    int relaynumber = board->getRelayNumber() / boards; // Clients see the same board or chain
+    mask = RelayFrameFormat::of(relaynumber, boards).mask;
+    shadow = board->getMask() & mask;
+    stats = RelayMuxStats();
+    if (pipe2(wakeup, O_CLOEXEC) != 0)
+        return -1;
+    for (Client& client : clients) {
+        int slave;
+        char name[128];
+        if (openpty(&client.master, &slave, name, nullptr, nullptr) != 0) {
+            this->running = true; // Let stop() release what was created
+            this->stop();
+            return -1;
+        }
+        struct termios raw;
+        tcgetattr(slave, &raw);
+        cfmakeraw(&raw); // Replies must not be echoed back before the client configures the port
+        tcsetattr(slave, TCSANOW, &raw);
+        close(slave); // The master reports a hang-up until a client opens the port
+        fcntl(client.master, F_SETFL, fcntl(client.master, F_GETFL) | O_NONBLOCK | O_CLOEXEC);
+        client.port = name;
+        client.decoder = SimBoard(relaynumber, boards, board->getProtocol());
+        client.connected = false;
+    }
+    running = true;
+    server = std::thread(&RelayMux::serve, this);
+    sender = std::thread(&RelayMux::writer, this);
+    return 1;
+}
+
+// Stops serving the clients, after the last merged state is written
+void RelayMux::stop() {
+    if (!running)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(lock); // The writer checks running under the lock
+        running = false;
+    }
+    if (wakeup[1] >= 0 && write(wakeup[1], "x", 1) != 1) {
+    }
+    changed.notify_all();
+    if (server.joinable())
+        server.join();
+    if (sender.joinable())
+        sender.join();
+    for (Client& client : clients) {
+        if (client.master >= 0)
+            close(client.master);
+        client.master = -1;
+    }
+    close(wakeup[0]);
+    close(wakeup[1]);
+    wakeup[0] = wakeup[1] = -1;
+}
+
+// Returns the number of pseudo-terminals
+int RelayMux::getClientCount() {
+    return (int)clients.size();
+}
+
+// Returns the device path a client opens instead of the board
+// Parameters: client - index of the pseudo-terminal
+std::string RelayMux::getClientPort(int client) {
+    return clients[client].port;
+}
+
+// Returns the merged state, bit k set when relay k+1 is on
+RelayMask RelayMux::getShadowState() {
+    std::lock_guard<std::mutex> guard(lock);
+    return shadow;
+}
+
+// Returns the counters of the multiplexer
+RelayMuxStats RelayMux::getStats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+// Client loop: waits for bytes on the connected terminals; terminals without
+// client report a hang-up continuously, so they are checked every 50 ms
+void RelayMux::serve() {
+    std::vector<struct pollfd> fds;
+    std::vector<Client*> owners;
+    while (running) {
+        fds.assign(1, {wakeup[0], POLLIN, 0});
+        owners.assign(1, nullptr);
+        bool waiting = false;
+        for (Client& client : clients) {
+            if (!client.connected) {
+                struct pollfd probe = {client.master, POLLIN, 0};
+                if (poll(&probe, 1, 0) == 1 && (probe.revents & POLLHUP)) {
+                    waiting = true;
+                    continue;
+                }
+                client.connected = true;
+                std::lock_guard<std::mutex> guard(lock);
+                stats.connects++;
+            }
+            fds.push_back({client.master, POLLIN, 0});
+            owners.push_back(&client);
+        }
+        if (poll(fds.data(), fds.size(), waiting ? 50 : -1) < 0 && errno != EINTR)
+            break;
+        for (size_t k = 1; k < fds.size(); k++) {
+            if (!fds[k].revents)
+                continue;
+            if ((fds[k].revents & POLLIN) && this->receive(*owners[k]) == 1)
+                continue;
+            this->disconnect(*owners[k]); // Hang-up: the client closed the port
+        }
+    }
+}
+
+// Handles the bytes of a client: answers the handshake, merges the states
+// Parameters: client - client with pending bytes
+// Returns: 1 on success, -1 if the client hung up
+int RelayMux::receive(Client& client) {
+    uint8_t buffer[256];
+    ssize_t nbyte = read(client.master, buffer, sizeof(buffer));
+    if (nbyte < 0 && (errno == EAGAIN || errno == EINTR))
+        return 1;
+    if (nbyte <= 0)
+        return -1;
+    for (ssize_t k = 0; k < nbyte; k++) {
+        bool ready = client.decoder.isReady();
+        uint8_t reply;
+        if (client.decoder.input(buffer[k], &reply) == 1 && write(client.master, &reply, 1) != 1)
+            return -1;
+        if (!ready) {
+            client.reference = client.decoder.isReady();
+            continue;
+        }
+        if (client.decoder.isInFrame()) // Rest of a wide state to come
+            continue;
+        if (client.reference) { // State of the client's initialization
+            client.view = client.decoder.getState();
+            client.reference = false;
+            continue;
+        }
+        this->merge(client, client.decoder.getState());
+    }
+    return 1;
+}
+
+// Applies the relays a client changed to the shadow state
+// Parameters: client - client that sent a state
+//             state - decoded state, bit k set when relay k+1 is on
+void RelayMux::merge(Client& client, RelayMask state) {
+    TRACE_SCOPE("mux.merge", state);
+    RelayMask delta = (state ^ client.view) & mask;
+    client.view = state;
+    std::lock_guard<std::mutex> guard(lock);
+    shadow = (shadow & ~delta) | (state & delta);
+    stats.commands++;
+    queued++;
+    dirty = true;
+    changed.notify_one();
+}
+
+// Forgets the protocol state of a client that closed its port
+void RelayMux::disconnect(Client& client) {
+    client.decoder.reset();
+    client.reference = false;
+    client.connected = false;
+}
+
+// Writer loop: sends the shadow state whenever it changed; setState paces the
+// board, and everything merged meanwhile goes out in the next write. A failed
+// write is retried with a backoff until it succeeds or the multiplexer stops.
+void RelayMux::writer() {
+    bool written = false;         // the board holds last
+    RelayMask last = 0;
+    unsigned long backoff_ms = 0; // wait before retrying a failed write, 0 after a success
+    uint64_t retried = 0;         // commands of the failed write
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        if (backoff_ms) // A client state cuts the wait short, merged with the failed one
+            changed.wait_for(guard, std::chrono::milliseconds(backoff_ms), [this] { return dirty || !running; });
+        else
+            changed.wait(guard, [this] { return dirty || !running; });
+        if (!dirty && !running)
+            break;
+        RelayMask target = shadow;
+        uint64_t merged = queued + retried;
+        dirty = false;
+        queued = 0;
+        guard.unlock();
+        bool attempted = !written || target != last;
+        bool sent = attempted && board->setMask(target) == 1;
+        written = sent || (written && !attempted);
+        if (sent)
+            last = target;
+        bool failed = attempted && !sent;
+        retried = failed ? merged : 0;
+        backoff_ms = failed ? std::min(backoff_ms ? backoff_ms * 2 : 50, 2000ul) : 0;
+        // Commands already on the board count as merged, a failed write is retried
+        uint64_t saved = !attempted ? merged : sent ? merged - 1 : 0;
+        if (saved)
+            board->countCoalesced(saved);
+        guard.lock();
+        stats.writes += sent;
+        stats.failures += failed;
+        stats.coalesced += saved;
+    }
+}
@@ -0,0 +1,173 @@
+#include <relaypack.hpp>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+static_assert(sizeof(bool) == 1, "bool spans are converted as bytes");
+
+
+
+// Returns bit k set when values[k] is nonzero, n up to 64
+static uint64_t packBits(const uint8_t* values, int n) {
+    uint64_t bits = 0;
+    int k = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; k + 16 <= n; k += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(values + k));
+        uint64_t off = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+        bits |= (~off & 0xffff) << k;
+    }
+#endif
+    if constexpr (std::endian::native == std::endian::little) {
+        for (; k + 8 <= n; k += 8) {
+            uint64_t chunk;
+            memcpy(&chunk, values + k, 8);
+            uint64_t high = (((chunk & 0x7f7f7f7f7f7f7f7full) + 0x7f7f7f7f7f7f7f7full) | chunk) & 0x8080808080808080ull;
+            bits |= (((high >> 7) * 0x0102040810204080ull) >> 56) << k; // Gathers the 8 flags in the top byte
+        }
+    }
+    for (; k < n; k++)
+        bits |= uint64_t(values[k] != 0) << k;
+    return bits;
+}
+
+static uint64_t packBits(const int* values, int n) {
+    uint64_t bits = 0;
+    int k = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; k + 16 <= n; k += 16) {
+        const __m128i* chunk = (const __m128i*)(values + k);
+        __m128i low = _mm_packs_epi32(_mm_cmpeq_epi32(_mm_loadu_si128(chunk), zero),
+                                      _mm_cmpeq_epi32(_mm_loadu_si128(chunk + 1), zero));
+        __m128i high = _mm_packs_epi32(_mm_cmpeq_epi32(_mm_loadu_si128(chunk + 2), zero),
+                                       _mm_cmpeq_epi32(_mm_loadu_si128(chunk + 3), zero));
+        uint64_t off = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(low, high));
+        bits |= (~off & 0xffff) << k;
+    }
+#endif
+    for (; k < n; k++)
+        bits |= uint64_t(values[k] != 0) << k;
+    return bits;
+}
+
+// Writes values[k] = bit k, n up to 64
+static void unpackBits(uint64_t bits, int n, uint8_t* values) {
+    int k = 0;
+#if defined(__SSE2__)
+    const __m128i select = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+    const __m128i one = _mm_set1_epi8(1);
+    for (; k + 16 <= n; k += 16) {
+        __m128i chunk = _mm_cvtsi32_si128(int((bits >> k) & 0xffff));
+        chunk = _mm_unpacklo_epi8(chunk, chunk);   // l l h h
+        chunk = _mm_unpacklo_epi16(chunk, chunk);  // l l l l h h h h
+        chunk = _mm_unpacklo_epi32(chunk, chunk);  // l x8, h x8
+        chunk = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(chunk, select), select), one);
+        _mm_storeu_si128((__m128i*)(values + k), chunk);
+    }
+#endif
+    if constexpr (std::endian::native == std::endian::little) {
+        for (; k + 8 <= n; k += 8) {
+            uint64_t byte = (bits >> k) & 0xff;
+#if defined(__BMI2__)
+            uint64_t chunk = _pdep_u64(byte, 0x0101010101010101ull);
+#else
+            uint64_t chunk = ((((byte * 0x0101010101010101ull) & 0x8040201008040201ull) + 0x7f7f7f7f7f7f7f7full) >> 7)
+                             & 0x0101010101010101ull; // Byte j keeps bit j, then is turned into 0 or 1
+#endif
+            memcpy(values + k, &chunk, 8);
+        }
+    }
+    for (; k < n; k++)
+        values[k] = (bits >> k) & 1;
+}
+
+static void unpackBits(uint64_t bits, int n, int* values) {
+    int k = 0;
+#if defined(__SSE2__)
+    const __m128i select = _mm_set_epi32(8, 4, 2, 1);
+    for (; k + 4 <= n; k += 4) {
+        __m128i chunk = _mm_and_si128(_mm_set1_epi32(int((bits >> k) & 0xf)), select);
+        _mm_storeu_si128((__m128i*)(values + k), _mm_srli_epi32(_mm_cmpeq_epi32(chunk, select), 31));
+    }
+#endif
+    for (; k < n; k++)
+        values[k] = (bits >> k) & 1;
+}
+
+
+
+// Boards converted together: as many as fit in 64 bits when none straddles
+// two words, one at a time otherwise
+static size_t boardsPerWord(int relays) {
+    return 64 % relays == 0 ? 64 / relays : 1;
+}
+
+static RelayMask boardMask(int relays) {
+    return relays >= 32 ? 0xffffffffu : (RelayMask(1) << relays) - 1;
+}
+
+template <typename T>
+static int packFleet(const T* values, size_t count, int relays, std::span<RelayMask> masks) {
+    if (relays < 1 || relays > 32 || count != size_t(relays) * masks.size())
+        return -1;
+    size_t group = boardsPerWord(relays);
+    RelayMask mask = boardMask(relays);
+    for (size_t board = 0; board < masks.size(); board += group) {
+        size_t boards = std::min(group, masks.size() - board);
+        uint64_t bits = packBits(values + board * relays, int(boards * relays));
+        for (size_t k = 0; k < boards; k++)
+            masks[board + k] = RelayMask(bits >> (k * relays)) & mask;
+    }
+    return 1;
+}
+
+template <typename T>
+static int unpackFleet(std::span<const RelayMask> masks, int relays, T* values, size_t count) {
+    if (relays < 1 || relays > 32 || count != size_t(relays) * masks.size())
+        return -1;
+    size_t group = boardsPerWord(relays);
+    RelayMask mask = boardMask(relays);
+    for (size_t board = 0; board < masks.size(); board += group) {
+        size_t boards = std::min(group, masks.size() - board);
+        uint64_t bits = 0;
+        for (size_t k = 0; k < boards; k++)
+            bits |= uint64_t(masks[board + k] & mask) << (k * relays);
+        unpackBits(bits, int(boards * relays), values + board * relays);
+    }
+    return 1;
+}
+
+
+
+int packRelays(std::span<const uint8_t> values, int relays, std::span<RelayMask> masks) {
+    return packFleet(values.data(), values.size(), relays, masks);
+}
+
+int packRelays(std::span<const bool> values, int relays, std::span<RelayMask> masks) {
+    return packFleet((const uint8_t*)values.data(), values.size(), relays, masks);
+}
+
+int packRelays(std::span<const int> values, int relays, std::span<RelayMask> masks) {
+    return packFleet(values.data(), values.size(), relays, masks);
+}
+
+int unpackRelays(std::span<const RelayMask> masks, int relays, std::span<uint8_t> values) {
+    return unpackFleet(masks, relays, values.data(), values.size());
+}
+
+int unpackRelays(std::span<const RelayMask> masks, int relays, std::span<bool> values) {
+    return unpackFleet(masks, relays, (uint8_t*)values.data(), values.size());
+}
+
+int unpackRelays(std::span<const RelayMask> masks, int relays, std::span<int> values) {
+    return unpackFleet(masks, relays, values.data(), values.size());
+}
@@ -0,0 +1,278 @@
+#include <relayreconciler.hpp>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+
+
+
+// Offset of a board in the resync interval: golden ratio steps spread any
+// number of boards evenly, so the rewrites never come in one burst
+static uint64_t resyncOffset_us(int board, unsigned long interval_ms) {
+    double fraction = board * 0.6180339887498949;
+    fraction -= (uint64_t)fraction;
+    return uint64_t(fraction * interval_ms * 1000.0);
+}
+
+// Constructor for the RelayReconciler class
+// Parameters: relays - largest number of relays of one board (see RelayFleet)
+RelayReconciler::RelayReconciler(int relays) : fleet(relays) {
+}
+
+RelayReconciler::~RelayReconciler() {
+    this->stop();
+}
+
+// Adds a board to keep converged. Its current mask is the desired state
+// until setDesired is called, and it is written at the next pass.
+// Parameters: board - opened and initialized board, not owned
+// Returns: the index of the board, -1 if the fleet slots are too small
+int RelayReconciler::addBoard(Usbrelay* board) {
+    std::lock_guard<std::mutex> pass(steplock);
+    std::lock_guard<std::mutex> guard(lock);
+    int index = fleet.addBoard(board);
+    if (index < 0)
+        return -1;
+    boards.push_back(board);
+    requested.push_back(board->getMask());
+    BoardHealth boardhealth;
+    boardhealth.resyncat = clock->now_us() + resync_ms * 1000ul + resyncOffset_us(index, resync_ms);
+    health.push_back(boardhealth);
+    dirty = true;
+    wake.notify_one();
+    return index;
+}
+
+// Declares the state a board must have
+// Returns: 1 on success, -1 for an unknown board
+int RelayReconciler::setDesired(int board, RelayMask state) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (board < 0 || board >= (int)requested.size())
+        return -1;
+    requested[board] = state;
+    dirty = true;
+    wake.notify_one();
+    return 1;
+}
+
+// Declares the state of every board, board 0 first
+// Returns: 1 on success, -1 if states does not hold one mask per board
+int RelayReconciler::setDesired(std::span<const RelayMask> states) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (states.size() != requested.size())
+        return -1;
+    std::copy(states.begin(), states.end(), requested.begin());
+    dirty = true;
+    wake.notify_one();
+    return 1;
+}
+
+// Declares the state of one relay
+// Parameters: board - board index
+//             relay - relay number, 1 to 32
+//             on - true to switch it on
+// Returns: 1 on success, -1 for an unknown board or relay
+int RelayReconciler::setRelay(int board, int relay, bool on) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (board < 0 || board >= (int)requested.size() || relay < 1 || relay > 32)
+        return -1;
+    RelayMask bit = RelayMask(1) << (relay - 1);
+    requested[board] = on ? requested[board] | bit : requested[board] & ~bit;
+    dirty = true;
+    wake.notify_one();
+    return 1;
+}
+
+RelayMask RelayReconciler::getDesired(int board) {
+    std::lock_guard<std::mutex> guard(lock);
+    return board >= 0 && board < (int)requested.size() ? requested[board] : 0;
+}
+
+// Returns true when the last pass left every board at its desired state and
+// nothing was declared since
+bool RelayReconciler::isConverged() {
+    std::lock_guard<std::mutex> guard(lock);
+    return converged && !dirty;
+}
+
+// Reports a board that lost its state (power cycle, reconnect seen by the
+// caller): it is initialized again and its desired state reasserted
+void RelayReconciler::boardReset(int board) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (board < 0 || board >= (int)health.size())
+        return;
+    health[board].reset = true;
+    health[board].retryat = 0;
+    dirty = true;
+    wake.notify_one();
+}
+
+// Sets how often every board is rewritten whatever its state, 0 to disable
+void RelayReconciler::setResyncInterval(unsigned long interval_ms) {
+    std::lock_guard<std::mutex> guard(lock);
+    resync_ms = interval_ms;
+    uint64_t now = clock->now_us();
+    for (size_t board = 0; board < health.size(); board++)
+        health[board].resyncat = now + interval_ms * 1000ul + resyncOffset_us(board, interval_ms);
+    wake.notify_one();
+}
+
+// Sets the wait between two reconnect attempts of a board
+void RelayReconciler::setRetryInterval(unsigned long interval_ms) {
+    std::lock_guard<std::mutex> guard(lock);
+    retry_ms = interval_ms;
+}
+
+// Sets the time source of the resync and retry schedules (the boards keep their own)
+void RelayReconciler::setClock(Clock* clock) {
+    std::lock_guard<std::mutex> guard(lock);
+    this->clock = clock ? clock : &systemClock();
+}
+
+// Runs one reconciliation pass: reconnects the boards due for it, forces the
+// resync of the boards due for it and commits the boards that differ
+// Returns: the number of boards written, -1 if a write failed
+int RelayReconciler::step() {
+    std::lock_guard<std::mutex> pass(steplock);
+    uint64_t now = clock->now_us();
+    std::vector<int> recovering;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        dirty = false;
+        fleet.setDesired(requested);
+        for (int board = 0; board < (int)health.size(); board++) {
+            BoardHealth& boardhealth = health[board];
+            if (boardhealth.down || boardhealth.reset) {
+                fleet.hold(board, true);
+                if (boardhealth.retryat <= now)
+                    recovering.push_back(board);
+            } else if (resync_ms && boardhealth.resyncat <= now) {
+                fleet.invalidate(board);
+                boardhealth.resyncat = std::max(boardhealth.resyncat + resync_ms * 1000ul, now);
+                stats.resyncs++;
+            }
+        }
+    }
+    for (int board : recovering)
+        this->recover(board, now);
+    int written = fleet.commit(&failed);
+    RelayFleetStats fleetstats = fleet.getStats();
+    std::lock_guard<std::mutex> guard(lock);
+    for (int board : failed) {
+        health[board].down = true;
+        health[board].retryat = now + retry_ms * 1000ul;
+        fleet.hold(board, true);
+    }
+    stats.steps++;
+    stats.writes += fleetstats.lastwrites;
+    stats.avoided += fleetstats.lastavoided;
+    stats.failures += failed.size();
+    converged = std::none_of(health.begin(), health.end(),
+                             [](const BoardHealth& boardhealth) { return boardhealth.down || boardhealth.reset; });
+    return written;
+}
+
+// Brings a board back: reopens its port if a write failed, runs the init
+// handshake after a reported power cycle only and schedules its desired state
+// Returns: 1 if the board is back, -1 otherwise
+int RelayReconciler::recover(int board, uint64_t now) {
+    Usbrelay* relay = boards[board];
+    bool reopen, reset;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        reopen = health[board].down;
+        reset = health[board].reset;
+    }
+    int status = 1;
+    if (reopen) {
+        relay->closeCom();
+        status = relay->openCom();
+    }
+    // A board that kept its power is still in command mode, where the 0x50
+    // request would be taken as a relay state: reasserting the state is enough
+    if (status == 1 && reset && relay->initBoard() != 1)
+        status = -1;
+    std::lock_guard<std::mutex> guard(lock);
+    if (status != 1) {
+        health[board].retryat = now + retry_ms * 1000ul;
+        stats.reconnectfailures++;
+        return -1;
+    }
+    health[board].down = health[board].reset = false;
+    fleet.hold(board, false);
+    fleet.invalidate(board); // Relays reset by the handshake, or changed while the link was down
+    stats.reconnects++;
+    return 1;
+}
+
+// Returns the time of the next pass, 0 if nothing is scheduled
+uint64_t RelayReconciler::nextDeadline_us() {
+    std::lock_guard<std::mutex> guard(lock);
+    return this->deadline();
+}
+
+uint64_t RelayReconciler::deadline() {
+    if (dirty)
+        return clock->now_us();
+    uint64_t next = 0;
+    for (const BoardHealth& boardhealth : health) {
+        uint64_t at = boardhealth.down || boardhealth.reset ? boardhealth.retryat : resync_ms ? boardhealth.resyncat : 0;
+        if (at && (next == 0 || at < next))
+            next = at;
+    }
+    return next;
+}
+
+// Starts the controller thread, which runs a pass whenever a desired state
+// changes or a reconnect or resync is due
+// Returns: 1 if the thread runs
+int RelayReconciler::start() {
+    if (running)
+        return 1;
+    running = true;
+    worker = std::thread(&RelayReconciler::run, this);
+    return 1;
+}
+
+// Stops the controller thread
+void RelayReconciler::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!running)
+            return;
+        running = false;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+// Returns a copy of the counters of the controller
+RelayReconcilerStats RelayReconciler::getStats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+// Controller thread: one pass, then sleep until the next deadline or a new
+// desired state
+void RelayReconciler::run() {
+    while (running) {
+        this->step();
+        std::unique_lock<std::mutex> guard(lock);
+        uint64_t next = this->deadline();
+        if (!running || dirty)
+            continue;
+        if (next == 0) {
+            wake.wait(guard, [this] { return dirty || !running; });
+            continue;
+        }
+        uint64_t now = clock->now_us();
+        if (next <= now)
+            continue;
+        int remaining_ms = (int)std::min<uint64_t>((next - now + 999) / 1000, INT_MAX);
+        if (!wake.wait_for(guard, std::chrono::milliseconds(clock->ioWait_ms(remaining_ms)),
+                           [this] { return dirty || !running; })) {
+            Clock* time = clock;
+            guard.unlock();
+            time->sleepUntil_us(next); // Instant on a virtual clock
+        }
+    }
+}
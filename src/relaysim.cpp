@@ -0,0 +1,305 @@
+#include <relaysim.hpp>
+#include <clock.hpp>
+#include <chrono>
+#include <cstring>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+
+// Constructor for the RelaySimulator class
+// Parameters: options - behaviour of the simulated board
+RelaySimulator::RelaySimulator(const RelaySimOptions& options)
+    : options(options), board(options.relaynumber, options.boards, options.protocol), random(options.seed) {
+}
+
+RelaySimulator::~RelaySimulator() {
+    this->stop();
+}
+
+// Creates the pseudo-terminal and starts answering the host
+// Returns: 1 if the simulator is running, -1 otherwise
+int RelaySimulator::start() {
+    if (running)
+        return 1;
+    char name[128];
+    if (openpty(&master, &slave, name, nullptr, nullptr) != 0)
+        return -1;
+    struct termios raw;
+    tcgetattr(slave, &raw);
+    cfmakeraw(&raw); // No echo nor line discipline before the host configures the port
+    tcsetattr(slave, TCSANOW, &raw);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    if (pipe(wakeup) != 0) {
+        close(master);
+        close(slave);
+        return -1;
+    }
+    port = name;
+    running = true;
+    worker = std::thread(&RelaySimulator::run, this);
+    return 1;
+}
+
+// Starts answering on a local TCP port instead of a pseudo-terminal, as a
+// stand-in for a terminal server (ser2net raw mode); getPort() then returns
+// "tcp://127.0.0.1:<port>". One connection is served at a time, a new one
+// replaces the previous.
+// Parameters: tcpport - port to listen on, 0 for any free port
+// Returns: 1 if the simulator is running, -1 otherwise
+int RelaySimulator::startTcp(unsigned int tcpport) {
+    if (running)
+        return 1;
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+        return -1;
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(tcpport);
+    socklen_t length = sizeof(address);
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 4) != 0
+        || getsockname(listener, (struct sockaddr*)&address, &length) != 0 || pipe(wakeup) != 0) {
+        close(listener);
+        listener = -1;
+        return -1;
+    }
+    port = "tcp://127.0.0.1:" + std::to_string(ntohs(address.sin_port));
+    running = true;
+    worker = std::thread(&RelaySimulator::run, this);
+    return 1;
+}
+
+// Starts answering on a local TCP port as an RFC 2217 terminal server:
+// telnet options are negotiated, COM-PORT-OPTION commands are acknowledged
+// and recorded in the stats, data bytes reach the board unescaped. getPort()
+// then returns "rfc2217://127.0.0.1:<port>".
+// Parameters: tcpport - port to listen on, 0 for any free port
+// Returns: 1 if the simulator is running, -1 otherwise
+int RelaySimulator::startRfc2217(unsigned int tcpport) {
+    if (running)
+        return 1;
+    telnet = true;
+    if (this->startTcp(tcpport) != 1) {
+        telnet = false;
+        return -1;
+    }
+    port.replace(0, 3, "rfc2217");
+    return 1;
+}
+
+// Stops the simulator and removes the pseudo-terminal
+void RelaySimulator::stop() {
+    if (!running)
+        return;
+    running = false;
+    char stop = 0;
+    if (write(wakeup[1], &stop, 1) != 1) {
+    }
+    worker.join();
+    close(wakeup[0]);
+    close(wakeup[1]);
+    if (master >= 0)
+        close(master);
+    if (slave >= 0)
+        close(slave); // Kept open until now so that the master never sees a hang-up
+    if (listener >= 0)
+        close(listener);
+    master = slave = listener = wakeup[0] = wakeup[1] = -1;
+    telnet = false;
+}
+
+// Returns the path of the device to open on the host side
+std::string RelaySimulator::getPort() {
+    return port;
+}
+
+// Returns the decoded relay state of the simulated board
+RelayMask RelaySimulator::getState() {
+    std::lock_guard<std::mutex> guard(lock);
+    return board.getState();
+}
+
+// Returns true once the host completed the init handshake
+bool RelaySimulator::isReady() {
+    std::lock_guard<std::mutex> guard(lock);
+    return board.isReady();
+}
+
+// Returns a copy of the counters of the simulated board
+RelaySimStats RelaySimulator::getStats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+// Waits until the board reaches a given state
+// Parameters: state - expected decoded state
+//             milliseconds - maximum wait
+// Returns: true if the state was reached in time
+bool RelaySimulator::waitState(RelayMask state, unsigned long milliseconds) {
+    uint64_t deadline = systemClock().now_us() + milliseconds * 1000;
+    while (this->getState() != state) {
+        if (systemClock().now_us() >= deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    return true;
+}
+
+// Emulates a power cycle of the board: relays off, init handshake required again
+void RelaySimulator::powerCycle() {
+    std::lock_guard<std::mutex> guard(lock);
+    board.reset();
+}
+
+// Event loop of the simulator thread
+void RelaySimulator::run() {
+    struct pollfd fds[3];
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeup[0];
+    fds[1].events = POLLIN;
+    fds[2].fd = listener; // Ignored by poll in pseudo-terminal mode (-1)
+    fds[2].events = POLLIN;
+    uint8_t data[256];
+    while (running) {
+        fds[0].fd = master; // -1 while no TCP client is connected
+        fds[0].revents = fds[1].revents = fds[2].revents = 0;
+        if (poll(fds, 3, -1) < 0)
+            continue;
+        if (fds[1].revents)
+            break;
+        if (fds[2].revents) { // New TCP connection
+            int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (client >= 0) {
+                int one = 1;
+                setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                if (master >= 0)
+                    close(master);
+                master = client;
+                decoder.reset();
+                memset(negotiated, 0, sizeof(negotiated));
+            }
+            continue;
+        }
+        int nbyte = read(master, data, sizeof(data));
+        if (nbyte > 0 && telnet) {
+            uint64_t arrival = systemClock().now_us();
+            std::vector<uint8_t> decoded, answers;
+            decoder.decode(data, nbyte, decoded,
+                [&](uint8_t command, uint8_t option) { this->answerOption(command, option, answers); },
+                [&](const uint8_t* sub, size_t size) { this->answerComPort(sub, size, answers); });
+            if (!answers.empty() && write(master, answers.data(), answers.size()) != (ssize_t)answers.size()) {
+            }
+            if (!decoded.empty())
+                this->process(decoded.data(), decoded.size(), arrival);
+        } else if (nbyte > 0)
+            this->process(data, nbyte, systemClock().now_us());
+        else if (listener >= 0 && (nbyte == 0 || errno != EAGAIN)) { // TCP client gone
+            close(master);
+            master = -1;
+        }
+    }
+}
+
+// Applies the bytes received in one read to the board model
+// Parameters: data - received bytes
+//             nbyte - number of received bytes
+//             arrival - reception time in microseconds
+void RelaySimulator::process(const uint8_t* data, int nbyte, uint64_t arrival) {
+    std::bernoulli_distribution drop(options.droprate);
+    for (int k = 0; k < nbyte; k++) {
+        uint8_t reply[4];
+        int nreply;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stats.bytes++;
+            bool tooclose = options.mingap_us && stats.bytes > 1 && !board.isInFrame() // Bytes of one frame come together
+                && arrival - lastbyte < options.mingap_us;
+            lastbyte = arrival;
+            if (tooclose) { // Bytes sent without pacing are lost by the board
+                stats.gapviolations++;
+                continue;
+            }
+            if (options.droprate > 0 && drop(random)) {
+                stats.dropped++;
+                continue;
+            }
+            bool ready = board.isReady();
+            nreply = board.input(data[k], reply);
+            if (ready && !board.isInFrame()) // Last byte of a state frame
+                stats.commands++;
+            stats.invalidframes = board.getInvalidFrames();
+            stats.replies += nreply;
+        }
+        if (nreply > 0) {
+            if (options.replydelay_us)
+                std::this_thread::sleep_for(std::chrono::microseconds(options.replydelay_us));
+            this->reply(reply, nreply);
+        }
+    }
+}
+
+// Sends board answers to the host, escaped in RFC 2217 mode
+void RelaySimulator::reply(const uint8_t* data, size_t size) {
+    if (telnet) {
+        std::vector<uint8_t> escaped;
+        telnetEscape(data, size, escaped);
+        if (write(master, escaped.data(), escaped.size()) != (ssize_t)escaped.size()) {
+        }
+    } else if (write(master, data, size) != (ssize_t)size) {
+    }
+}
+
+// Answers a telnet option negotiation once per option: binary mode,
+// suppress-go-ahead and the COM-PORT-OPTION are accepted, others declined
+void RelaySimulator::answerOption(uint8_t command, uint8_t option, std::vector<uint8_t>& output) {
+    bool supported = option == TELNET_BINARY || option == TELNET_SGA || option == TELNET_COMPORT;
+    bool will = command == TELNET_WILL || command == TELNET_WONT; // The host offers
+    if (command == TELNET_WONT || command == TELNET_DONT || negotiated[will][option])
+        return;
+    negotiated[will][option] = true;
+    if (will)
+        telnetOption(supported ? TELNET_DO : TELNET_DONT, option, output);
+    else
+        telnetOption(supported && option != TELNET_COMPORT ? TELNET_WILL : TELNET_WONT, option, output);
+}
+
+// Acknowledges a COM-PORT-OPTION command with the server code and the value
+// in effect, like a terminal server with an always-present serial port
+void RelaySimulator::answerComPort(const uint8_t* sub, size_t size, std::vector<uint8_t>& output) {
+    if (size < 2 || sub[0] != TELNET_COMPORT || sub[1] >= RFC2217_SERVER)
+        return;
+    uint8_t command = sub[1];
+    std::vector<uint8_t> value(sub + 2, sub + size);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stats.controls++;
+        if (command == RFC2217_SET_BAUDRATE && value.size() == 4) {
+            unsigned int speed = (unsigned int)value[0] << 24 | (unsigned int)value[1] << 16 | (unsigned int)value[2] << 8 | value[3];
+            if (speed) // 0 asks for the current speed
+                stats.baudrate = speed;
+            for (int k = 0; k < 4; k++)
+                value[k] = uint8_t(stats.baudrate >> (24 - 8 * k));
+        } else if (command == RFC2217_SET_CONTROL && value.size() == 1) {
+            if (value[0] == RFC2217_DTR_ON || value[0] == RFC2217_DTR_OFF)
+                stats.dtr = value[0] == RFC2217_DTR_ON;
+            if (value[0] == RFC2217_RTS_ON || value[0] == RFC2217_RTS_OFF)
+                stats.rts = value[0] == RFC2217_RTS_ON;
+        }
+    }
+    rfc2217Command(RFC2217_SERVER + command, value.data(), value.size(), output);
+    if (command == RFC2217_SET_MODEMSTATE_MASK) { // Initial state of the lines
+        uint8_t modemstate = RFC2217_MODEM_CTS | RFC2217_MODEM_DSR | RFC2217_MODEM_DCD;
+        rfc2217Command(RFC2217_SERVER + RFC2217_NOTIFY_MODEMSTATE, &modemstate, 1, output);
+    }
+}
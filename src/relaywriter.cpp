@@ -0,0 +1,124 @@
+#include <relaywriter.hpp>
+#include <tracing.hpp>
+#include <chrono>
+
+
+
+RelayWriter::~RelayWriter() {
+    this->stop();
+}
+
+// Starts the writer thread
+// Returns: 1 if the thread runs
+int RelayWriter::start() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (running)
+        return 1;
+    running = true;
+    worker = std::thread(&RelayWriter::run, this);
+    return 1;
+}
+
+// Stops the writer thread, after the updates already submitted are written
+void RelayWriter::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock); // The writer checks running under the lock
+        if (!running)
+            return;
+        running = false;
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+// Queues relay updates and returns at once; the updates of one board are
+// merged with those still waiting for it
+// Parameters: updates, count - updates, applied in order
+//             detected_us - time of the event on the system clock, 0 if not timed
+//             latency - if not null, records the time from detected_us to the
+//                       write of the command
+// Returns: 1 on success, -1 if a board does not fit in the table (its update is dropped)
+int RelayWriter::submit(const RelayUpdate* updates, int count, uint64_t detected_us, LatencyHistogram* latency) {
+    int status = 1;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (int k = 0; k < count; k++) {
+            const RelayUpdate& update = updates[k];
+            int board = 0;
+            while (board < boards && pending[board].relay != update.relay)
+                board++;
+            if (board == MAXBOARDS || !update.relay) {
+                status = -1;
+                continue;
+            }
+            if (board == boards)
+                pending[boards++].relay = update.relay;
+            Pending& entry = pending[board];
+            entry.setmask = (entry.setmask & ~update.clearmask) | update.setmask;
+            entry.clearmask = (entry.clearmask & ~update.setmask) | update.clearmask;
+            if (entry.updates == 0 || (detected_us && detected_us < entry.detected_us))
+                entry.detected_us = detected_us;
+            if (entry.updates++ == 0)
+                queued++;
+            entry.latency = latency;
+            stats.updates++;
+        }
+    }
+    changed.notify_one();
+    return status;
+}
+
+// Waits until every update submitted is written
+// Parameters: milliseconds - maximum wait
+// Returns: true if nothing is left to write
+bool RelayWriter::flush(unsigned long milliseconds) {
+    std::unique_lock<std::mutex> guard(lock);
+    return idle.wait_for(guard, std::chrono::milliseconds(milliseconds), [this] { return !queued && !writing; });
+}
+
+// Returns a copy of the counters of the writer
+RelayWriterStats RelayWriter::getStats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+// Writer loop: writes the merged update of each board in turn; updates
+// submitted during the pacing of a board are merged into its next write
+void RelayWriter::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        changed.wait(guard, [this] { return queued || !running; });
+        if (!queued)
+            break;
+        for (int board = 0; board < boards; board++) {
+            if (!pending[board].updates)
+                continue;
+            Pending update = pending[board];
+            pending[board].setmask = pending[board].clearmask = 0;
+            pending[board].updates = 0;
+            queued--;
+            writing = true;
+            guard.unlock();
+            TRACE_SCOPE("writer.update", update.setmask);
+            uint64_t submitted = systemClock().now_us();
+            bool sent = update.relay->updateMask(update.setmask, update.clearmask) == 1;
+            if (sent && update.latency && update.detected_us) {
+                // The byte reached the OS encode+write after the submission, pacing excluded
+                const RelayTiming& timing = update.relay->getTiming();
+                uint64_t wired = submitted + (timing.encode_ns + timing.write_ns) / 1000;
+                update.latency->record(wired > update.detected_us ? wired - update.detected_us : 0);
+            }
+            uint64_t saved = sent ? update.updates - 1 : 0;
+            if (saved)
+                update.relay->countCoalesced(saved);
+            guard.lock();
+            writing = false;
+            stats.writes += sent;
+            stats.failures += !sent;
+            stats.coalesced += saved;
+        }
+        if (!queued)
+            idle.notify_all();
+    }
+    idle.notify_all();
+}
@@ -0,0 +1,38 @@
+#include <rfc2217.hpp>
+
+
+
+// Appends data bytes to a telnet stream, doubling IAC
+// Parameters: data, size - data bytes
+//             output - telnet stream
+void telnetEscape(const uint8_t* data, size_t size, std::vector<uint8_t>& output) {
+    for (size_t k = 0; k < size; k++) {
+        output.push_back(data[k]);
+        if (data[k] == TELNET_IAC)
+            output.push_back(TELNET_IAC);
+    }
+}
+
+// Appends an option negotiation
+// Parameters: command - TELNET_WILL, TELNET_WONT, TELNET_DO or TELNET_DONT
+//             option - TelnetOption
+//             output - telnet stream
+void telnetOption(uint8_t command, uint8_t option, std::vector<uint8_t>& output) {
+    output.push_back(TELNET_IAC);
+    output.push_back(command);
+    output.push_back(option);
+}
+
+// Appends a COM-PORT-OPTION subnegotiation
+// Parameters: command - Rfc2217Command (plus RFC2217_SERVER on the server side)
+//             value, size - parameter bytes, network order for numbers
+//             output - telnet stream
+void rfc2217Command(uint8_t command, const uint8_t* value, size_t size, std::vector<uint8_t>& output) {
+    output.push_back(TELNET_IAC);
+    output.push_back(TELNET_SB);
+    output.push_back(TELNET_COMPORT);
+    output.push_back(command);
+    telnetEscape(value, size, output);
+    output.push_back(TELNET_IAC);
+    output.push_back(TELNET_SE);
+}
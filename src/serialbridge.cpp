@@ -0,0 +1,194 @@
+#include <serialbridge.hpp>
+#include <tracing.hpp>
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+
+// Constructor for the SerialBridge class
+// Parameters: a, b - serial ports to connect, opened before start()
+SerialBridge::SerialBridge(serialib* a, serialib* b) {
+    ports[0] = a;
+    ports[1] = b;
+}
+
+SerialBridge::~SerialBridge() {
+    this->stop();
+}
+
+// Sets the function called with every forwarded chunk, only before start()
+// Parameters: tap - called on the bridge thread, must not block
+void SerialBridge::setTap(SerialBridgeTap tap) {
+    if (!worker.joinable())
+        this->tap = tap;
+}
+
+// Starts forwarding
+// Returns: 1 if the bridge runs, -1 if a port is closed or the event loop cannot be created
+int SerialBridge::start() {
+    if (worker.joinable())
+        return 1;
+    for (int k = 0; k < 2; k++) {
+        fds[k] = ports[k]->getFd();
+        if (fds[k] < 0)
+            return -1;
+        pending[k].buffer.resize(1 << 16);
+        pending[k].size = pending[k].offset = 0;
+        interest[k] = -1;
+        hungup[k] = false;
+    }
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u32 = 2;
+    if (epoll < 0 || wakeup < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, wakeup, &event) != 0) {
+        if (epoll >= 0)
+            close(epoll);
+        if (wakeup >= 0)
+            close(wakeup);
+        epoll = wakeup = -1;
+        return -1;
+    }
+    for (int k = 0; k < 2; k++) {
+        event.events = EPOLLIN;
+        event.data.u32 = k;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, fds[k], &event);
+        interest[k] = EPOLLIN;
+    }
+    stats = SerialBridgeStats();
+    running = true;
+    worker = std::thread(&SerialBridge::run, this);
+    return 1;
+}
+
+// Stops forwarding; bytes read but not written yet are discarded
+void SerialBridge::stop() {
+    if (!worker.joinable())
+        return;
+    running = false;
+    uint64_t one = 1;
+    if (write(wakeup, &one, sizeof(one)) != sizeof(one)) {
+        // The counter cannot overflow here, the loop wakes up anyway
+    }
+    worker.join();
+    close(epoll);
+    close(wakeup);
+    epoll = wakeup = -1;
+}
+
+// Returns the counters of the bridge
+SerialBridgeStats SerialBridge::getStats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+// Event loop: reads a port when it has data and nothing is waiting to be
+// written to the other one, writes the waiting bytes when the queue drains.
+// A port hanging up while its bytes wait for the other one leaves the event
+// set (its hang-up is reported whatever the events watched) until they are
+// written, then it is read to the end.
+void SerialBridge::run() {
+    struct epoll_event events[3];
+    bool alive = true; // false once a port hung up or failed
+    while (running && alive) {
+        int count = epoll_wait(epoll, events, 3, -1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            break;
+        for (int k = 0; k < count && alive; k++) {
+            uint32_t id = events[k].data.u32;
+            if (id == 2)
+                continue;
+            // The port drained: finish the other direction's write first
+            if ((events[k].events & EPOLLOUT) && this->flush(1 - id) != 1)
+                alive = false;
+            if ((events[k].events & (EPOLLHUP | EPOLLERR)) && pending[id].size)
+                hungup[id] = true;
+            else if ((events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && pending[id].size == 0
+                     && this->transfer(id) != 1)
+                alive = false;
+        }
+        for (int id = 0; id < 2 && alive; id++) {
+            if (!hungup[id] || pending[id].size)
+                continue;
+            hungup[id] = false; // Its bytes are written: read what is left, or see the hang-up again
+            if (this->transfer(id) != 1)
+                alive = false;
+        }
+        if (alive && this->updateInterest() != 1)
+            alive = false;
+    }
+}
+
+// Reads what a port holds and writes it to the other one
+// Parameters: direction - SerialBridgeDirection, also the index of the source port
+// Returns: 1 on success, -1 on hang up or error
+int SerialBridge::transfer(int direction) {
+    Pending& chunk = pending[direction];
+    ssize_t nbyte = read(fds[direction], chunk.buffer.data(), chunk.buffer.size());
+    if (nbyte < 0 && (errno == EAGAIN || errno == EINTR))
+        return 1;
+    if (nbyte <= 0)
+        return -1;
+    TRACE_SCOPE("bridge", direction);
+    if (tap)
+        tap((SerialBridgeDirection)direction, chunk.buffer.data(), (size_t)nbyte);
+    chunk.offset = 0;
+    chunk.size = (size_t)nbyte;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stats.bytes[direction] += nbyte;
+        stats.chunks[direction]++;
+    }
+    if (this->flush(direction) != 1)
+        return -1;
+    if (chunk.size) {
+        std::lock_guard<std::mutex> guard(lock);
+        stats.stalls[direction]++;
+    }
+    return 1;
+}
+
+// Writes the bytes of a direction still waiting for the destination
+// Parameters: direction - SerialBridgeDirection
+// Returns: 1 on success (all written or queue full), -1 on error
+int SerialBridge::flush(int direction) {
+    Pending& chunk = pending[direction];
+    while (chunk.offset < chunk.size) {
+        ssize_t written = write(fds[1 - direction], chunk.buffer.data() + chunk.offset, chunk.size - chunk.offset);
+        if (written < 0 && (errno == EAGAIN || errno == EINTR))
+            return 1;
+        if (written <= 0)
+            return -1;
+        chunk.offset += written;
+    }
+    chunk.offset = chunk.size = 0;
+    return 1;
+}
+
+// Waits for input on a port only when its direction has nothing pending, and
+// for room on a port only when the other direction has bytes for it; a port
+// that hung up is left out of the set
+// Returns: 1 on success, -1 if the event set cannot be changed
+int SerialBridge::updateInterest() {
+    for (int k = 0; k < 2; k++) {
+        uint32_t in = pending[k].size == 0 ? (uint32_t)EPOLLIN : 0;
+        uint32_t out = pending[1 - k].size ? (uint32_t)EPOLLOUT : 0;
+        int wanted = hungup[k] ? -1 : (int)(in | out);
+        if (wanted == interest[k])
+            continue;
+        struct epoll_event event = {};
+        event.events = (uint32_t)wanted;
+        event.data.u32 = k;
+        int operation = wanted < 0 ? EPOLL_CTL_DEL : interest[k] < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (epoll_ctl(epoll, operation, fds[k], &event) != 0)
+            return -1;
+        interest[k] = wanted;
+    }
+    return 1;
+}
@@ -0,0 +1,314 @@
+#include <serialcapture.hpp>
+#include <tracing.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+
+
+// Constructor for the SerialCapture class
+// Parameters: port - serial port to record, opened before start()
+SerialCapture::SerialCapture(serialib* port) {
+    this->port = port;
+}
+
+SerialCapture::~SerialCapture() {
+    this->stop();
+}
+
+// Returns the path of a segment file
+// Parameters: prefix - path prefix given to start()
+//             segment - segment number
+//             extension - "bin" for data, "idx" for the index
+std::string SerialCapture::segmentPath(const std::string& prefix, uint64_t segment, const char* extension) {
+    char suffix[40];
+    snprintf(suffix, sizeof(suffix), ".%06llu.%s", (unsigned long long)segment, extension);
+    return prefix + suffix;
+}
+
+// Starts recording the bytes received on the port; reads on the port keep
+// working and see the same bytes. Must not be called while another thread
+// reads the port.
+// Parameters: prefix - path prefix of the segment files
+//             segmentbytes - size after which a new segment is started
+//             keepsegments - number of segments kept on disk, 0 keeps all
+// Returns: 1 if the capture runs, -1 if the port is closed or a file or pipe cannot be created
+int SerialCapture::start(const std::string& prefix, uint64_t segmentbytes, int keepsegments) {
+    if (running)
+        return 1;
+    this->stop(); // Capture ended by a hang-up: release its thread and files first
+    if (!port->isDeviceOpen())
+        return -1;
+    this->prefix = prefix;
+    this->segmentbytes = segmentbytes ? segmentbytes : 1;
+    this->keepsegments = keepsegments;
+    segment = 0;
+    stats = SerialCaptureStats();
+    if (pipe2(transfer, O_CLOEXEC) != 0 || pipe2(readpipe, O_CLOEXEC | O_NONBLOCK) != 0
+        || pipe2(wakeup, O_CLOEXEC) != 0 || this->openSegment() != 1) {
+        this->closeSegment();
+        for (int* descriptors : {transfer, readpipe, wakeup}) {
+            for (int k = 0; k < 2; k++) {
+                if (descriptors[k] >= 0)
+                    close(descriptors[k]);
+                descriptors[k] = -1;
+            }
+        }
+        return -1;
+    }
+    fcntl(readpipe[0], F_SETPIPE_SZ, 1 << 20); // Room for ~1 s at 921600 bauds before the capture waits
+    port->infd = readpipe[0];
+    running = true;
+    worker = std::thread(&SerialCapture::run, this);
+    return 1;
+}
+
+// Stops the capture and gives the device back to the reads. Bytes received
+// but not read yet by the application are lost (counted as dropped).
+void SerialCapture::stop() {
+    if (!worker.joinable())
+        return;
+    running = false;
+    if (write(wakeup[1], "x", 1) != 1) {
+        // The thread also sees running == false on its next chunk
+    }
+    worker.join();
+    this->closeSegment();
+    for (int* descriptors : {transfer, readpipe, wakeup}) {
+        for (int k = 0; k < 2; k++) {
+            if (descriptors[k] >= 0)
+                close(descriptors[k]);
+            descriptors[k] = -1;
+        }
+    }
+}
+
+// Returns true while the capture runs, false once stopped or ended by a hang-up
+bool SerialCapture::isRunning() {
+    return running;
+}
+
+// Returns the counters of the capture
+SerialCaptureStats SerialCapture::getStats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+// Opens the data and index files of the current segment, removing the
+// oldest one beyond keepsegments
+// Returns: 1 on success, -1 otherwise
+int SerialCapture::openSegment() {
+    data = open(segmentPath(prefix, segment, "bin").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    index = open(segmentPath(prefix, segment, "idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (data < 0 || index < 0)
+        return -1;
+    if (keepsegments > 0 && segment >= (uint64_t)keepsegments) {
+        unlink(segmentPath(prefix, segment - keepsegments, "bin").c_str());
+        unlink(segmentPath(prefix, segment - keepsegments, "idx").c_str());
+    }
+    segmentoffset = 0;
+    lastindex_us = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    stats.segments++;
+    return 1;
+}
+
+// Closes the files of the current segment
+void SerialCapture::closeSegment() {
+    if (data >= 0)
+        close(data);
+    if (index >= 0)
+        close(index);
+    data = index = -1;
+}
+
+// Gives the device back to the reads when the capture thread ends, whether
+// stopped or after a hang-up; bytes the application did not read are dropped.
+// Reads already on the pipe see it hang up and move to the device; the pipe
+// is only closed by stop() once none of them holds it.
+void SerialCapture::release() {
+    port->infd = port->fd;
+    close(readpipe[1]);
+    readpipe[1] = -1;
+    for (int readers = port->pipereaders; readers > 0; readers = port->pipereaders)
+        port->pipereaders.wait(readers);
+    int left = 0;
+    ioctl(readpipe[0], FIONREAD, &left);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stats.dropped += left;
+    }
+    running = false;
+}
+
+// Capture loop: sleeps in poll until the device has data, then moves it
+void SerialCapture::run() {
+    struct pollfd fds[2] = {{port->fd, POLLIN, 0}, {wakeup[0], POLLIN, 0}};
+    while (running) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            break;
+        if (fds[1].revents || (fds[0].revents & (POLLERR | POLLNVAL)))
+            break;
+        if (!(fds[0].revents & (POLLIN | POLLHUP)))
+            continue;
+        ssize_t nbyte = -1;
+        if (!stats.copying) {
+            nbyte = splice(port->fd, nullptr, transfer[1], nullptr, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (nbyte < 0 && errno == EINVAL) { // Driver without splice support
+                std::lock_guard<std::mutex> guard(lock);
+                stats.copying = true;
+                buffer.resize(1 << 16);
+            }
+        }
+        if (stats.copying)
+            nbyte = read(port->fd, buffer.data(), buffer.size());
+        if (nbyte < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (nbyte <= 0) // Hang up or device error
+            break;
+        if ((stats.copying ? this->copy(nbyte) : this->forward(nbyte)) != 1)
+            break;
+    }
+    this->release();
+}
+
+// Starts a new segment when the current one is full and indexes the chunk
+// about to be written (at most one record per millisecond)
+// Returns: 1 on success, -1 if a file cannot be written
+int SerialCapture::beginChunk() {
+    if (segmentoffset >= segmentbytes) {
+        this->closeSegment();
+        segment++;
+        if (this->openSegment() != 1)
+            return -1;
+    }
+    uint64_t now = port->clock->now_us();
+    if (lastindex_us && now < lastindex_us + 1000)
+        return 1;
+    SerialCaptureIndex record = {now, segmentoffset};
+    lastindex_us = now;
+    return write(index, &record, sizeof(record)) == sizeof(record) ? 1 : -1;
+}
+
+// Moves a chunk held in the transfer pipe to the reads and to the segment
+// Parameters: nbyte - size of the chunk
+// Returns: 1 on success, -1 on error or stop
+int SerialCapture::forward(ssize_t nbyte) {
+    TRACE_SCOPE("capture", nbyte);
+    if (this->beginChunk() != 1)
+        return -1;
+    ssize_t left = nbyte;
+    ssize_t overflow = 0;
+    while (left > 0) {
+        // Duplicate what the reads can take, then consume the same amount into the file
+        ssize_t shared = tee(transfer[0], readpipe[1], left, SPLICE_F_NONBLOCK);
+        if (shared < 0 && errno == EAGAIN) { // Read pipe full: record the rest only
+            shared = left;
+            overflow += left;
+        } else if (shared <= 0) {
+            return -1;
+        }
+        for (ssize_t moved = 0; moved < shared;) {
+            ssize_t written = splice(transfer[0], nullptr, data, nullptr, shared - moved, SPLICE_F_MOVE);
+            if (written <= 0)
+                return -1;
+            moved += written;
+        }
+        left -= shared;
+    }
+    segmentoffset += nbyte;
+    std::lock_guard<std::mutex> guard(lock);
+    stats.bytes += nbyte;
+    stats.overflow += overflow;
+    stats.chunks++;
+    return 1;
+}
+
+// Fallback of forward() for drivers without splice: the chunk is in buffer
+// Parameters: nbyte - size of the chunk
+// Returns: 1 on success, -1 on error or stop
+int SerialCapture::copy(ssize_t nbyte) {
+    if (this->beginChunk() != 1)
+        return -1;
+    ssize_t shared = 0;
+    while (shared < nbyte) {
+        ssize_t written = write(readpipe[1], buffer.data() + shared, nbyte - shared);
+        if (written < 0 && errno == EAGAIN) // Read pipe full: record the rest only
+            break;
+        if (written <= 0)
+            return -1;
+        shared += written;
+    }
+    ssize_t overflow = nbyte - shared;
+    for (ssize_t done = 0; done < nbyte;) {
+        ssize_t written = write(data, buffer.data() + done, nbyte - done);
+        if (written <= 0)
+            return -1;
+        done += written;
+    }
+    segmentoffset += nbyte;
+    std::lock_guard<std::mutex> guard(lock);
+    stats.bytes += nbyte;
+    stats.overflow += overflow;
+    stats.chunks++;
+    return 1;
+}
+
+// Finds where the data received at a given time is stored in a recording
+// Parameters: prefix - path prefix of the segment files
+//             time_us - time on the clock of the recorded port
+//             segment, offset - segment and offset in its data file of the
+//                               chunk containing that time (earliest data if before it)
+// Returns: 1 if found, -1 if there is no recording
+int SerialCapture::locate(const std::string& prefix, uint64_t time_us, uint64_t* segment, uint64_t* offset) {
+    size_t slash = prefix.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : prefix.substr(0, slash + 1);
+    std::string base = slash == std::string::npos ? prefix : prefix.substr(slash + 1);
+    std::vector<uint64_t> segments;
+    DIR* listing = opendir(directory.c_str());
+    if (!listing)
+        return -1;
+    while (struct dirent* entry = readdir(listing)) {
+        std::string name = entry->d_name;
+        unsigned long long number;
+        char extension[8];
+        if (name.compare(0, base.size() + 1, base + ".") == 0
+            && sscanf(name.c_str() + base.size(), ".%llu.%3s", &number, extension) == 2
+            && strcmp(extension, "idx") == 0)
+            segments.push_back(number);
+    }
+    closedir(listing);
+    std::sort(segments.begin(), segments.end());
+
+    // Latest segment whose first chunk is not after time_us, then latest chunk in it
+    bool found = false;
+    for (uint64_t number : segments) {
+        FILE* file = fopen(segmentPath(prefix, number, "idx").c_str(), "rb");
+        if (!file)
+            continue;
+        std::vector<SerialCaptureIndex> records;
+        SerialCaptureIndex record;
+        while (fread(&record, sizeof(record), 1, file) == 1)
+            records.push_back(record);
+        fclose(file);
+        if (records.empty())
+            continue;
+        if (found && records.front().time_us > time_us)
+            break;
+        auto chunk = std::upper_bound(records.begin(), records.end(), time_us,
+            [](uint64_t time, const SerialCaptureIndex& entry) { return time < entry.time_us; });
+        *segment = number;
+        *offset = chunk == records.begin() ? 0 : (chunk - 1)->offset;
+        found = true;
+        if (chunk != records.end())
+            break;
+    }
+    return found ? 1 : -1;
+}
@@ -16,6 +16,9 @@ This is a licence-free software, it can be used by anyone who try to build a bet
  */
 
 #include "serialib.hpp"
+#include "tracing.hpp"
+#include "usdt.hpp"
+#include <algorithm>
 
 
 
@@ -28,6 +31,9 @@ This is a licence-free software, it can be used by anyone who try to build a bet
 */
 serialib::serialib()
 {
+    clock = &systemClock();
+    metrics = &ownMetrics;
+    modeminterrupt = false;
 #if defined (_WIN32) || defined( _WIN64)
     // Set default value for RTS and DTR (Windows only)
     currentStateRTS=true;
@@ -36,6 +42,12 @@ serialib::serialib()
 #endif
 #if defined (__linux__) || defined(__APPLE__)
     fd = -1;
+    infd = -1;
+    pipereaders = 0;
+#endif
+#if defined (__linux__)
+    modemwatch = 0;
+    modemgeneration = 0;
 #endif
 }
 
@@ -248,6 +260,7 @@ char serialib::openDevice(const char *Device, const unsigned int Bauds,
     if (fd == -1) return -2;
     // Open the device in nonblocking mode
     fcntl(fd, F_SETFL, FNDELAY);
+    infd = fd;
 
 
     // Get the current options of the port
@@ -374,9 +387,13 @@ void serialib::closeDevice()
     CloseHandle(hSerial);
     hSerial = INVALID_HANDLE_VALUE;
 #endif
+#if defined (__linux__)
+    stopModemWatch();
+#endif
 #if defined (__linux__) || defined(__APPLE__)
     close (fd);
     fd = -1;
+    infd = -1;
 #endif
 }
 
@@ -396,20 +413,30 @@ void serialib::closeDevice()
   */
 int serialib::writeChar(const char Byte)
 {
+    TRACE_SCOPE("writeChar",(uint8_t)Byte);
+    USDT_PROBE2(usbrelay,writechar_entry,fd,(uint8_t)Byte);
 #if defined (_WIN32) || defined( _WIN64)
     // Number of bytes written
     DWORD dwBytesWritten;
     // Write the char to the serial device
     // Return -1 if an error occured
-    if(!WriteFile(hSerial,&Byte,1,&dwBytesWritten,NULL)) return -1;
+    if(!WriteFile(hSerial,&Byte,1,&dwBytesWritten,NULL)) { metricAdd(metrics->errors); return -1; }
     // Write operation successfull
+    metricAdd(metrics->bytestx);
     return 1;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
     // Write the char
-    if (write(fd,&Byte,1)!=1) return -1;
+    if (write(fd,&Byte,1)!=1)
+    {
+        metricAdd(metrics->errors);
+        USDT_PROBE2(usbrelay,writechar_return,fd,-1);
+        return -1;
+    }
 
     // Write operation successfull
+    metricAdd(metrics->bytestx);
+    USDT_PROBE2(usbrelay,writechar_return,fd,1);
     return 1;
 #endif
 }
@@ -433,17 +460,22 @@ int serialib::writeString(const char *receivedString)
     DWORD dwBytesWritten;
     // Write the string
     if(!WriteFile(hSerial,receivedString,strlen(receivedString),&dwBytesWritten,NULL))
+    {
         // Error while writing, return -1
+        metricAdd(metrics->errors);
         return -1;
+    }
     // Write operation successfull
+    metricAdd(metrics->bytestx,dwBytesWritten);
     return 1;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
     // Lenght of the string
     int Lenght=strlen(receivedString);
     // Write the string
-    if (write(fd,receivedString,Lenght)!=Lenght) return -1;
+    if (write(fd,receivedString,Lenght)!=Lenght) { metricAdd(metrics->errors); return -1; }
     // Write operation successfull
+    metricAdd(metrics->bytestx,Lenght);
     return 1;
 #endif
 }
@@ -462,20 +494,33 @@ int serialib::writeString(const char *receivedString)
   */
 int serialib::writeBytes(const void *Buffer, const unsigned int NbBytes)
 {
+    TRACE_SCOPE("writeBytes",NbBytes);
+    USDT_PROBE2(usbrelay,writebytes_entry,fd,NbBytes);
 #if defined (_WIN32) || defined( _WIN64)
     // Number of bytes written
     DWORD dwBytesWritten;
     // Write data
     if(!WriteFile(hSerial, Buffer, NbBytes, &dwBytesWritten, NULL))
+    {
         // Error while writing, return -1
+        metricAdd(metrics->errors);
         return -1;
+    }
     // Write operation successfull
+    metricAdd(metrics->bytestx,dwBytesWritten);
     return 1;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
     // Write data
-    if (write (fd,Buffer,NbBytes)!=(ssize_t)NbBytes) return -1;
+    if (write (fd,Buffer,NbBytes)!=(ssize_t)NbBytes)
+    {
+        metricAdd(metrics->errors);
+        USDT_PROBE2(usbrelay,writebytes_return,fd,-1);
+        return -1;
+    }
     // Write operation successfull
+    metricAdd(metrics->bytestx,NbBytes);
+    USDT_PROBE2(usbrelay,writebytes_return,fd,1);
     return 1;
 #endif
 }
@@ -493,6 +538,22 @@ int serialib::writeBytes(const void *Buffer, const unsigned int NbBytes)
      \return -2 error while reading the byte
   */
 int serialib::readChar(char *pByte,unsigned int timeOut_ms)
+{
+    TRACE_SCOPE("readChar",timeOut_ms);
+    USDT_PROBE2(usbrelay,readchar_entry,fd,timeOut_ms);
+    int result=waitChar(pByte,timeOut_ms);
+    USDT_PROBE3(usbrelay,readchar_return,fd,result,result==1 ? (uint8_t)*pByte : 0);
+    return result;
+}
+
+
+
+/*!
+     \brief Body of readChar, separated so that the entry and return probes
+            see every exit path
+     \return 1 success, 0 timeout, -1 or -2 error (see readChar)
+  */
+int serialib::waitChar(char *pByte,unsigned int timeOut_ms)
 {
 #if defined (_WIN32) || defined(_WIN64)
     // Number of bytes read
@@ -505,29 +566,59 @@ int serialib::readChar(char *pByte,unsigned int timeOut_ms)
     if(!SetCommTimeouts(hSerial, &timeouts)) return -1;
 
     // Read the byte, return -2 if an error occured
-    if(!ReadFile(hSerial,pByte, 1, &dwBytesRead, NULL)) return -2;
+    if(!ReadFile(hSerial,pByte, 1, &dwBytesRead, NULL)) { metricAdd(metrics->errors); return -2; }
 
     // Return 0 if the timeout is reached
-    if (dwBytesRead==0) return 0;
+    if (dwBytesRead==0) { metricAdd(metrics->timeouts); return 0; }
 
     // The byte is read
+    metricAdd(metrics->bytesrx);
     return 1;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Timer used for timeout
-    timeOut         timer;
-    // Initialise the timer
-    timer.initTimer();
-    // While Timeout is not reached
-    while (timer.elapsedTime_ms()<timeOut_ms || timeOut_ms==0)
+    // Deadline of the read on the serial clock
+    uint64_t        start=clock->now_us();
+    uint64_t        deadline=start+(uint64_t)timeOut_ms*1000;
+    // Wait descriptor for the device
+    struct pollfd   pfd;
+    pfd.fd=acquireInput();
+    pfd.events=POLLIN;
+    while (true)
     {
         // Try to read a byte on the device
-        switch (read(fd,pByte,1)) {
-        case 1  : return 1; // Read successfull
-        case -1 : return -2; // Error while reading
+        switch (read(pfd.fd,pByte,1)) {
+        case 1  : // Read successfull
+            releaseInput(pfd.fd);
+            metricAdd(metrics->bytesrx);
+            metrics->readwait.record(clock->now_us()-start);
+            return 1;
+        case 0  : // Capture pipe hung up and drained: back to the device
+            if (pfd.fd!=fd) { releaseInput(pfd.fd); pfd.fd=acquireInput(); continue; }
+            break;
+        case -1 : // Error while reading
+            if (errno!=EAGAIN && errno!=EINTR) { releaseInput(pfd.fd); metricAdd(metrics->errors); return -2; }
         }
+        // Compute the remaining time (-1 = infinite)
+        int remaining_ms=-1;
+        if (timeOut_ms!=0)
+        {
+            uint64_t now=clock->now_us();
+            if (now>=deadline)
+            {
+                releaseInput(pfd.fd);
+                metricAdd(metrics->timeouts);
+                metrics->readwait.record(now-start);
+                return 0;
+            }
+            remaining_ms=(int)((deadline-now+999)/1000);
+        }
+        // Sleep until a byte arrives instead of spinning on read
+        pfd.revents=0;
+        int ready=poll(&pfd,1,clock->ioWait_ms(remaining_ms));
+        if (ready<0 && errno!=EINTR) { releaseInput(pfd.fd); metricAdd(metrics->errors); return -2; }
+        // Nothing arrived: let the clock reach the deadline (instant on a virtual clock)
+        if (ready==0 && timeOut_ms!=0) clock->sleepUntil_us(deadline);
     }
-    return 0;
 #endif
 }
 
@@ -602,7 +693,7 @@ int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbB
     // Character read on serial device
     char            charRead;
     // Timer used for timeout
-    timeOut         timer;
+    timeOut         timer(clock);
     long int        timeOutParam;
 
     // Initialize the timer (for timeout)
@@ -638,8 +729,9 @@ int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbB
             // If an error occurend, return the error number
             if (charRead<0) return charRead;
         }
-        // Check if timeout is reached
-        if (timer.elapsedTime_ms()>timeOut_ms)
+        // Check if timeout is reached: readChar returns exactly at the deadline,
+        // and on a virtual clock no more time passes, so equality must end the wait
+        if (timer.elapsedTime_ms()>=timeOut_ms)
         {
             // Add the end caracter
             receivedString[nbBytes]=0;
@@ -658,15 +750,31 @@ int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbB
      \param buffer : array of bytes read from the serial device
      \param maxNbBytes : maximum allowed number of bytes read
      \param timeOut_ms : delay of timeout before giving up the reading
-     \param sleepDuration_us : delay of CPU relaxing in microseconds (Linux only)
-            In the reading loop, a sleep can be performed after each reading
-            This allows CPU to perform other tasks
+     \param sleepDuration_us : kept for compatibility, unused: the reading loop
+            now blocks in poll() until bytes arrive or the timeout expires,
+            which leaves the CPU idle while waiting
      \return >=0 return the number of bytes read before timeout or
                 requested data is completed
      \return -1 error while setting the Timeout
      \return -2 error while reading the byte
   */
 int serialib::readBytes (void *buffer,unsigned int maxNbBytes,unsigned int timeOut_ms, unsigned int sleepDuration_us)
+{
+    TRACE_SCOPE("readBytes",maxNbBytes);
+    USDT_PROBE3(usbrelay,readbytes_entry,fd,maxNbBytes,timeOut_ms);
+    int result=waitBytes(buffer,maxNbBytes,timeOut_ms,sleepDuration_us);
+    USDT_PROBE2(usbrelay,readbytes_return,fd,result);
+    return result;
+}
+
+
+
+/*!
+     \brief Body of readBytes, separated so that the entry and return probes
+            see every exit path
+     \return >=0 number of bytes read, -1 or -2 error (see readBytes)
+  */
+int serialib::waitBytes (void *buffer,unsigned int maxNbBytes,unsigned int timeOut_ms, unsigned int sleepDuration_us)
 {
 #if defined (_WIN32) || defined(_WIN64)
     // Avoid warning while compiling
@@ -683,46 +791,187 @@ int serialib::readBytes (void *buffer,unsigned int maxNbBytes,unsigned int timeO
 
 
     // Read the bytes from the serial device, return -2 if an error occured
-    if(!ReadFile(hSerial,buffer,(DWORD)maxNbBytes,&dwBytesRead, NULL))  return -2;
+    if(!ReadFile(hSerial,buffer,(DWORD)maxNbBytes,&dwBytesRead, NULL)) { metricAdd(metrics->errors); return -2; }
 
     // Return the byte read
+    metricAdd(metrics->bytesrx,dwBytesRead);
+    if (dwBytesRead<maxNbBytes) metricAdd(metrics->timeouts);
     return dwBytesRead;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Timer used for timeout
-    timeOut          timer;
-    // Initialise the timer
-    timer.initTimer();
+    // CPU relaxing is done by waiting on the device instead of sleeping
+    UNUSED(sleepDuration_us);
+    // Deadline of the read on the serial clock
+    uint64_t         start=clock->now_us();
+    uint64_t         deadline=start+(uint64_t)timeOut_ms*1000;
+    // Wait descriptor for the device
+    struct pollfd    pfd;
+    pfd.fd=acquireInput();
+    pfd.events=POLLIN;
     unsigned int     NbByteRead=0;
     // While Timeout is not reached
-    while (timer.elapsedTime_ms()<timeOut_ms || timeOut_ms==0)
+    while (true)
     {
         // Compute the position of the current byte
         unsigned char* Ptr=(unsigned char*)buffer+NbByteRead;
         // Try to read a byte on the device
-        int Ret=read(fd,(void*)Ptr,maxNbBytes-NbByteRead);
+        int Ret=read(pfd.fd,(void*)Ptr,maxNbBytes-NbByteRead);
         // Error while reading
-        if (Ret==-1) return -2;
+        if (Ret==-1 && errno!=EAGAIN && errno!=EINTR) { releaseInput(pfd.fd); metricAdd(metrics->errors); return -2; }
+        // Capture pipe hung up and drained: back to the device
+        if (Ret==0 && pfd.fd!=fd) { releaseInput(pfd.fd); pfd.fd=acquireInput(); continue; }
 
         // One or several byte(s) has been read on the device
         if (Ret>0)
         {
             // Increase the number of read bytes
             NbByteRead+=Ret;
+            metricAdd(metrics->bytesrx,Ret);
             // Success : bytes has been read
             if (NbByteRead>=maxNbBytes)
+            {
+                releaseInput(pfd.fd);
+                metrics->readwait.record(clock->now_us()-start);
                 return NbByteRead;
+            }
         }
-        // Suspend the loop to avoid charging the CPU
-        usleep (sleepDuration_us);
+        // Compute the remaining time (-1 = infinite)
+        int remaining_ms=-1;
+        if (timeOut_ms!=0)
+        {
+            uint64_t now=clock->now_us();
+            if (now>=deadline) break;
+            remaining_ms=(int)((deadline-now+999)/1000);
+        }
+        // Suspend the loop until new bytes arrive to avoid charging the CPU
+        pfd.revents=0;
+        int ready=poll(&pfd,1,clock->ioWait_ms(remaining_ms));
+        if (ready<0 && errno!=EINTR) { releaseInput(pfd.fd); metricAdd(metrics->errors); return -2; }
+        if (ready==0 && timeOut_ms!=0) clock->sleepUntil_us(deadline);
     }
     // Timeout reached, return the number of bytes read
+    releaseInput(pfd.fd);
+    metricAdd(metrics->timeouts);
+    metrics->readwait.record(clock->now_us()-start);
     return NbByteRead;
 #endif
 }
 
 
 
+/*!
+     \brief Read the bytes received so far, blocking only until the first one
+            arrives. Suited to streams: one call per burst instead of one per
+            byte, and no wait for a buffer that may never fill
+     \param buffer : array of bytes read from the serial device
+     \param maxNbBytes : maximum allowed number of bytes read
+     \param timeOut_ms : delay of timeout before giving up the reading (0 = wait forever)
+     \return >0 number of bytes read
+     \return 0 timeout reached
+     \return -1 error while setting the Timeout
+     \return -2 error while reading the byte
+  */
+int serialib::readAvailable (void *buffer,unsigned int maxNbBytes,unsigned int timeOut_ms)
+{
+    TRACE_SCOPE("readAvailable",maxNbBytes);
+#if defined (_WIN32) || defined(_WIN64)
+    // Number of bytes read
+    DWORD dwBytesRead = 0;
+
+    // Return as soon as one byte is received (MAXDWORD interval and multiplier)
+    COMMTIMEOUTS burst=timeouts;
+    burst.ReadIntervalTimeout=MAXDWORD;
+    burst.ReadTotalTimeoutMultiplier=MAXDWORD;
+    burst.ReadTotalTimeoutConstant=timeOut_ms ? (DWORD)timeOut_ms : MAXDWORD-1;
+    if(!SetCommTimeouts(hSerial, &burst)) return -1;
+
+    // Read the bytes from the serial device, return -2 if an error occured
+    BOOL ok=ReadFile(hSerial,buffer,(DWORD)maxNbBytes,&dwBytesRead, NULL);
+    SetCommTimeouts(hSerial, &timeouts);
+    if(!ok) { metricAdd(metrics->errors); return -2; }
+
+    metricAdd(metrics->bytesrx,dwBytesRead);
+    if (dwBytesRead==0) metricAdd(metrics->timeouts);
+    return dwBytesRead;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    uint64_t         start=clock->now_us();
+    uint64_t         deadline=start+(uint64_t)timeOut_ms*1000;
+    struct pollfd    pfd;
+    pfd.fd=acquireInput();
+    pfd.events=POLLIN;
+    while (true)
+    {
+        // Take everything the driver holds in one call
+        int Ret=read(pfd.fd,buffer,maxNbBytes);
+        if (Ret==-1 && errno!=EAGAIN && errno!=EINTR) { releaseInput(pfd.fd); metricAdd(metrics->errors); return -2; }
+        // Capture pipe hung up and drained: back to the device
+        if (Ret==0 && pfd.fd!=fd) { releaseInput(pfd.fd); pfd.fd=acquireInput(); continue; }
+        if (Ret>0)
+        {
+            releaseInput(pfd.fd);
+            metricAdd(metrics->bytesrx,Ret);
+            metrics->readwait.record(clock->now_us()-start);
+            return Ret;
+        }
+        // Compute the remaining time (-1 = infinite)
+        int remaining_ms=-1;
+        if (timeOut_ms!=0)
+        {
+            uint64_t now=clock->now_us();
+            if (now>=deadline) break;
+            remaining_ms=(int)((deadline-now+999)/1000);
+        }
+        // Sleep until the first byte arrives
+        pfd.revents=0;
+        int ready=poll(&pfd,1,clock->ioWait_ms(remaining_ms));
+        if (ready<0 && errno!=EINTR) { releaseInput(pfd.fd); metricAdd(metrics->errors); return -2; }
+        if (ready==0 && timeOut_ms!=0) clock->sleepUntil_us(deadline);
+    }
+    releaseInput(pfd.fd);
+    metricAdd(metrics->timeouts);
+    metrics->readwait.record(clock->now_us()-start);
+    return 0;
+#endif
+}
+
+
+
+
+#if defined (__linux__) || defined(__APPLE__)
+/*!
+    \brief  Take the descriptor a read call is served from: the device, or the
+            pipe of a running SerialCapture. The capture does not close its
+            pipe before every call holding it has called releaseInput
+    \return The descriptor to read from
+*/
+int serialib::acquireInput()
+{
+    while (true)
+    {
+        int in=infd.load();
+        if (in==fd) return in;
+        pipereaders.fetch_add(1);
+        // Still the pipe once counted: the capture sees us before closing it
+        if (infd.load()==in) return in;
+        releaseInput(in);
+    }
+}
+
+
+
+/*!
+    \brief  Give back the descriptor taken by acquireInput
+    \param in : descriptor returned by acquireInput
+*/
+void serialib::releaseInput(int in)
+{
+    if (in!=fd && pipereaders.fetch_sub(1)==1) pipereaders.notify_all();
+}
+#endif
+
+
+
 
 // _________________________
 // ::: Special operation :::
@@ -744,12 +993,38 @@ char serialib::flushReceiver()
 #if defined (__linux__) || defined(__APPLE__)
     // Purge receiver
     tcflush(fd,TCIFLUSH);
+    // Bytes already moved to the capture pipe
+    char drain[256];
+    int in=acquireInput();
+    while (in!=fd && read(in,drain,sizeof(drain))>0);
+    releaseInput(in);
     return true;
 #endif
 }
 
 
 
+/*!
+    \brief  Return the descriptor of the device, to wait for it in poll/epoll
+            loops next to other descriptors (UNIX only). The descriptor is in
+            nonblocking mode and stays owned by serialib. Bytes read
+            directly from it bypass a running SerialCapture: they are not
+            recorded and compete with the capture thread, so a port used
+            that way must not be captured
+    \return The file descriptor, -1 if the device is closed or on Windows
+*/
+int serialib::getFd()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    return -1;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    return fd;
+#endif
+}
+
+
+
 /*!
     \brief  Return the number of bytes in the received buffer (UNIX only)
     \return The number of bytes received by the serial provider but not yet read.
@@ -769,7 +1044,9 @@ int serialib::available()
 #if defined (__linux__) || defined(__APPLE__)
     int nBytes=0;
     // Return number of pending bytes in the receiver
-    ioctl(fd, FIONREAD, &nBytes);
+    int in=acquireInput();
+    ioctl(in, FIONREAD, &nBytes);
+    releaseInput(in);
     return nBytes;
 #endif
 
@@ -777,6 +1054,98 @@ int serialib::available()
 
 
 
+/*!
+    \brief  Take a snapshot of the driver counters of the port (TIOCGICOUNT on
+            Linux: bytes, framing/overrun/parity errors, breaks, buffer
+            overruns, modem line transitions) and of the input and output
+            queue depths (FIONREAD/TIOCOUTQ). Three ioctls, no allocation.
+    \param  stats : filled snapshot
+    \return 1 counters and queues are valid
+    \return 0 only the queues are valid (driver without counters, e.g. pty)
+    \return -1 device not open
+*/
+int serialib::linkStats(SerialLinkStats *stats)
+{
+    memset(stats,0,sizeof(SerialLinkStats));
+    stats->inqueue=-1;
+    stats->outqueue=-1;
+#if defined (_WIN32) || defined(_WIN64)
+    if (hSerial==INVALID_HANDLE_VALUE) return -1;
+    // Device errors (flags only, the driver does not count them)
+    DWORD commErrors;
+    // Device status
+    COMSTAT commStatus;
+    if (!ClearCommError(hSerial, &commErrors, &commStatus)) return -1;
+    stats->inqueue=commStatus.cbInQue;
+    stats->outqueue=commStatus.cbOutQue;
+    return 0;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    if (fd<0) return -1;
+    int queue=0;
+    if (ioctl(fd, FIONREAD, &queue)==0) stats->inqueue=queue;
+    if (ioctl(fd, TIOCOUTQ, &queue)==0) stats->outqueue=queue;
+#if defined (__linux__)
+    struct serial_icounter_struct icount;
+    if (ioctl(fd, TIOCGICOUNT, &icount)==0)
+    {
+        stats->counters=true;
+        stats->rx=icount.rx;
+        stats->tx=icount.tx;
+        stats->frame=icount.frame;
+        stats->overrun=icount.overrun;
+        stats->parity=icount.parity;
+        stats->brk=icount.brk;
+        stats->bufoverrun=icount.buf_overrun;
+        stats->cts=icount.cts;
+        stats->dsr=icount.dsr;
+        stats->rng=icount.rng;
+        stats->dcd=icount.dcd;
+        return 1;
+    }
+#endif
+    return 0;
+#endif
+}
+
+
+
+/*!
+    \brief  Wait until every written byte has left the kernel output queue,
+            i.e. was handed to the UART or to the USB device. The queue
+            (TIOCOUTQ) is polled with a backoff from 50 µs to 1 ms, so a
+            single byte at 9600 bauds costs about five ioctls. Bytes already
+            in the FIFO of a USB adapter are not visible to the host.
+    \param  timeOut_ms : maximum wait, 0 checks the queue once
+    \return 1 the output queue is empty
+    \return 0 timeout reached with bytes still queued
+    \return -1 error or not supported
+*/
+int serialib::waitSent(unsigned int timeOut_ms)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    // Writes are synchronous: WriteFile returns once the driver sent the data
+    UNUSED(timeOut_ms);
+    return hSerial==INVALID_HANDLE_VALUE ? -1 : 1;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    uint64_t        deadline=clock->now_us()+(uint64_t)timeOut_ms*1000;
+    uint64_t        backoff_us=50;
+    while (true)
+    {
+        int queued=0;
+        if (ioctl(fd, TIOCOUTQ, &queued)!=0) return -1;
+        if (queued==0) return 1;
+        uint64_t now=clock->now_us();
+        if (now>=deadline) return 0;
+        clock->sleep_us(backoff_us<deadline-now ? backoff_us : deadline-now);
+        if (backoff_us<1000) backoff_us*=2;
+    }
+#endif
+}
+
+
+
 // __________________
 // ::: I/O Access :::
 
@@ -1054,6 +1423,298 @@ bool serialib::isRTS()
 
 
 
+// _________________________
+// ::: Time source :::
+
+/*!
+    \brief      Select the clock used for timeouts and for the CPU relaxing
+                sleeps of the reading functions. A VirtualClock lets tests run
+                long timeouts instantly.
+    \param      clock : time source (not owned), nullptr for the system clock
+*/
+void serialib::setClock(Clock *clock)
+{
+    this->clock = clock ? clock : &systemClock();
+}
+
+
+
+
+// _________________________
+// ::: Metrics :::
+
+/*!
+    \brief      Select where the counters of the port are kept, so that they
+                can outlive the serialib object (Usbrelay keeps them across
+                reconnections)
+    \param      metrics : counters (not owned), nullptr for the internal ones
+*/
+void serialib::setMetrics(SerialMetrics *metrics)
+{
+    this->metrics = metrics ? metrics : &ownMetrics;
+}
+
+/*!
+    \brief      Return the counters of the port: bytes sent and received,
+                read timeouts, I/O errors and the read wait histogram
+*/
+const SerialMetrics& serialib::getMetrics()
+{
+    return *metrics;
+}
+
+
+
+
+// _________________________
+// ::: Modem lines :::
+
+/*!
+    \brief      Read every modem line with a single request (one TIOCMGET
+                instead of one per isCTS/isDSR/isDCD/isRI/isDTR/isRTS call)
+    \return     SerialModemLine bits of the lines that are set
+    \return     -1 error
+*/
+int serialib::modemLines()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    DWORD modemStat;
+    if (!GetCommModemStatus(hSerial, &modemStat)) return -1;
+    int lines=0;
+    if (modemStat & MS_CTS_ON) lines|=SERIAL_LINE_CTS;
+    if (modemStat & MS_DSR_ON) lines|=SERIAL_LINE_DSR;
+    if (modemStat & MS_RLSD_ON) lines|=SERIAL_LINE_DCD;
+    if (modemStat & MS_RING_ON) lines|=SERIAL_LINE_RI;
+    if (currentStateDTR) lines|=SERIAL_LINE_DTR;
+    if (currentStateRTS) lines|=SERIAL_LINE_RTS;
+    return lines;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    int status=0;
+    if (ioctl(fd, TIOCMGET, &status)!=0) return -1;
+    int lines=0;
+    if (status & TIOCM_CTS) lines|=SERIAL_LINE_CTS;
+    if (status & TIOCM_DSR) lines|=SERIAL_LINE_DSR;
+    if (status & TIOCM_CAR) lines|=SERIAL_LINE_DCD;
+    if (status & TIOCM_RNG) lines|=SERIAL_LINE_RI;
+    if (status & TIOCM_DTR) lines|=SERIAL_LINE_DTR;
+    if (status & TIOCM_RTS) lines|=SERIAL_LINE_RTS;
+    return lines;
+#endif
+}
+
+
+/*!
+    \brief      Read the number of transitions the driver counted on each
+                input line (TIOCGICOUNT, Linux only). Comparing two snapshots
+                shows pulses that came and went between them
+    \param      counters : receives the counters
+    \return     1 success
+    \return     -1 the driver does not count transitions, or error
+*/
+int serialib::modemCounters(SerialModemCounters *counters)
+{
+#if defined (__linux__)
+    struct serial_icounter_struct icount;
+    if (ioctl(fd, TIOCGICOUNT, &icount)!=0) return -1;
+    counters->transitions[0]=icount.cts;
+    counters->transitions[1]=icount.dsr;
+    counters->transitions[2]=icount.dcd;
+    counters->transitions[3]=icount.rng;
+    return 1;
+#else
+    UNUSED(counters);
+    return -1;
+#endif
+}
+
+
+/*!
+    \brief      Wait until one of the selected input lines changes state.
+                On Linux the change is a difference of the driver transition
+                counters (TIOCGICOUNT) from a snapshot, so a pulse shorter
+                than the wait is seen and no change between the snapshot and
+                the wait is lost. The wait blocks on a thread of the port that
+                sleeps in TIOCMIWAIT (started by the first call, cancelled by
+                closeDevice), timed or not, without touching any signal
+                disposition. Drivers with the counters but not TIOCMIWAIT are
+                read every millisecond; drivers without the counters (ptys,
+                macOS, Windows) fall back to reading the lines every
+                millisecond.
+    \param      mask : SerialModemLine input bits to watch
+    \param      timeOut_ms : maximum wait, 0 waits forever
+    \param      lines : optional, receives the lines after the wait
+    \param      counters : optional, snapshot from modemCounters or from a
+                previous wait to compare with (a change since then ends the
+                wait at once); receives the counters after the wait. Left
+                unchanged when the driver does not count transitions
+    \return     1 a watched line changed
+    \return     0 timeout reached, or interrupted by interruptModemWait
+    \return     -1 error
+*/
+int serialib::waitModemChange(int mask, unsigned int timeOut_ms, int *lines, SerialModemCounters *counters)
+{
+    mask&=SERIAL_LINE_INPUTS;
+#if defined (__linux__)
+    SerialModemCounters now;
+    if (modemCounters(&now)==1)
+    {
+        SerialModemCounters start=counters ? *counters : now;
+        uint64_t deadline=clock->now_us()+(uint64_t)timeOut_ms*1000;
+        startModemWatch();
+        std::unique_lock<std::mutex> guard(modemlock);
+        while (true)
+        {
+            // Read under the lock: a wake-up after this read bumps the generation
+            uint64_t generation=modemgeneration;
+            if (modemCounters(&now)!=1) return -1;
+            bool changed=false;
+            for (int k=0; k<4; k++)
+                changed|=((mask>>k) & 1) && now.transitions[k]!=start.transitions[k];
+            bool interrupted=modeminterrupt.exchange(false);
+            uint64_t time=clock->now_us();
+            if (changed || interrupted || (timeOut_ms!=0 && time>=deadline))
+            {
+                guard.unlock();
+                if (counters) *counters=now;
+                if (lines && (*lines=modemLines())<0) return -1;
+                return changed ? 1 : 0;
+            }
+            int remaining_ms=timeOut_ms!=0 ? (int)((deadline-time+999)/1000) : -1;
+            if (modemwatch<0)
+            {
+                // The driver cannot wait for modem changes: poll the counters instead
+                guard.unlock();
+                clock->sleepUntil_us(timeOut_ms!=0 ? std::min(time+1000, deadline) : time+1000);
+                guard.lock();
+                continue;
+            }
+            int wait_ms=clock->ioWait_ms(remaining_ms);
+            auto woken=[&]{ return modemgeneration!=generation || modeminterrupt; };
+            if (wait_ms<0) modemchanged.wait(guard, woken);
+            else if (!modemchanged.wait_for(guard, std::chrono::milliseconds(wait_ms), woken) && timeOut_ms!=0)
+            {
+                // Nothing arrived: let the clock reach the deadline (instant on a virtual clock)
+                guard.unlock();
+                clock->sleepUntil_us(deadline);
+                guard.lock();
+            }
+        }
+    }
+#endif
+    return pollModemChange(mask, timeOut_ms, lines);
+}
+
+
+/*!
+    \brief      Make the waitModemChange in progress return 0 at once, e.g. to
+                stop the thread calling it. When no wait is in progress the
+                next one returns 0 instead, so the request cannot be lost
+                between the caller's checks
+*/
+void serialib::interruptModemWait()
+{
+#if defined (__linux__)
+    {
+        // Under the lock of the waiters, so it cannot fall between their check and their sleep
+        std::lock_guard<std::mutex> guard(modemlock);
+        modeminterrupt=true;
+    }
+    modemchanged.notify_all();
+#else
+    modeminterrupt=true;
+#endif
+}
+
+
+/*!
+    \brief      Fallback of waitModemChange: read the lines every millisecond
+    \return     1 changed, 0 timeout, -1 error
+*/
+int serialib::pollModemChange(int mask, unsigned int timeOut_ms, int *lines)
+{
+    int initial=modemLines();
+    if (initial<0) return -1;
+    uint64_t deadline=clock->now_us()+(uint64_t)timeOut_ms*1000;
+    while (true)
+    {
+        int current=modemLines();
+        if (current<0) return -1;
+        if (lines) *lines=current;
+        if ((current^initial) & mask) return 1;
+        if (modeminterrupt.exchange(false)) return 0;
+        if (timeOut_ms!=0 && clock->now_us()>=deadline) return 0;
+        clock->sleep_us(1000);
+    }
+}
+
+
+#if defined (__linux__)
+/*!
+    \brief      Start the thread waiting for modem changes, unless it runs or
+                has found that the driver cannot wait
+    \return     1 the thread waits, -1 the driver cannot wait
+*/
+int serialib::startModemWatch()
+{
+    std::lock_guard<std::mutex> guard(modemlock);
+    if (modemwatch==0)
+        modemwatch=pthread_create(&modemwatcher, nullptr, &serialib::watchModem, this)==0 ? 1 : -2;
+    return modemwatch>0 ? 1 : -1;
+}
+
+
+/*!
+    \brief      Stop the thread waiting for modem changes. TIOCMIWAIT only
+                returns on a transition or a signal, so the thread is
+                cancelled, which it allows inside the ioctl only
+*/
+void serialib::stopModemWatch()
+{
+    {
+        std::lock_guard<std::mutex> guard(modemlock);
+        if (modemwatch==0) return;
+        if (modemwatch==-2) { modemwatch=0; return; }
+    }
+    pthread_cancel(modemwatcher);
+    pthread_join(modemwatcher, nullptr);
+    modemwatch=0;
+}
+
+
+/*!
+    \brief      Body of the modem watch thread: sleep in TIOCMIWAIT on every
+                input line and wake the waiters of waitModemChange after each
+                transition. A transition in the instants between two ioctls is
+                seen by the waiters at their next wake-up or deadline
+    \param      port : the serialib
+    \return     nullptr
+*/
+void* serialib::watchModem(void *port)
+{
+    serialib *self=(serialib*)port;
+    while (true)
+    {
+        int type;
+        pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &type);
+        int result=ioctl(self->fd, TIOCMIWAIT, TIOCM_CTS | TIOCM_DSR | TIOCM_CAR | TIOCM_RNG);
+        int error=result!=0 ? errno : 0;
+        pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &type);
+        bool ended=result!=0 && error!=EINTR;
+        {
+            std::lock_guard<std::mutex> guard(self->modemlock);
+            if (ended) self->modemwatch=-1;
+            self->modemgeneration++;
+        }
+        self->modemchanged.notify_all();
+        if (ended) return nullptr;
+    }
+}
+#endif
+
+
+
+
 // ******************************************
 //  Class timeOut
 // ******************************************
@@ -1061,9 +1722,10 @@ bool serialib::isRTS()
 
 /*!
     \brief      Constructor of the class timeOut.
+    \param      clock : optional time source, the OS timer is used when nullptr
 */
 // Constructor
-timeOut::timeOut()
+timeOut::timeOut(Clock *clock) : clock(clock), previousClock_us(0)
 {}
 
 
@@ -1073,6 +1735,11 @@ timeOut::timeOut()
 //Initialize the timer
 void timeOut::initTimer()
 {
+    if (clock)
+    {
+        previousClock_us = clock->now_us();
+        return;
+    }
 #if defined (NO_POSIX_TIME)
     LARGE_INTEGER tmp;
     QueryPerformanceFrequency(&tmp);
@@ -1093,6 +1760,8 @@ void timeOut::initTimer()
 //Return the elapsed time since initialization
 unsigned long int timeOut::elapsedTime_ms()
 {
+    if (clock)
+        return (clock->now_us()-previousClock_us)/1000;
 #if defined (NO_POSIX_TIME)
     // Current time
     LARGE_INTEGER CurrentTime;
@@ -0,0 +1,119 @@
+#include <simboard.hpp>
+#include <relayboard.hpp>
+
+
+
+// Constructor for the SimBoard class
+// Parameters: relaynumber - number of relays of the simulated board (2, 4, 8,
+//                           16 or 32, see RELAY_HYPOTHETICAL_MODELS)
+//             boards - number of such boards chained (8 relays or more)
+//             protocol - command protocol of the board
+SimBoard::SimBoard(int relaynumber, int boards, RelayProtocol protocol) {
+    this->relaynumber = relayBoardSize(relaynumber);
+    this->protocol = protocol;
+    this->format = RelayFrameFormat::of(this->relaynumber, relayChainLength(this->relaynumber, boards));
+    this->reset();
+}
+
+// Feeds one byte sent by the host to the board
+// Parameters: byte - the received byte
+//             reply - buffer receiving the answer of the board (at least 1 byte)
+// Returns: the number of bytes written to reply
+int SimBoard::input(uint8_t byte, uint8_t* reply) {
+    if (protocol == RELAY_PROTOCOL_LCUS)
+        return this->inputLcus(byte);
+    switch (phase) {
+        case WAITINIT:
+        case IDENTIFIED:
+            if (byte == RelayBoardModel<8>::initrequest) { // Identification request
+                reply[0] = this->getIdentifier();
+                phase = IDENTIFIED;
+                return 1;
+            }
+            if (byte == RelayBoardModel<8>::startcommand && phase == IDENTIFIED) { // Start command mode
+                phase = READY;
+                received = 0;
+            }
+            return 0;
+        case READY:
+            frame[received++] = byte;
+            if (received == format.framebytes) { // Whole state received
+                state = format.decode(frame);
+                received = 0;
+            }
+            return 0;
+    }
+    return 0;
+}
+
+// Feeds one byte of an LCUS frame, waiting for 0xa0 to start a frame
+// Parameters: byte - the received byte
+// Returns: 0, LCUS boards never answer
+int SimBoard::inputLcus(uint8_t byte) {
+    static_assert(RELAY_MAX_FRAME >= 4, "frame holds LCUS frames");
+    if (received == 0 && byte != LcusProtocol::start)
+        return 0;
+    frame[received++] = byte;
+    if (received < 4)
+        return 0;
+    received = 0;
+    bool on = false;
+    int channel = LcusProtocol::decode(frame, &on);
+    if (channel < 1 || channel > 32 || !((format.mask >> (channel - 1)) & 1)) {
+        invalidframes++;
+        return 0;
+    }
+    RelayMask bit = RelayMask(1) << (channel - 1);
+    state = on ? state | bit : state & ~bit;
+    return 0;
+}
+
+// Returns the decoded state, bit k set when relay k+1 is on
+RelayMask SimBoard::getState() {
+    return state;
+}
+
+// Returns the identifier answered to 0x50
+uint8_t SimBoard::getIdentifier() {
+    switch (relaynumber) {
+        case 2:
+            return RelayBoardModel<2>::identifier;
+        case 4:
+            return RelayBoardModel<4>::identifier;
+#if defined (USBRELAY_HYPOTHETICAL_MODELS)
+        case 16:
+            return RelayBoardModel<16>::identifier;
+        case 32:
+            return RelayBoardModel<32>::identifier;
+#endif
+        default:
+            return RelayBoardModel<8>::identifier;
+    }
+}
+
+// Returns the number of relays of the simulated board
+int SimBoard::getRelayNumber() {
+    return relaynumber;
+}
+
+// Returns true once the board accepts state bytes
+bool SimBoard::isReady() {
+    return phase == READY;
+}
+
+// Returns true while a multi-byte state frame is partly received
+bool SimBoard::isInFrame() {
+    return received > 0;
+}
+
+// Returns the number of LCUS frames rejected (bad checksum or channel)
+unsigned long SimBoard::getInvalidFrames() {
+    return invalidframes;
+}
+
+// Emulates a power cycle: relays off and init handshake required again
+void SimBoard::reset() {
+    phase = protocol == RELAY_PROTOCOL_LCUS ? READY : WAITINIT;
+    state = 0;
+    received = 0;
+}
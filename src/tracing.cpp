@@ -0,0 +1,119 @@
+#include <tracing.hpp>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+
+namespace tracing
+{
+
+std::atomic<bool> active {false};
+
+// Event storage of one thread, written only by that thread
+struct Buffer
+{
+    std::unique_ptr<Event[]> events;
+    size_t capacity;
+    std::atomic<size_t> count {0};
+    int tid;
+};
+
+static std::mutex registryLock;
+static std::vector<std::unique_ptr<Buffer>> buffers;
+static size_t bufferCapacity = 65536;
+static std::atomic<uint64_t> generation {1};
+static std::atomic<uint64_t> lost {0};
+static thread_local Buffer* local = nullptr;
+static thread_local uint64_t localGeneration = 0;
+
+// Starts recording
+// Parameters: eventsPerThread - size of the buffer given to each recording thread
+void start(size_t eventsPerThread) {
+    {
+        std::lock_guard<std::mutex> guard(registryLock);
+        bufferCapacity = eventsPerThread;
+    }
+    active.store(true, std::memory_order_release);
+}
+
+// Stops recording, the events stay available for writeChromeJson
+void stop() {
+    active.store(false, std::memory_order_release);
+}
+
+// Releases every buffer, threads allocate a new one on their next event
+void clear() {
+    std::lock_guard<std::mutex> guard(registryLock);
+    buffers.clear();
+    lost = 0;
+    generation.fetch_add(1);
+}
+
+// Returns the number of events lost because a buffer was full
+uint64_t dropped() {
+    return lost.load(std::memory_order_relaxed);
+}
+
+// Allocates the buffer of the calling thread (once per thread and generation)
+static Buffer* attach() {
+    std::lock_guard<std::mutex> guard(registryLock);
+    auto buffer = std::make_unique<Buffer>();
+    buffer->events = std::make_unique<Event[]>(bufferCapacity);
+    buffer->capacity = bufferCapacity;
+    buffer->tid = int(buffers.size()) + 1;
+    local = buffer.get();
+    localGeneration = generation.load();
+    buffers.push_back(std::move(buffer));
+    return local;
+}
+
+// Appends one event to the buffer of the calling thread
+// Parameters: name - event name, must be a string literal
+//             phase - 'B', 'E' or 'i'
+//             arg - value shown in the event arguments
+void record(const char* name, char phase, uint64_t arg) {
+    Buffer* buffer = local;
+    if (!buffer || localGeneration != generation.load(std::memory_order_relaxed))
+        buffer = attach();
+    size_t index = buffer->count.load(std::memory_order_relaxed);
+    if (index >= buffer->capacity) {
+        lost.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    buffer->events[index] = {name, uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()), arg, phase};
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+// Writes the recorded events as Chrome trace-event JSON
+// Parameters: path - destination file
+// Returns: 1 if the file is written, -1 otherwise
+int writeChromeJson(const std::string& path) {
+    FILE* out = std::fopen(path.c_str(), "w");
+    if (!out)
+        return -1;
+    std::lock_guard<std::mutex> guard(registryLock);
+    std::fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (auto& buffer : buffers) {
+        size_t count = buffer->count.load(std::memory_order_acquire);
+        for (size_t k = 0; k < count; k++) {
+            const Event& event = buffer->events[k];
+            std::fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+                         first ? "" : ",\n", event.name, event.phase, event.ts_ns / 1000.0, buffer->tid);
+            if (event.phase == 'i')
+                std::fprintf(out, ",\"s\":\"t\"");
+            if (event.phase != 'E')
+                std::fprintf(out, ",\"args\":{\"value\":%llu}", (unsigned long long)event.arg);
+            std::fprintf(out, "}");
+            first = false;
+        }
+    }
+    std::fprintf(out, "\n]}\n");
+    return std::fclose(out) == 0 ? 1 : -1;
+}
+
+}
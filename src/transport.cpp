@@ -0,0 +1,560 @@
+#include <transport.hpp>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+
+#if defined (__linux__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// A peer closing the connection must not raise SIGPIPE in the host process
+#ifdef MSG_NOSIGNAL
+static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static constexpr int SEND_FLAGS = 0; // macOS: SO_NOSIGPIPE set on the socket instead
+#endif
+#endif
+
+
+
+// Constructor for the SerialTransport class
+// Parameters: device - serial device path (/dev/ttyACM0, COM3...)
+//             baudrate - line speed
+SerialTransport::SerialTransport(const std::string& device, unsigned int baudrate) {
+    this->device = device;
+    this->baudrate = baudrate;
+}
+
+int SerialTransport::open() {
+    return port.openDevice(device.c_str(), baudrate) == 1 ? 1 : -1;
+}
+
+void SerialTransport::close() {
+    port.closeDevice();
+}
+
+bool SerialTransport::isOpen() {
+    return port.isDeviceOpen();
+}
+
+int SerialTransport::write(const void* data, unsigned int size) {
+    return size == 1 ? port.writeChar(*(const char*)data) : port.writeBytes(data, size);
+}
+
+int SerialTransport::read(void* buffer, unsigned int size, unsigned int timeOut_ms) {
+    return size == 1 ? port.readChar((char*)buffer, timeOut_ms) : port.readAvailable(buffer, size, timeOut_ms);
+}
+
+int SerialTransport::waitSent(unsigned int timeOut_ms) {
+    return port.waitSent(timeOut_ms);
+}
+
+int SerialTransport::linkStats(SerialLinkStats* stats) {
+    return port.linkStats(stats);
+}
+
+int SerialTransport::setDTR(bool status) {
+    return port.DTR(status) ? 1 : -1;
+}
+
+int SerialTransport::setRTS(bool status) {
+    return port.RTS(status) ? 1 : -1;
+}
+
+int SerialTransport::modemLines() {
+    return port.modemLines();
+}
+
+void SerialTransport::setClock(Clock* clock) {
+    Transport::setClock(clock);
+    port.setClock(this->clock);
+}
+
+void SerialTransport::setMetrics(SerialMetrics* metrics) {
+    Transport::setMetrics(metrics);
+    port.setMetrics(this->metrics);
+}
+
+// Returns the serial port, for calls that have no transport equivalent
+serialib& SerialTransport::getSerial() {
+    return port;
+}
+
+
+
+// Constructor for the LoopbackTransport class
+// Parameters: relaynumber - number of relays of the in-memory board
+//             protocol - command protocol of the in-memory board
+LoopbackTransport::LoopbackTransport(int relaynumber, RelayProtocol protocol) : board(relaynumber, 1, protocol) {
+}
+
+int LoopbackTransport::open() {
+    opened = true;
+    return 1;
+}
+
+void LoopbackTransport::close() {
+    opened = false;
+    replies.clear();
+}
+
+bool LoopbackTransport::isOpen() {
+    return opened;
+}
+
+int LoopbackTransport::write(const void* data, unsigned int size) {
+    if (!opened)
+        return -1;
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (unsigned int k = 0; k < size; k++) {
+        uint8_t reply[4];
+        int nreply = board.input(bytes[k], reply);
+        replies.insert(replies.end(), reply, reply + nreply);
+    }
+    metricAdd(metrics->bytestx, size);
+    return 1;
+}
+
+int LoopbackTransport::read(void* buffer, unsigned int size, unsigned int timeOut_ms) {
+    (void)timeOut_ms;
+    if (!opened)
+        return -1;
+    unsigned int nbyte = 0;
+    while (nbyte < size && !replies.empty()) {
+        ((uint8_t*)buffer)[nbyte++] = replies.front();
+        replies.pop_front();
+    }
+    if (nbyte)
+        metricAdd(metrics->bytesrx, nbyte);
+    else
+        metricAdd(metrics->timeouts);
+    return nbyte;
+}
+
+int LoopbackTransport::waitSent(unsigned int timeOut_ms) {
+    (void)timeOut_ms;
+    return opened ? 1 : -1;
+}
+
+// Returns the in-memory board, to check or reset its state
+SimBoard& LoopbackTransport::getBoard() {
+    return board;
+}
+
+
+
+// Constructor for the TcpTransport class
+// Parameters: host - name or address of the terminal server
+//             port - TCP port of the serial line
+TcpTransport::TcpTransport(const std::string& host, unsigned int port) {
+    this->host = host;
+    this->port = port;
+}
+
+TcpTransport::~TcpTransport() {
+    this->close();
+}
+
+int TcpTransport::open() {
+#if defined (__linux__) || defined(__APPLE__)
+    this->close();
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addresses;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+        return -1;
+    for (struct addrinfo* address = addresses; address && fd < 0; address = address->ai_next) {
+#ifdef SOCK_CLOEXEC
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+#else
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol); // No SOCK_CLOEXEC on macOS
+        if (fd >= 0)
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+        if (fd < 0)
+            continue;
+#ifdef SO_NOSIGPIPE
+        int nosigpipe = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+        if (connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // One segment per command
+    return 1;
+#else
+    return -1;
+#endif
+}
+
+void TcpTransport::close() {
+#if defined (__linux__) || defined(__APPLE__)
+    if (fd >= 0)
+        ::close(fd);
+#endif
+    fd = -1;
+}
+
+bool TcpTransport::isOpen() {
+    return fd >= 0;
+}
+
+int TcpTransport::sendRaw(const void* data, size_t size) {
+#if defined (__linux__) || defined(__APPLE__)
+    const char* bytes = (const char*)data;
+    for (size_t done = 0; done < size;) {
+        ssize_t written = send(fd, bytes + done, size - done, SEND_FLAGS);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            metricAdd(metrics->errors);
+            return -1;
+        }
+        done += written;
+    }
+    return 1;
+#else
+    (void)data;
+    (void)size;
+    return -1;
+#endif
+}
+
+int TcpTransport::write(const void* data, unsigned int size) {
+    if (this->sendRaw(data, size) != 1)
+        return -1;
+    metricAdd(metrics->bytestx, size);
+    return 1;
+}
+
+int TcpTransport::waitReadable(unsigned int timeOut_ms) {
+#if defined (__linux__) || defined(__APPLE__)
+    uint64_t deadline = clock->now_us() + (uint64_t)timeOut_ms * 1000;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (true) {
+        int remaining_ms = -1;
+        if (timeOut_ms != 0) {
+            uint64_t now = clock->now_us();
+            if (now >= deadline)
+                return 0;
+            remaining_ms = (int)((deadline - now + 999) / 1000);
+        }
+        int ready = poll(&pfd, 1, clock->ioWait_ms(remaining_ms));
+        if (ready > 0)
+            return 1;
+        if (ready < 0 && errno != EINTR)
+            return -1;
+        if (ready == 0 && timeOut_ms != 0)
+            clock->sleepUntil_us(deadline);
+    }
+#else
+    (void)timeOut_ms;
+    return -1;
+#endif
+}
+
+int TcpTransport::read(void* buffer, unsigned int size, unsigned int timeOut_ms) {
+#if defined (__linux__) || defined(__APPLE__)
+    if (fd < 0)
+        return -1;
+    uint64_t start = clock->now_us();
+    int ready = this->waitReadable(timeOut_ms);
+    if (ready <= 0) {
+        metricAdd(ready == 0 ? metrics->timeouts : metrics->errors);
+        metrics->readwait.record(clock->now_us() - start);
+        return ready;
+    }
+    ssize_t nbyte = recv(fd, buffer, size, 0);
+    if (nbyte <= 0) { // Connection closed by the server
+        metricAdd(metrics->errors);
+        return -2;
+    }
+    metricAdd(metrics->bytesrx, nbyte);
+    metrics->readwait.record(clock->now_us() - start);
+    return (int)nbyte;
+#else
+    (void)buffer;
+    (void)size;
+    (void)timeOut_ms;
+    return -1;
+#endif
+}
+
+// Reports the socket queues (no line counters over TCP)
+int TcpTransport::linkStats(SerialLinkStats* stats) {
+#if defined (__linux__)
+    if (fd < 0)
+        return -1;
+    *stats = SerialLinkStats();
+    int queue = 0;
+    stats->inqueue = ioctl(fd, FIONREAD, &queue) == 0 ? queue : -1;
+    stats->outqueue = ioctl(fd, TIOCOUTQ, &queue) == 0 ? queue : -1;
+    return 0;
+#else
+    (void)stats;
+    return -1;
+#endif
+}
+
+
+
+// Constructor for the Rfc2217Transport class
+// Parameters: host - name or address of the terminal server
+//             port - TCP port of the serial line
+//             baudrate - line speed requested at open
+Rfc2217Transport::Rfc2217Transport(const std::string& host, unsigned int port, unsigned int baudrate)
+    : TcpTransport(host, port) {
+    this->baudrate = baudrate;
+}
+
+// Connects, then negotiates the COM-PORT-OPTION and sets 8N1 at the requested
+// speed in one burst
+// Returns: 1 once the server confirmed the speed, -1 if it refused RFC 2217 or did not answer within 2 s
+int Rfc2217Transport::open() {
+    if (TcpTransport::open() != 1)
+        return -1;
+    decoder.reset();
+    pending.clear();
+    pendingoffset = 0;
+    confirmedbaudrate = 0;
+    refused = false;
+    outgoing.clear();
+    telnetOption(TELNET_WILL, TELNET_COMPORT, outgoing);
+    telnetOption(TELNET_WILL, TELNET_BINARY, outgoing);
+    telnetOption(TELNET_DO, TELNET_BINARY, outgoing);
+    uint8_t speed[4] = {uint8_t(baudrate >> 24), uint8_t(baudrate >> 16), uint8_t(baudrate >> 8), uint8_t(baudrate)};
+    uint8_t datasize = 8, parity = 1, stopsize = 1, modemmask = 0xff; // 8N1, every modem line reported
+    rfc2217Command(RFC2217_SET_BAUDRATE, speed, 4, outgoing);
+    rfc2217Command(RFC2217_SET_DATASIZE, &datasize, 1, outgoing);
+    rfc2217Command(RFC2217_SET_PARITY, &parity, 1, outgoing);
+    rfc2217Command(RFC2217_SET_STOPSIZE, &stopsize, 1, outgoing);
+    rfc2217Command(RFC2217_SET_MODEMSTATE_MASK, &modemmask, 1, outgoing);
+    if (this->sendRaw(outgoing.data(), outgoing.size()) != 1) {
+        this->close();
+        return -1;
+    }
+    outgoing.clear();
+    uint64_t deadline = clock->now_us() + 2000000;
+    while (!confirmedbaudrate && !refused) {
+        uint64_t now = clock->now_us();
+        if (now >= deadline || this->receive((unsigned int)((deadline - now + 999) / 1000)) < 0) {
+            this->close();
+            return -1;
+        }
+    }
+    if (refused) {
+        this->close();
+        return -1;
+    }
+    return 1;
+}
+
+// Writes data bytes, escaping IAC
+int Rfc2217Transport::write(const void* data, unsigned int size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    if (size == 1 && bytes[0] != TELNET_IAC) { // Relay commands: no copy
+        if (this->sendRaw(bytes, 1) != 1)
+            return -1;
+    } else {
+        std::vector<uint8_t> escaped;
+        escaped.reserve(size + 8);
+        telnetEscape(bytes, size, escaped);
+        if (this->sendRaw(escaped.data(), escaped.size()) != 1)
+            return -1;
+    }
+    metricAdd(metrics->bytestx, size);
+    return 1;
+}
+
+// Receives what the socket holds and decodes it
+// Parameters: timeOut_ms - maximum wait for the first byte
+// Returns: 1 if bytes were decoded, 0 on timeout, -1 on error or closed connection
+int Rfc2217Transport::receive(unsigned int timeOut_ms) {
+#if defined (__linux__) || defined(__APPLE__)
+    int ready = this->waitReadable(timeOut_ms);
+    if (ready <= 0)
+        return ready;
+    uint8_t raw[512];
+    ssize_t nbyte = recv(fd, raw, sizeof(raw), 0);
+    if (nbyte <= 0)
+        return -1;
+    if (pendingoffset == pending.size()) {
+        pending.clear();
+        pendingoffset = 0;
+    }
+    decoder.decode(raw, (size_t)nbyte, pending,
+        [this](uint8_t command, uint8_t option) { this->onOption(command, option); },
+        [this](const uint8_t* sub, size_t size) { this->onSub(sub, size); });
+    if (!outgoing.empty()) { // Answers to the server negotiations
+        int sent = this->sendRaw(outgoing.data(), outgoing.size());
+        outgoing.clear();
+        if (sent != 1)
+            return -1;
+    }
+    return 1;
+#else
+    (void)timeOut_ms;
+    return -1;
+#endif
+}
+
+// Reads data bytes, telnet commands are handled on the way
+int Rfc2217Transport::read(void* buffer, unsigned int size, unsigned int timeOut_ms) {
+    if (fd < 0)
+        return -1;
+    uint64_t start = clock->now_us();
+    uint64_t deadline = start + (uint64_t)timeOut_ms * 1000;
+    while (pendingoffset == pending.size()) {
+        unsigned int remaining_ms = 0;
+        if (timeOut_ms != 0) {
+            uint64_t now = clock->now_us();
+            if (now >= deadline) {
+                metricAdd(metrics->timeouts);
+                metrics->readwait.record(now - start);
+                return 0;
+            }
+            remaining_ms = (unsigned int)((deadline - now + 999) / 1000);
+        }
+        int status = this->receive(remaining_ms);
+        if (status < 0) {
+            metricAdd(metrics->errors);
+            return -2;
+        }
+    }
+    size_t nbyte = std::min<size_t>(size, pending.size() - pendingoffset);
+    memcpy(buffer, pending.data() + pendingoffset, nbyte);
+    pendingoffset += nbyte;
+    metricAdd(metrics->bytesrx, nbyte);
+    metrics->readwait.record(clock->now_us() - start);
+    return (int)nbyte;
+}
+
+// Sends a SET-CONTROL request without waiting for its acknowledgement
+int Rfc2217Transport::control(uint8_t value) {
+    std::vector<uint8_t> message;
+    rfc2217Command(RFC2217_SET_CONTROL, &value, 1, message);
+    return this->sendRaw(message.data(), message.size());
+}
+
+int Rfc2217Transport::setDTR(bool status) {
+    if (this->control(status ? RFC2217_DTR_ON : RFC2217_DTR_OFF) != 1)
+        return -1;
+    outputs = status ? outputs | SERIAL_LINE_DTR : outputs & ~SERIAL_LINE_DTR;
+    return 1;
+}
+
+int Rfc2217Transport::setRTS(bool status) {
+    if (this->control(status ? RFC2217_RTS_ON : RFC2217_RTS_OFF) != 1)
+        return -1;
+    outputs = status ? outputs | SERIAL_LINE_RTS : outputs & ~SERIAL_LINE_RTS;
+    return 1;
+}
+
+// Returns the input lines last notified by the server and the outputs last set
+int Rfc2217Transport::modemLines() {
+    if (fd < 0)
+        return -1;
+#if defined (__linux__) || defined(__APPLE__)
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (poll(&pfd, 1, 0) > 0 && this->receive(1) == 1); // Takes the notifications already received
+#endif
+    int lines = outputs;
+    if (modemstate & RFC2217_MODEM_CTS) lines |= SERIAL_LINE_CTS;
+    if (modemstate & RFC2217_MODEM_DSR) lines |= SERIAL_LINE_DSR;
+    if (modemstate & RFC2217_MODEM_DCD) lines |= SERIAL_LINE_DCD;
+    if (modemstate & RFC2217_MODEM_RI) lines |= SERIAL_LINE_RI;
+    return lines;
+}
+
+// Returns the speed acknowledged by the server at open, 0 before
+unsigned int Rfc2217Transport::getConfirmedBaudrate() {
+    return confirmedbaudrate;
+}
+
+// Answers the option negotiations of the server: binary mode and the
+// COM-PORT-OPTION are accepted, anything else is declined
+void Rfc2217Transport::onOption(uint8_t command, uint8_t option) {
+    bool wanted = option == TELNET_BINARY || option == TELNET_COMPORT || option == TELNET_SGA;
+    switch (command) {
+        case TELNET_WILL:
+            if (!wanted)
+                telnetOption(TELNET_DONT, option, outgoing);
+            else if (option == TELNET_SGA)
+                telnetOption(TELNET_DO, option, outgoing);
+            break;
+        case TELNET_DO:
+            if (!wanted)
+                telnetOption(TELNET_WONT, option, outgoing);
+            break;
+        case TELNET_DONT:
+        case TELNET_WONT:
+            if (option == TELNET_COMPORT) // Plain telnet server
+                refused = true;
+            break;
+    }
+}
+
+// Handles the COM-PORT-OPTION answers and notifications of the server
+void Rfc2217Transport::onSub(const uint8_t* sub, size_t size) {
+    if (size < 2 || sub[0] != TELNET_COMPORT)
+        return;
+    switch (sub[1]) {
+        case RFC2217_SERVER + RFC2217_SET_BAUDRATE:
+            if (size >= 6)
+                confirmedbaudrate = (unsigned int)sub[2] << 24 | (unsigned int)sub[3] << 16 | (unsigned int)sub[4] << 8 | sub[5];
+            break;
+        case RFC2217_SERVER + RFC2217_NOTIFY_MODEMSTATE:
+            if (size >= 3)
+                modemstate = sub[2];
+            break;
+    }
+}
+
+
+
+// Splits "host:port" or "[v6 address]:port", the port defaults to 2000 (ser2net's first port)
+static void splitAddress(const std::string& address, std::string& host, unsigned int& port) {
+    size_t colon = address.find_last_of(':');
+    if (colon != std::string::npos && address.find(']', colon) != std::string::npos)
+        colon = std::string::npos; // "[::1]" without port
+    host = colon == std::string::npos ? address : address.substr(0, colon);
+    port = colon == std::string::npos ? 2000 : std::atoi(address.c_str() + colon + 1);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') // [::1]:2000
+        host = host.substr(1, host.size() - 2);
+}
+
+// Creates the transport of a device name
+// Parameters: device - "tcp://host:port", "rfc2217://host:port", "loop://[relays]" or a serial device
+//             baudrate - line speed of serial devices, requested remotely over RFC 2217
+// Returns: the transport, not opened yet
+std::unique_ptr<Transport> makeTransport(const std::string& device, unsigned int baudrate) {
+    std::string host;
+    unsigned int port;
+    if (device.compare(0, 6, "tcp://") == 0) {
+        splitAddress(device.substr(6), host, port);
+        return std::make_unique<TcpTransport>(host, port);
+    }
+    if (device.compare(0, 10, "rfc2217://") == 0) {
+        splitAddress(device.substr(10), host, port);
+        return std::make_unique<Rfc2217Transport>(host, port, baudrate);
+    }
+    if (device.compare(0, 7, "loop://") == 0) {
+        int relaynumber = device.size() > 7 ? std::atoi(device.c_str() + 7) : 8;
+        return std::make_unique<LoopbackTransport>(relaynumber);
+    }
+    return std::make_unique<SerialTransport>(device, baudrate);
+}
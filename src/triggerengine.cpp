@@ -0,0 +1,211 @@
+#include <triggerengine.hpp>
+#include <tracing.hpp>
+
+
+
+// Index (0..3) of an input line bit in the per-line tables
+static int lineIndex(int line) {
+    switch (line) {
+        case SERIAL_LINE_CTS:
+            return 0;
+        case SERIAL_LINE_DSR:
+            return 1;
+        case SERIAL_LINE_DCD:
+            return 2;
+        default:
+            return 3;
+    }
+}
+
+// Constructor for the TriggerEngine class
+// Parameters: input - opened serial port whose modem lines are watched
+TriggerEngine::TriggerEngine(serialib* input) {
+    this->input = input;
+}
+
+TriggerEngine::~TriggerEngine() {
+    this->stop();
+}
+
+// Adds a rule, only allowed while the engine is stopped
+// Parameters: rule - edge to relay mapping
+// Returns: 1 if the rule is added, -1 if the table is full, the line is not an input or the engine runs
+int TriggerEngine::addRule(const TriggerRule& rule) {
+    bool single = rule.line == SERIAL_LINE_CTS || rule.line == SERIAL_LINE_DSR
+                  || rule.line == SERIAL_LINE_DCD || rule.line == SERIAL_LINE_RI;
+    if (running || rulecount >= MAXRULES || !single || !rule.relay)
+        return -1;
+    rules[rulecount++] = rule;
+    watched |= rule.line;
+    return 1;
+}
+
+// Starts the event thread
+// Returns: 1 if the thread runs, -1 if the lines cannot be read
+int TriggerEngine::start() {
+    if (running)
+        return 1;
+    SerialModemCounters counters;
+    counting = input->modemCounters(&counters) == 1; // Read before the lines, as waitModemChange does
+    int lines = input->modemLines();
+    if (lines < 0)
+        return -1;
+    initialized = false;
+    this->feed(lines, systemClock().now_us(), counting ? &counters : nullptr);
+    writer.start();
+    running = true;
+    worker = std::thread(&TriggerEngine::run, this);
+    return 1;
+}
+
+// Stops the event thread, waking it from its wait, then the writer once the
+// commands of the last edges are sent
+void TriggerEngine::stop() {
+    if (running) {
+        running = false;
+        input->interruptModemWait();
+        worker.join();
+    }
+    writer.stop();
+}
+
+// Waits until the commands of the edges seen so far are written
+// Parameters: milliseconds - maximum wait
+// Returns: true if nothing is left to write
+bool TriggerEngine::flush(unsigned long milliseconds) {
+    return writer.flush(milliseconds);
+}
+
+// Returns the earliest end of a debounce window, 0 when none is open
+uint64_t TriggerEngine::nextDeadline_us() {
+    uint64_t next = 0;
+    for (uint64_t end : lockout) {
+        if (end && (!next || end < next))
+            next = end;
+    }
+    return next;
+}
+
+// Processes a sample of the lines; called by the event thread, public so that
+// the debounce logic can be driven without hardware (the commands are still
+// written by the writer thread, see flush)
+// Parameters: lines - SERIAL_LINE_* bits read from the port
+//             now_us - time of the sample on the system clock
+//             counters - transition counters read just before the lines, or
+//                        nullptr when the driver has none: each line is then
+//                        taken to have moved at most once since the last sample
+// Returns: the number of edges reported to the rules
+int TriggerEngine::feed(int lines, uint64_t now_us, const SerialModemCounters* counters) {
+    lines &= watched;
+    if (!initialized) {
+        stable = raw = lines;
+        if (counters)
+            counted = *counters;
+        borrowed = 0;
+        initialized = true;
+        return 0;
+    }
+    int fired = 0;
+    for (int line = SERIAL_LINE_CTS; line <= SERIAL_LINE_RI; line <<= 1) {
+        if (!(watched & line))
+            continue;
+        int index = lineIndex(line);
+        bool moved = bool(lines & line) != bool(raw & line);
+        unsigned long transitions = moved;
+        if (counters && counters->transitions[index] >= counted.transitions[index]) { // Lower after a reopen
+            // A transition between the counter and line reads shows in the
+            // levels first: it is taken now and not counted again next time
+            transitions = counters->transitions[index] - counted.transitions[index];
+            if ((borrowed & line) && transitions)
+                transitions--;
+            borrowed &= ~line;
+            if ((transitions & 1) != moved) {
+                transitions++;
+                borrowed |= line;
+            }
+        }
+        // Replay the levels since the last sample: the level then, and one per transition
+        uint64_t& end = lockout[index];
+        bool level = raw & line;
+        for (unsigned long step = 0; step <= transitions; step++) {
+            if (step)
+                level = !level;
+            if (end && now_us < end) { // Inside the window: only count the bounce
+                if (step)
+                    metricAdd(bounces);
+                continue;
+            }
+            end = 0;
+            if (level != bool(stable & line)) { // Leading edge, or level changed during the window
+                stable ^= line;
+                this->fire(line, level, now_us);
+                fired++;
+            }
+        }
+    }
+    if (counters)
+        counted = *counters;
+    raw = lines;
+    return fired;
+}
+
+// Hands the rules matching an edge to the writer and opens the debounce window
+// Parameters: line - input line bit
+//             level - new level of the line
+//             detected_us - time the edge was seen
+void TriggerEngine::fire(int line, bool level, uint64_t detected_us) {
+    TRACE_SCOPE("trigger", line);
+    metricAdd(edges);
+    unsigned long window = 0;
+    RelayUpdate updates[MAXRULES];
+    int count = 0;
+    for (int k = 0; k < rulecount; k++) {
+        TriggerRule& rule = rules[k];
+        if (rule.line != line || !(rule.edge & (level ? TRIGGER_RISING : TRIGGER_FALLING)))
+            continue;
+        if (rule.debounce_us > window)
+            window = rule.debounce_us;
+        updates[count++] = {rule.relay, rule.setmask, rule.clearmask};
+    }
+    if (count) {
+        writer.start(); // Already running unless feed is driven directly
+        writer.submit(updates, count, detected_us, &edgetowire); // Merged per board, never waits for a board
+    }
+    uint64_t& end = lockout[lineIndex(line)];
+    end = window ? detected_us + window : 0;
+}
+
+// Event loop: sleeps in waitModemChange until a watched line moves, a
+// debounce window closes or stop() interrupts the wait
+void TriggerEngine::run() {
+    while (running) {
+        unsigned int timeout_ms = 0; // No window open: nothing to do before a line moves
+        uint64_t next = this->nextDeadline_us();
+        if (next) {
+            uint64_t now = systemClock().now_us();
+            timeout_ms = next > now ? (unsigned int)((next - now + 999) / 1000) : 1;
+        }
+        int lines = 0;
+        SerialModemCounters counters = counted; // Changes since the last sample end the wait at once
+        if (input->waitModemChange(watched, timeout_ms, &lines, counting ? &counters : nullptr) < 0) {
+            systemClock().sleep_us(50000); // Port lost, retry every 50 ms
+            continue;
+        }
+        this->feed(lines, systemClock().now_us(), counting ? &counters : nullptr);
+    }
+}
+
+// Returns the latency between an edge and the write of the resulting command
+const LatencyHistogram& TriggerEngine::getEdgeToWire() {
+    return edgetowire;
+}
+
+// Returns the number of edges reported to the rules
+uint64_t TriggerEngine::getEdges() {
+    return edges.load(std::memory_order_relaxed);
+}
+
+// Returns the number of transitions ignored inside debounce windows
+uint64_t TriggerEngine::getBounces() {
+    return bounces.load(std::memory_order_relaxed);
+}
@@ -3,6 +3,10 @@
 #include <iostream>
 #include <cstdio>
 #include <serialib.hpp>
+#include <tracing.hpp>
+#include <usdt.hpp>
+#include <chrono>
+#include <algorithm>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -25,23 +29,49 @@ void os_sleep(unsigned long milliseconds) {
 #endif
 }
 
+// Returns a monotonic timestamp in nanoseconds for the stage timing
+uint64_t Usbrelay::stampNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 // Constructor for the Usbrelay class, initializes the port and relay number
 // Parameters: port - the communication port for the USB relay
 //             relaynumber - the number of relays on the device
-Usbrelay::Usbrelay(const std::string &port, int relaynumber) {
+//             boards - number of boards of that size chained on the port
+Usbrelay::Usbrelay(const std::string &port, int relaynumber, int boards) {
     this->device = port;
     this->baudrate = 9600; // Default baud rate
-    this->relaynumber = relaynumber;
+    this->boards = boards;
+    this->selectModel(relaynumber);
+}
+
+// Constructor for the Usbrelay class on a given transport (TCP, in-memory...)
+// Parameters: transport - link to the board, owned by the Usbrelay
+//             relaynumber - the number of relays on the device
+//             boards - number of boards of that size chained on the link
+Usbrelay::Usbrelay(std::unique_ptr<Transport> transport, int relaynumber, int boards) {
+    this->baudrate = 9600; // Default baud rate
+    this->boards = boards;
+    this->selectModel(relaynumber);
+    this->boardinterface = std::move(transport);
 }
 
 // Opens the communication with the USB relay device
 // Returns: 1 if the device is successfully opened, -1 otherwise
 int Usbrelay::openCom() {
-    this->boardinterface = std::make_unique<serialib>(); // Create a new serial interface
-    const char *device = this->device.c_str();
-    this->boardinterface->openDevice(device, baudrate); // Open device with baud rate
-    os_sleep(1); // Sleep for 1 millisecond
-    if (!this->boardinterface->isDeviceOpen()) { // Check if the device opened successfully
+    {
+        std::lock_guard<std::mutex> guard(linklock); // getLinkStats never sees the interface freed
+        if (!this->device.empty()) // Create a new interface for the device name (serial, tcp://, loop://)
+            this->boardinterface = makeTransport(this->device, baudrate);
+        if (!this->boardinterface)
+            return -1;
+        this->boardinterface->setClock(clock); // Share the board clock for read timeouts
+        this->boardinterface->setMetrics(&serialmetrics); // Keep serial counters across reconnections
+        this->boardinterface->open(); // Open device with baud rate
+    }
+    clock->sleep_ms(1); // Sleep for 1 millisecond
+    if (!this->boardinterface->isOpen()) { // Check if the device opened successfully
         return -1; // Return -1 if the device is not open
     }
     return 1; // Return 1 if the device is open
@@ -50,8 +80,11 @@ int Usbrelay::openCom() {
 // Closes the communication with the USB relay device
 // Returns: 1 if the device is successfully closed, -1 otherwise
 int Usbrelay::closeCom() {
-    this->boardinterface->closeDevice(); // Close the device
-    if (this->boardinterface->isDeviceOpen()) { // Check if the device closed successfully
+    std::lock_guard<std::mutex> guard(linklock);
+    if (!this->boardinterface)
+        return -1;
+    this->boardinterface->close(); // Close the device
+    if (this->boardinterface->isOpen()) { // Check if the device closed successfully
         return -1; // Return -1 if the device is still open
     }
     return 1; // Return 1 if the device is closed
@@ -60,8 +93,8 @@ int Usbrelay::closeCom() {
 // Adds a character to the receive buffer (FIFO style)
 // Parameters: elt - the character to add to the receive buffer
 void Usbrelay::bufferrxAdd(char elt) {
-    int length = sizeof(this->bufferrx);
-    for (int k = length - 1; k >= 0; k--) {
+    int length = this->bufferrx.size();
+    for (int k = length - 2; k >= 0; k--) {
         this->bufferrx[k + 1] = this->bufferrx[k]; // Shift elements to the right
     }
     this->bufferrx[0] = elt; // Add new element at the start
@@ -70,8 +103,8 @@ void Usbrelay::bufferrxAdd(char elt) {
 // Adds a character to the transmit buffer (FIFO style)
 // Parameters: elt - the character to add to the transmit buffer
 void Usbrelay::buffertxAdd(char elt) {
-    int length = sizeof(this->buffertx);
-    for (int k = length - 1; k >= 0; k--) {
+    int length = this->buffertx.size();
+    for (int k = length - 2; k >= 0; k--) {
         this->buffertx[k + 1] = this->buffertx[k]; // Shift elements to the right
     }
     this->buffertx[0] = elt; // Add new element at the start
@@ -82,9 +115,36 @@ void Usbrelay::buffertxAdd(char elt) {
 //             milliseconds - the number of milliseconds to wait after sending
 // Returns: 1 if the data is successfully written, -1 otherwise
 int Usbrelay::send(char data, unsigned long milliseconds) {
-    this->buffertxAdd(data); // Add data to transmit buffer
-    int status = this->boardinterface->writeChar(buffertx[0]); // Write data to device
-    os_sleep(milliseconds); // Sleep for the specified time
+    uint8_t byte = data;
+    return this->send(&byte, 1, milliseconds);
+}
+
+// Sends a command frame in one write and waits for the specified time
+// Parameters: frame - the bytes to send
+//             size - the number of bytes
+//             milliseconds - the number of milliseconds to wait after sending
+// Returns: 1 if the data is successfully written, -1 otherwise
+int Usbrelay::send(const uint8_t* frame, int size, unsigned long milliseconds) {
+    TRACE_SCOPE("send", frame[0]);
+    USDT_PROBE2(usbrelay, send_entry, frame[0], milliseconds);
+    for (int k = 0; k < size; k++)
+        this->buffertxAdd(frame[k]); // Add data to transmit buffer
+    uint64_t start = stampNs();
+    int status = this->boardinterface->write(frame, size); // Write data to device
+    uint64_t written = stampNs();
+    uint64_t pacingstart = clock->now_us();
+    if (wiretracking && status == 1) { // Wait until the bytes left the output queue
+        TRACE_SCOPE("drain", 0);
+        if (this->boardinterface->waitSent(milliseconds) == 1)
+            timing.wire_ns += stampNs() - written;
+    }
+    {
+        TRACE_SCOPE("pacing", milliseconds);
+        clock->sleepUntil_us(pacingstart + milliseconds * 1000); // Sleep for the remaining time
+    }
+    timing.write_ns += written - start;
+    timing.pacing_ns += stampNs() - written;
+    USDT_PROBE1(usbrelay, send_return, status);
     return status; // Return the status of the write operation
 }
 
@@ -92,22 +152,34 @@ int Usbrelay::send(char data, unsigned long milliseconds) {
 // Parameters: nbyte - the number of bytes to receive
 // Returns: 1 if the data is successfully read, -1 otherwise
 int Usbrelay::recieve(int nbyte) {
-    int status;
+    TRACE_SCOPE("recieve", nbyte);
+    USDT_PROBE1(usbrelay, recieve_entry, nbyte);
+    int status = -1;
+    uint64_t start = stampNs();
     for (int k = 1; k <= nbyte; k++) {
-        char tempbuffer[2];
-        status = this->boardinterface->readChar(tempbuffer, 500); // Read character with 500ms timeout
+        char tempbuffer[2] = {0, 0};
+        status = this->boardinterface->read(tempbuffer, 1, 500); // Read character with 500ms timeout
         this->bufferrxAdd(tempbuffer[0]); // Add received character to buffer
         if (status != 1) {
-            return status; // Return status if read operation failed
+            if (status == 0)
+                metricAdd(metrics.timeouts);
+            break; // Stop if read operation failed
         }
     }
+    timing.receive_ns += stampNs() - start;
+    USDT_PROBE2(usbrelay, recieve_return, status, (uint8_t)bufferrx[0]);
     return status; // Return status of the last read operation
 }
 
 // Returns the relay number of the USB relay
-// Returns: relaynumber - the number of relays on the device
+// Returns: the number of relays on the device, of all the boards for a chain
 int Usbrelay::getRelayNumber() {
-    return relaynumber;
+    return relaynumber * boards;
+}
+
+// Returns the number of boards chained on the port
+int Usbrelay::getBoardCount() {
+    return boards;
 }
 
 // Returns the communication speed (baud rate) of the USB relay
@@ -131,105 +203,269 @@ int Usbrelay::setPort(const std::string &port) {
 }
 
 
+// Sets the time source used for pacing and read timeouts
+// Parameters: clock - clock to use (not owned), nullptr restores the system clock
+void Usbrelay::setClock(Clock* clock) {
+    this->clock = clock ? clock : &systemClock();
+    if (this->boardinterface)
+        this->boardinterface->setClock(this->clock);
+}
+
+// Returns the time source used by the board
+// Returns: clock - the clock used for pacing and read timeouts
+Clock* Usbrelay::getClock() {
+    return clock;
+}
+
+
+// Returns the stage timing of the last setState or initBoard call
+// Returns: timing - durations of encoding, write, pacing and receive stages
+const RelayTiming& Usbrelay::getTiming() {
+    return timing;
+}
+
+// Returns the command counters and latency histograms of the board
+// Returns: metrics - counters updated by setState and initBoard
+const RelayMetrics& Usbrelay::getMetrics() {
+    return metrics;
+}
+
+// Returns the counters of the serial link of the board
+// Returns: serialmetrics - bytes, timeouts, errors and read waits of the port
+const SerialMetrics& Usbrelay::getSerialMetrics() {
+    return serialmetrics;
+}
+
+// Reads the kernel counters and queue depths of the serial link
+// Parameters: stats - filled snapshot
+// Returns: 1 counters and queues valid, 0 queues only, -1 if the port is not open
+// Safe to call from another thread (metrics exporter) while the board reconnects
+int Usbrelay::getLinkStats(SerialLinkStats* stats) {
+    std::lock_guard<std::mutex> guard(linklock);
+    if (!this->boardinterface)
+        return -1;
+    return this->boardinterface->linkStats(stats);
+}
+
+// Returns the link to the board, nullptr before openCom for device names
+Transport* Usbrelay::getTransport() {
+    return this->boardinterface.get();
+}
+
+// Enables tracking of the actual transmission of each command byte: after
+// the write, send waits (within the pacing delay) until the kernel output
+// queue is empty and records that time as the actuation time
+// Parameters: enabled - true to track the output queue
+void Usbrelay::setWireTracking(bool enabled) {
+    this->wiretracking = enabled;
+}
+
+// Records commands merged into another one before reaching the board, by a
+// caller queueing commands for it (multiplexer, reconciliation)
+// Parameters: commands - number of commands that did not cause a write
+void Usbrelay::countCoalesced(uint64_t commands) {
+    metricAdd(metrics.coalesced, commands);
+}
+
 // Initializes the USB relay board and sets the relay number based on the response
 // Returns: 1 if the board is successfully initialized, -1 otherwise
 int Usbrelay::initBoard() {
-    if (this->send(0x50, 200) != 1) // Send initialization command
+    std::lock_guard<std::recursive_mutex> guard(commandlock);
+    TRACE_SCOPE("initBoard", 0);
+    USDT_PROBE0(usbrelay, initboard_entry);
+    timing = RelayTiming();
+    uint64_t start = stampNs();
+    int status = this->handshake();
+    metrics.inithandshake.record((stampNs() - start) / 1000);
+    if (status != 1)
+        metricAdd(metrics.errors);
+    USDT_PROBE2(usbrelay, initboard_return, status, relaynumber);
+    return status;
+}
+
+// Runs the init sequence: identification request, answer, start command
+// Returns: 1 if the board answered and was started, -1 otherwise
+int Usbrelay::handshake() {
+    stateknown = false;
+    if (!handshaking) // Nothing to identify (LCUS), the first command sets every relay
+        return 1;
+    if (this->send(RelayBoardModel<8>::initrequest, 200) != 1) // Send initialization command
         return -1;
     if (this->recieve(1) != 1) // Receive response
         return -1;
     uint8_t data = this->bufferrx[0];
     data = static_cast<int>(data);
-    switch (data) { // Set relay number based on response
-        case 0xad:
-            this->relaynumber = 2;
-            if (this->send(0x51, 10) != 1) // Send additional initialization commands
-                return -1;
-            if (this->send(0xff, 10) != 1)
-                return -1;
+    TRACE_INSTANT("init.identified", data);
+    switch (data) { // Set relay number based on response, the chained boards are of the same size
+        case RelayBoardModel<2>::identifier:
+            this->selectModel(2);
+            break;
+        case RelayBoardModel<4>::identifier:
+            this->selectModel(4);
+            break;
+        case RelayBoardModel<8>::identifier:
+            this->selectModel(8);
             break;
-        case 0xab:
-            this->relaynumber = 4;
-            if (this->send(0x51, 10) != 1)
-                return -1;
-            if (this->send(0xff, 10) != 1)
-                return -1;
+#if defined (USBRELAY_HYPOTHETICAL_MODELS)
+        case RelayBoardModel<16>::identifier:
+            this->selectModel(16);
             break;
-        case 0xac:
-            this->relaynumber = 8;
-            if (this->send(0x51, 10) != 1)
-                return -1;
-            if (this->send(0xff, 10) != 1)
-                return -1;
+        case RelayBoardModel<32>::identifier:
+            this->selectModel(32);
             break;
+#endif
+        default:
+            return 1;
     }
+    if (this->send(RelayBoardModel<8>::startcommand, 10) != 1) // Send additional initialization commands
+        return -1;
+    // One start byte, as on the known boards; hypothetical wide frames get one per frame byte
+    uint8_t startframe[RELAY_MAX_FRAME] = {RelayBoardModel<8>::startstate, RelayBoardModel<8>::startstate,
+                                            RelayBoardModel<8>::startstate, RelayBoardModel<8>::startstate};
+    if (this->send(startframe, format.framebytes, 10) != 1) // One start byte per state byte
+        return -1;
+    this->state = format.decode(startframe);
     return 1; // Return 1 if initialization is successful
 }
 
+// Selects the command frame format of a board size
+// Parameters: relaynumber - number of relays of each board
+void Usbrelay::selectModel(int relaynumber) {
+    this->relaynumber = relayBoardSize(relaynumber);
+    this->boards = relayChainLength(this->relaynumber, boards);
+    this->format = RelayFrameFormat::of(this->relaynumber, boards);
+}
+
+// Selects the command protocol of the board
+// Parameters: protocol - RELAY_PROTOCOL_MASK (default) or RELAY_PROTOCOL_LCUS
+void Usbrelay::setProtocol(RelayProtocol protocol) {
+    this->protocol = protocol;
+    this->encodecommand = protocol == RELAY_PROTOCOL_LCUS ? LcusProtocol::encode : MaskProtocol::encode;
+    this->handshaking = protocol == RELAY_PROTOCOL_LCUS ? LcusProtocol::handshake : MaskProtocol::handshake;
+    this->stateknown = false;
+}
+
+// Returns the command protocol of the board
+RelayProtocol Usbrelay::getProtocol() {
+    return protocol;
+}
+
+// Returns the relays to include in a command for a new state: those that
+// changed, or all of them while the board state is unknown
+RelayMask Usbrelay::changedRelays(RelayMask state) {
+    return stateknown ? (state ^ this->state) & format.mask : format.mask;
+}
+
+// Sends an encoded state and records its timing and metrics
+// Parameters: state - relay state, kept for getMask
+//             command - command bytes of the state, sent in one write
+//             size - number of bytes, 0 if the board already holds the state
+//             start - stampNs() before encoding
+//             probe - state passed to the entry probe, -1 for arrays
+// Returns: 1 if the state is successfully set, -1 otherwise
+int Usbrelay::sendState(RelayMask state, const uint8_t* command, int size, uint64_t start, int probe) {
+    TRACE_SCOPE("setState", probe & 0xff);
+    USDT_PROBE1(usbrelay, setstate_entry, probe);
+    timing = RelayTiming();
+    timing.encode_ns = stampNs() - start;
+    this->state = state;
+    if (size == 0) { // Nothing changed for a protocol sending the changes only
+        metricAdd(metrics.commands);
+        USDT_PROBE2(usbrelay, setstate_return, 1, 0);
+        return 1;
+    }
+    if (send(command, size, 50) != 1) {
+        stateknown = false;
+        metricAdd(metrics.errors);
+        USDT_PROBE2(usbrelay, setstate_return, -1, command[0]);
+        return -1;
+    }
+    stateknown = true;
+    metricAdd(metrics.commands);
+    metrics.submittowire.record((timing.encode_ns + timing.write_ns) / 1000);
+    if (timing.wire_ns)
+        metrics.submittoactuation.record((timing.encode_ns + timing.write_ns + timing.wire_ns) / 1000);
+    USDT_PROBE2(usbrelay, setstate_return, 1, command[0]);
+    return 1; // Return 1 if the state is successfully set
+}
+
 // Sets the state of the relays using a command integer
 // Parameters: command - the command to set the state of the relays
 // Returns: 1 if the state is successfully set, -1 otherwise
 int Usbrelay::setState(int command) {
-    uint8_t com;
-    switch (relaynumber) {
-        case 2:
-            com = command & 3; // Set state for 2 relays boards
-            if (send(com, 50) != 1)
-                return -1;
-            break;
-        default:
-            com = ~command; // Set state for more than 2 relays boards
-            if (send(com, 50) != 1)
-                return -1;
-            break;
-    }
-    return 1; // Return 1 if the state is successfully set
+    return this->setMask(RelayMask(command));
 }
 
 // Sets the state of the relays using a command array
 // Parameters: commandarray - array of commands to set the state of each relay
 // Returns: 1 if the state is successfully set, -1 otherwise
 int Usbrelay::setState(int commandarray[]) {
-    uint8_t com;
-    switch (relaynumber) {
-        case 2:
-            com = commandarray[this->relaynumber - 1]; // Set state for 2 relays boards
-            for (int k = this->relaynumber - 2; k >= 0; k--) {
-                if (commandarray[k] == 1) {
-                    com = com << 1;
-                    com++;
-                } else {
-                    com = com << 1;
-                }
-            }
-            if (this->send(com, 50) != 1)
-                return -1;
-            break;
-        default:
-            com = !commandarray[this->relaynumber - 1]; // Set state for more than 2 relays boards
-            for (int k = this->relaynumber - 2; k >= 0; k--) {
-                if (commandarray[k] == 0) {
-                    com = com << 1;
-                    com++;
-                } else {
-                    com = com << 1;
-                }
-            }
-            if (this->send(com, 50) != 1)
-                return -1;
-            break;
-    }
-    return 1; // Return 1 if the state is successfully set
+    RelayMask state = 0;
+    int relays = std::min(this->getRelayNumber(), 32);
+    packRelays(std::span<const int>(commandarray, relays), relays, std::span<RelayMask>(&state, 1));
+    return this->command(state, -1);
+}
+
+// Sets the state of every relay of the board or chain
+// Parameters: state - bit k switches relay k+1 on
+// Returns: 1 if the state is successfully set, -1 otherwise
+int Usbrelay::setMask(RelayMask state) {
+    return this->command(state, (int)state);
+}
+
+// Sets the state of every relay, sending all of them even when the board is
+// believed to hold some already (LCUS boards are otherwise sent the changed
+// relays only), to undo changes the host did not see
+// Parameters: state - bit k switches relay k+1 on
+// Returns: 1 if the state is successfully set, -1 otherwise
+int Usbrelay::forceMask(RelayMask state) {
+    std::lock_guard<std::recursive_mutex> guard(commandlock);
+    stateknown = false;
+    return this->command(state, (int)state);
+}
+
+// Encodes and sends a state with the protocol of the board
+// Parameters: state - relay state
+//             probe - state passed to the entry probe, -1 for arrays
+// Returns: 1 if the state is successfully set, -1 otherwise
+int Usbrelay::command(RelayMask state, int probe) {
+    std::lock_guard<std::recursive_mutex> guard(commandlock);
+    uint64_t start = stampNs();
+    uint8_t command[RELAY_MAX_COMMAND];
+    state &= format.mask;
+    int size = encodecommand(format, this->changedRelays(state), state, command);
+    return this->sendState(state, command, size, start, probe);
+}
+
+// Switches some relays on and others off, keeping the rest as last set
+// Parameters: setmask - relays to switch on (bit k = relay k+1)
+//             clearmask - relays to switch off
+// Returns: 1 if the state is successfully set, -1 otherwise
+int Usbrelay::updateState(uint8_t setmask, uint8_t clearmask) {
+    return this->updateMask(setmask, clearmask);
+}
+
+// Switches some relays on and others off on a board or chain of any size
+// Parameters: setmask - relays to switch on (bit k = relay k+1)
+//             clearmask - relays to switch off
+// Returns: 1 if the state is successfully set, -1 otherwise
+// Safe against commands of other threads: the read of the current state and
+// the write are done under the command lock
+int Usbrelay::updateMask(RelayMask setmask, RelayMask clearmask) {
+    std::lock_guard<std::recursive_mutex> guard(commandlock);
+    return this->setMask((state | setmask) & ~clearmask);
 }
 
 // Returns the current state of the relay(s)
-// Returns: the state of the relay(s) as a character
+// Returns: the state of the relays 1 to 8 as a character
 char Usbrelay::getState() {
-    if (relaynumber == 2) {
-        return buffertx[0]; // Return state for 2 relays boards
-    } else {
-        return ~buffertx[0]; // Return state for more than 2 relays boards
-    }
+    return (char)state;
+}
+
+// Returns the state last sent to the board or chain
+// Returns: bit k set when relay k+1 is on
+RelayMask Usbrelay::getMask() {
+    return state;
 }
 
 // Returns the last received character from the receive buffer
@@ -270,3 +506,10 @@ std::bitset<8> charToBitset(char mychar) {
     std::bitset<8> mybitset(mychar);
     return mybitset;
 }
+
+// Converts a relay state of up to 32 relays to a bitset
+// Parameters: mask - the state, bit k = relay k+1
+// Returns: a bitset of 32 bits representing the state
+std::bitset<32> maskToBitset(RelayMask mask) {
+    return std::bitset<32>(mask);
+}